@@ -0,0 +1,155 @@
+// Microbenchmarks of the ring core (is18_ring.h) in user space, no module
+// and no root needed:
+//   make bench-core
+// Single threaded: one write plus one read of a message, ns per op and
+// cycles per byte. Two threads: one producer and one consumer streaming
+// through the ring, as the driver does in SPSC mode (without the syscalls).
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h> //__rdtsc
+#endif
+
+#include "is18_ring.h"
+
+#define RING_SIZE (64 * 1024)
+#define SINGLE_BYTES (64 * 1024 * 1024)   // bytes per single threaded run
+#define STREAM_BYTES (256 * 1024 * 1024)  // bytes per streaming run
+
+struct stream_args {
+    struct is18_ring_ctrl* ctrl;
+    char* ring;
+    size_t msg_size;
+    int cpu;  // -1: not pinned
+};
+
+static unsigned long long cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;  // no cycle counter, only ns are reported
+#endif
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void pin(int cpu) {
+    cpu_set_t cpus;
+
+    if (cpu < 0) {
+        return;
+    }
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    sched_setaffinity(0, sizeof(cpus), &cpus);
+}
+
+// one write and one read per message, the ring never fills up
+static void bench_single(size_t msg_size) {
+    static char ring[RING_SIZE];
+    static struct is18_ring_ctrl ctrl;
+    char* msg = calloc(1, msg_size);
+    size_t ops = SINGLE_BYTES / msg_size;
+    unsigned long long c0;
+    double t0;
+
+    if (!msg) {
+        return;
+    }
+    is18_core_reset(&ctrl);
+    t0 = now_ns();
+    c0 = cycles();
+    for (size_t i = 0; i < ops; ++i) {
+        is18_core_write(&ctrl, ring, RING_SIZE, msg, msg_size);
+        is18_core_read(&ctrl, ring, RING_SIZE, msg, msg_size);
+    }
+    double ns = now_ns() - t0;
+    unsigned long long c = cycles() - c0;
+
+    printf("%-10s %10zu %12.1f %14.3f %12.1f\n", "single", msg_size, ns / ops,
+           (double)c / ((double)ops * msg_size), ops * msg_size / ns * 1e3);
+    free(msg);
+}
+
+static void* stream_producer(void* args) {
+    struct stream_args* a = (struct stream_args*)args;
+    char* msg = calloc(1, a->msg_size);
+    size_t sent = 0;
+
+    pin(a->cpu);
+    while (msg && sent < STREAM_BYTES) {
+        size_t done = is18_core_write(a->ctrl, a->ring, RING_SIZE, msg, a->msg_size);
+
+        if (!done) {
+            sched_yield();  // full, the consumer may share our cpu
+        }
+        sent += done;
+    }
+    free(msg);
+    return NULL;
+}
+
+// producer thread and consumer (this thread) on different cpus
+static void bench_stream(size_t msg_size, int producer_cpu, int consumer_cpu) {
+    static char ring[RING_SIZE];
+    static struct is18_ring_ctrl ctrl;
+    struct stream_args args = {&ctrl, ring, msg_size, producer_cpu};
+    char* msg = calloc(1, msg_size);
+    size_t received = 0;
+    unsigned long long c0;
+    pthread_t id;
+    double t0;
+
+    if (!msg) {
+        return;
+    }
+    is18_core_reset(&ctrl);
+    pin(consumer_cpu);
+    t0 = now_ns();
+    c0 = cycles();
+    pthread_create(&id, NULL, stream_producer, &args);
+    while (received < STREAM_BYTES) {
+        size_t done = is18_core_read(&ctrl, ring, RING_SIZE, msg, msg_size);
+
+        if (!done) {
+            sched_yield();  // empty, the producer may share our cpu
+        }
+        received += done;
+    }
+    pthread_join(id, NULL);
+    double ns = now_ns() - t0;
+    unsigned long long c = cycles() - c0;
+    size_t ops = received / msg_size;
+
+    printf("%-10s %10zu %12.1f %14.3f %12.1f\n", "stream", msg_size, ns / ops, (double)c / received,
+           received / ns * 1e3);
+    free(msg);
+}
+
+// ./bench_core [producer cpu] [consumer cpu]
+int main(int argc, char** argv) {
+    static const size_t sizes[] = {1, 8, 64, 512, 4096, 32 * 1024};
+    int producer_cpu = argc > 1 ? atoi(argv[1]) : -1;
+    int consumer_cpu = argc > 2 ? atoi(argv[2]) : -1;
+
+    printf("ring core, ring size %d, cycles are TSC ticks (0 without a TSC)\n", RING_SIZE);
+    printf("%-10s %10s %12s %14s %12s\n", "run", "msg size", "ns/op", "cycles/byte", "MB/s");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        bench_single(sizes[i]);
+    }
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        if (sizes[i] >= 64) {
+            bench_stream(sizes[i], producer_cpu, consumer_cpu);
+        }
+    }
+    return 0;
+}
@@ -1,6 +1,8 @@
 #ifndef IS18_IOCTL_H
 #define IS18_IOCTL_H
 
+#include <linux/types.h>
+
 // see: http://git.kernel.org/cgit/linux/kernel/git/stable/linux-stable.git/plain/Documentation/ioctl/ioctl-number.txt?id=HEAD
 #define IS18_IOC_MY_MAGIC 0xCE // freie Nummer laut link (oberhalb)
 
@@ -11,12 +13,325 @@
 #define IS18_IOC_NR_READ_INDEX 9            // current buffer position for reading
 #define IS18_IOC_NR_WRITE_INDEX 10          // current buffer position for writing
 #define IS18_IOC_NR_NUM_BUFFERED_BYTES 11   // numer of bytes which are stored in the buffer
+#define IS18_IOC_NR_BUFFER_SIZE 12          // current size of the ring buffer
+#define IS18_IOC_NR_SET_BUFFER_SIZE 13      // resize the ring buffer (only while it is empty)
+#define IS18_IOC_NR_RING_NOTIFY 14          // user space moved head or tail of a mapped ring
+#define IS18_IOC_NR_PACKET_MODE 15          // 1 if the device is in packet mode
+#define IS18_IOC_NR_SET_PACKET_MODE 16      // switch between byte stream and packet mode (only while it is empty)
+#define IS18_IOC_NR_READ_BATCH 17           // read a batch of whole messages in packet mode
+#define IS18_IOC_NR_SEND_MMSG 18            // write many records with one call
+#define IS18_IOC_NR_RECV_MMSG 19            // read many records with one call
+#define IS18_IOC_NR_STATS 20                // statistics of the device
+#define IS18_IOC_NR_RESET_LATENCY 21        // clear the latency histograms of the device
+#define IS18_IOC_NR_CREATE_DEVICE 22        // /dev/is18ctl: create a device
+#define IS18_IOC_NR_DESTROY_DEVICE 23       // /dev/is18ctl: remove a device
+#define IS18_IOC_NR_NUMA_NODE 24            // NUMA node of the ring
+#define IS18_IOC_NR_SET_NUMA_NODE 25        // move the ring to a NUMA node (only while it is empty)
+#define IS18_IOC_NR_BROADCAST 26            // broadcast mode of the device
+#define IS18_IOC_NR_SET_BROADCAST 27        // switch broadcast mode (only while the ring is empty)
+#define IS18_IOC_NR_DROPPED 28              // bytes a lossy broadcast reader lost
+#define IS18_IOC_NR_MPSC 29                 // multi producer mode of the device
+#define IS18_IOC_NR_SET_MPSC 30             // switch multi producer mode (only while the ring is empty)
+#define IS18_IOC_NR_OVERWRITE 31            // overwrite mode of the device
+#define IS18_IOC_NR_SET_OVERWRITE 32        // switch overwrite mode
+#define IS18_IOC_NR_ZEROCOPY 33             // minimum size of zero copy writes
+#define IS18_IOC_NR_SET_ZEROCOPY 34         // switch zero copy writes on/off
+#define IS18_IOC_NR_BUSY_POLL 35            // busy poll time of this fd
+#define IS18_IOC_NR_SET_BUSY_POLL 36        // set the busy poll time of this fd
+#define IS18_IOC_NR_WAKEUP 37               // wakeup thresholds of this fd
+#define IS18_IOC_NR_SET_WAKEUP 38           // set the wakeup thresholds of this fd
+#define IS18_IOC_NR_PEEK 39                 // copy unread bytes without consuming them
 
 #define IS18_IOC_READ_INDEX _IO(IS18_IOC_MY_MAGIC, IS18_IOC_NR_READ_INDEX)
 #define IS18_IOC_WRITE_INDEX _IO(IS18_IOC_MY_MAGIC, IS18_IOC_NR_WRITE_INDEX)
 #define IS18_IOC_EMPTY_BUFFER _IO(IS18_IOC_MY_MAGIC, IS18_IOC_NR_EMPTY_BUFFER)
 #define IS18_IOC_NUM_BUFFERED_BYTES _IO(IS18_IOC_MY_MAGIC, IS18_IOC_NR_NUM_BUFFERED_BYTES)
 #define IS18_IOC_OPENWRITECNT _IO(IS18_IOC_MY_MAGIC, IS18_IOC_NR_OPENWRITECNT)
+#define IS18_IOC_BUFFER_SIZE _IO(IS18_IOC_MY_MAGIC, IS18_IOC_NR_BUFFER_SIZE)
+
+// new ring size in bytes is passed per address:
+// int size = 4096;
+// ioctl(fd, IS18_IOC_SET_BUFFER_SIZE, &size);
+// fails with EBUSY as long as there are bytes in the buffer
+#define IS18_IOC_SET_BUFFER_SIZE _IOW(IS18_IOC_MY_MAGIC, IS18_IOC_NR_SET_BUFFER_SIZE, int)
+
+// The ring lives on the NUMA node of the first writer unless a node is set
+// (module parameter numa_node or per device):
+// int node = 1; // -1: node of the caller
+// ioctl(fd, IS18_IOC_SET_NUMA_NODE, &node);
+// fails with EBUSY as long as there are bytes in the buffer or it is mapped,
+// EINVAL for a node which is not online.
+// IS18_IOC_NUMA_NODE returns the node the ring pages are on. Producer and
+// consumer should run on the CPUs of that node, see /proc/is18/info.
+#define IS18_IOC_NUMA_NODE _IO(IS18_IOC_MY_MAGIC, IS18_IOC_NR_NUMA_NODE)
+#define IS18_IOC_SET_NUMA_NODE _IOW(IS18_IOC_MY_MAGIC, IS18_IOC_NR_SET_NUMA_NODE, int)
+
+/*
+ * mmap of a device (MAP_SHARED only):
+ * page offset IS18_MMAP_CTRL_PGOFF is the control page (struct is18_ring_ctrl),
+ * the ring data starts at page offset IS18_MMAP_DATA_PGOFF. Both can be
+ * mapped with a single mmap starting at offset 0.
+ *
+ * head and tail are free running counters, the position in the data area is
+ * counter & (buffer_size - 1). A producer writes the data first and publishes
+ * it by storing head with release semantics, a consumer loads head with
+ * acquire semantics, copies the data and stores tail with release semantics.
+ * Only one producer and one consumer may work on a ring at the same time,
+ * a mapping producer replaces write() and a mapping consumer replaces read().
+ *
+ * The driver sets reader_waiting/writer_waiting before it sleeps in read(),
+ * write() or poll(). After publishing head or tail, user space calls
+ * ioctl(fd, IS18_IOC_RING_NOTIFY) if the flag of the other side is set.
+ */
+#define IS18_MMAP_CTRL_PGOFF 0
+#define IS18_MMAP_DATA_PGOFF 1
+
+struct is18_ring_ctrl {
+    __u32 head;             // written by the producer
+    __u32 reserved1[15];    // head and tail in separate cache lines
+    __u32 tail;             // written by the consumer
+    __u32 reserved2[15];
+    __u32 buffer_size;      // size of the data area in bytes (power of two), read only
+    __u32 reader_waiting;   // a reader sleeps until head moves
+    __u32 writer_waiting;   // a writer sleeps until tail moves
+};
+
+#define IS18_IOC_RING_NOTIFY _IO(IS18_IOC_MY_MAGIC, IS18_IOC_NR_RING_NOTIFY)
+
+/*
+ * packet mode: every write() stores one message, every read() returns one
+ * message. A message that does not fit into the read buffer is truncated,
+ * the rest of it is discarded (like a pipe opened with O_DIRECT).
+ * Writes are all or nothing, a message larger than the ring minus
+ * IS18_PACKET_HDR_SIZE fails with EMSGSIZE. mmap and splice are not
+ * supported in packet mode.
+ *
+ * int packet = 1;
+ * ioctl(fd, IS18_IOC_SET_PACKET_MODE, &packet);
+ * fails with EBUSY as long as there are bytes in the buffer or it is mapped
+ */
+#define IS18_PACKET_HDR_SIZE sizeof(__u32)
+
+#define IS18_IOC_PACKET_MODE _IO(IS18_IOC_MY_MAGIC, IS18_IOC_NR_PACKET_MODE)
+#define IS18_IOC_SET_PACKET_MODE _IOW(IS18_IOC_MY_MAGIC, IS18_IOC_NR_SET_PACKET_MODE, int)
+
+// IS18_IOC_READ_BATCH copies as many whole messages as fit into buf, each
+// one as __u32 length followed by the payload. Blocks like read() until
+// there is at least one message, EMSGSIZE if the first one does not fit.
+// Returns the number of bytes copied to buf.
+struct is18_batch {
+    __u64 buf;      // user space buffer
+    __u32 len;      // size of buf in bytes
+    __u32 count;    // returns the number of messages copied to buf
+};
+
+#define IS18_IOC_READ_BATCH _IOWR(IS18_IOC_MY_MAGIC, IS18_IOC_NR_READ_BATCH, struct is18_batch)
+
+/*
+ * sendmmsg/recvmmsg style batches of small records: one call, one lock
+ * hold and one wakeup of the other side for up to IS18_MMSG_MAX records.
+ * A record is always transferred as a whole. In packet mode every record is
+ * one message, in byte stream mode a record is just len bytes.
+ * The calls block until the first record is done (EAGAIN for nonblocking
+ * files), then transfer as many of the remaining records as possible.
+ * Both return the number of completed records, result of each completed
+ * descriptor is set to the number of transferred bytes.
+ *
+ * struct is18_msg recs[64] = {...};
+ * struct is18_mmsg mmsg = {(unsigned long)recs, 64, 0};
+ * int sent = ioctl(fd, IS18_IOC_SEND_MMSG, &mmsg);
+ */
+#define IS18_MMSG_MAX 1024
+
+struct is18_msg {
+    __u64 buf;      // user space buffer of the record
+    __u32 len;      // size of the record (send) or of buf (receive)
+    __u32 result;   // returns the number of bytes transferred
+};
+
+struct is18_mmsg {
+    __u64 msgs;     // array of struct is18_msg
+    __u32 vlen;     // number of entries in msgs
+    __u32 flags;    // reserved, must be 0
+};
+
+#define IS18_IOC_SEND_MMSG _IOWR(IS18_IOC_MY_MAGIC, IS18_IOC_NR_SEND_MMSG, struct is18_mmsg)
+#define IS18_IOC_RECV_MMSG _IOWR(IS18_IOC_MY_MAGIC, IS18_IOC_NR_RECV_MMSG, struct is18_mmsg)
+
+// statistics since the module was loaded, also in /proc/is18/info and /proc/is18/stats
+// struct is18_stats st;
+// ioctl(fd, IS18_IOC_STATS, &st);
+// New fields are only appended, version is incremented then. The driver
+// fills only as many bytes as the caller's struct has.
+#define IS18_STATS_VERSION 2
+
+struct is18_stats {
+    __u32 version;          // IS18_STATS_VERSION
+    __u32 size;             // sizeof(struct is18_stats) of the driver
+    __u64 bytes_in;         // bytes stored by writers
+    __u64 bytes_out;        // bytes taken by readers
+    __u64 reads;            // read syscalls (read, readv, splice, batch ioctls)
+    __u64 writes;           // write syscalls
+    __u64 read_blocked;     // times a reader slept on an empty ring
+    __u64 write_blocked;    // times a writer slept on a full ring
+    __u64 eagain;           // nonblocking calls that could not proceed (empty/full ring, lock taken)
+    __u64 enospc;           // nonblocking writes that returned ENOSPC
+    __u32 high_water;       // max number of bytes in the ring at once
+    __u32 reserved;
+    // version 2
+    __u64 overwritten;      // bytes dropped by writers in overwrite mode before a reader got them
+};
+
+#define IS18_IOC_STATS _IOR(IS18_IOC_MY_MAGIC, IS18_IOC_NR_STATS, struct is18_stats)
+
+// latency histograms (blocked on empty/full ring, residency of written bytes)
+// are in /proc/is18/latency, this clears them:
+// ioctl(fd, IS18_IOC_RESET_LATENCY);
+#define IS18_IOC_RESET_LATENCY _IO(IS18_IOC_MY_MAGIC, IS18_IOC_NR_RESET_LATENCY)
+
+/*
+ * Devices are created and removed at runtime with ioctls on the control
+ * device /dev/is18ctl (CAP_SYS_ADMIN). The minor number is passed per
+ * address, -1 for any free one:
+ * int minor = -1;
+ * ioctl(ctl, IS18_IOC_CREATE_DEVICE, &minor); // minor is set, /dev/is18dev<minor> exists
+ * ioctl(ctl, IS18_IOC_DESTROY_DEVICE, &minor);
+ * Create fails with EBUSY if the minor number is taken (ENOSPC if all are
+ * taken, see module parameter max_devices), destroy fails with EBUSY while
+ * the device is open and with ENODEV for an unknown minor number.
+ */
+#define IS18_CTL_DEVICE "/dev/is18ctl"
+
+#define IS18_IOC_CREATE_DEVICE _IOWR(IS18_IOC_MY_MAGIC, IS18_IOC_NR_CREATE_DEVICE, int)
+#define IS18_IOC_DESTROY_DEVICE _IOW(IS18_IOC_MY_MAGIC, IS18_IOC_NR_DESTROY_DEVICE, int)
+
+/*
+ * Broadcast mode (publish/subscribe): every reader fd has a cursor of its own
+ * and gets every byte written after it was opened, instead of the readers
+ * sharing the bytes between them.
+ *  IS18_BROADCAST_RELIABLE: a byte is removed from the ring once the slowest
+ *      reader has read it, the writer blocks on a ring full for the slowest reader.
+ *  IS18_BROADCAST_LOSSY: the writer never blocks, it overwrites the oldest
+ *      bytes and readers which are behind lose them. IS18_IOC_DROPPED returns
+ *      the number of bytes the calling fd lost so far.
+ * int mode = IS18_BROADCAST_RELIABLE;
+ * ioctl(fd, IS18_IOC_SET_BROADCAST, &mode);
+ * Fails with EBUSY while there are bytes in the ring, the ring is mapped or
+ * another writer is open (switch before the producer starts), with EINVAL in
+ * packet mode. mmap, IS18_IOC_RECV_MMSG and (in lossy mode) IS18_IOC_SEND_MMSG
+ * fail with EINVAL in broadcast mode.
+ * IS18_IOC_BROADCAST returns the mode.
+ */
+#define IS18_BROADCAST_OFF 0
+#define IS18_BROADCAST_RELIABLE 1
+#define IS18_BROADCAST_LOSSY 2
+
+#define IS18_IOC_BROADCAST _IO(IS18_IOC_MY_MAGIC, IS18_IOC_NR_BROADCAST)
+#define IS18_IOC_SET_BROADCAST _IOW(IS18_IOC_MY_MAGIC, IS18_IOC_NR_SET_BROADCAST, int)
+#define IS18_IOC_DROPPED _IOR(IS18_IOC_MY_MAGIC, IS18_IOC_NR_DROPPED, __u64)
+
+/*
+ * Multi producer (MPSC) mode: writers of different fds don't serialise on a
+ * lock, every write reserves its space in the ring with an atomic operation,
+ * copies without a lock and is published in the order of the reservations.
+ * A write of at most the ring size never interleaves with other writes.
+ * int on = 1;
+ * ioctl(fd, IS18_IOC_SET_MPSC, &on);
+ * Fails with EBUSY while there are bytes in the ring, the ring is mapped or
+ * another writer is open (switch before the producers start), with EINVAL in
+ * lossy broadcast mode. mmap and IS18_IOC_SEND_MMSG fail with EINVAL in MPSC mode.
+ * IS18_IOC_MPSC returns 1 in MPSC mode.
+ */
+#define IS18_IOC_MPSC _IO(IS18_IOC_MY_MAGIC, IS18_IOC_NR_MPSC)
+#define IS18_IOC_SET_MPSC _IOW(IS18_IOC_MY_MAGIC, IS18_IOC_NR_SET_MPSC, int)
+
+/*
+ * Overwrite mode (flight recorder): writes never wait for space and never
+ * fail with ENOSPC, the oldest bytes (in packet mode the oldest whole
+ * messages) are dropped to make room. The dropped bytes are counted in
+ * struct is18_stats.overwritten and /proc/is18/info. Writers only serialise
+ * among themselves, they never wait for a reader, however many fds are open.
+ * int on = 1;
+ * ioctl(fd, IS18_IOC_SET_OVERWRITE, &on);
+ * Fails with EINVAL in broadcast and MPSC mode, with EBUSY while the ring is
+ * mapped. mmap, IS18_IOC_SEND_MMSG and IS18_IOC_RECV_MMSG fail with EINVAL in
+ * overwrite mode.
+ * IS18_IOC_OVERWRITE returns 1 in overwrite mode.
+ */
+#define IS18_IOC_OVERWRITE _IO(IS18_IOC_MY_MAGIC, IS18_IOC_NR_OVERWRITE)
+#define IS18_IOC_SET_OVERWRITE _IOW(IS18_IOC_MY_MAGIC, IS18_IOC_NR_SET_OVERWRITE, int)
+
+/*
+ * Zero copy writes: a blocking write() of at least min bytes is not copied
+ * into the ring, a reference is taken on its pages and the reader copies
+ * straight from them (one copy instead of two). The write returns once the readers took all
+ * of it, the order with the other writes is kept. Smaller and nonblocking
+ * writes use the ring.
+ * int min = 64 * 1024; // 0: off, otherwise at least the page size
+ * ioctl(fd, IS18_IOC_SET_ZEROCOPY, &min);
+ * Fails with EINVAL in packet, broadcast, MPSC and overwrite mode, with EBUSY
+ * while the ring is mapped. mmap and IS18_IOC_RECV_MMSG fail with EINVAL
+ * while zero copy writes are on.
+ * IS18_IOC_ZEROCOPY returns min.
+ */
+#define IS18_IOC_ZEROCOPY _IO(IS18_IOC_MY_MAGIC, IS18_IOC_NR_ZEROCOPY)
+#define IS18_IOC_SET_ZEROCOPY _IOW(IS18_IOC_MY_MAGIC, IS18_IOC_NR_SET_ZEROCOPY, int)
+
+/*
+ * Busy poll: a read() on an empty or a write() on a full ring spins up to
+ * us microseconds for the other side before it sleeps, like SO_BUSY_POLL.
+ * Saves the sleep and wakeup of a fast handoff, costs CPU time while spinning.
+ * Applies to the calling fd only, new fds start with the module parameter busy_poll.
+ * int us = 50; // 0: off, at most IS18_BUSY_POLL_MAX
+ * ioctl(fd, IS18_IOC_SET_BUSY_POLL, &us);
+ * IS18_IOC_BUSY_POLL returns us.
+ */
+#define IS18_BUSY_POLL_MAX 1000000
+#define IS18_IOC_BUSY_POLL _IO(IS18_IOC_MY_MAGIC, IS18_IOC_NR_BUSY_POLL)
+#define IS18_IOC_SET_BUSY_POLL _IOW(IS18_IOC_MY_MAGIC, IS18_IOC_NR_SET_BUSY_POLL, int)
+
+/*
+ * Wakeup thresholds (SO_RCVLOWAT/SO_SNDLOWAT, VMIN/VTIME of a terminal): a
+ * blocked read() is not woken before rcvlowat bytes are in the ring (at most
+ * the requested count or the ring size), unless rcvdelay_us passed since the
+ * read() began - then it returns whatever it got (an empty ring: the next
+ * bytes at once). A blocked write() is not woken before sndlowat bytes are free.
+ * Fewer wakeups of a trickling producer for a bounded latency. Nonblocking calls and poll() are not affected.
+ * Applies to the calling fd only, 0 is the default (wake at once, no delay).
+ * struct is18_wakeup w = {.rcvlowat = 4096, .rcvdelay_us = 1000};
+ * ioctl(fd, IS18_IOC_SET_WAKEUP, &w);
+ * IS18_IOC_WAKEUP reads the thresholds back.
+ */
+struct is18_wakeup {
+    __u32 rcvlowat;     // bytes a blocked reader waits for
+    __u32 rcvdelay_us;  // a blocked reader returns what it has after this time, 0: never
+    __u32 sndlowat;     // free bytes a blocked writer waits for
+};
+
+#define IS18_WAKEUP_DELAY_MAX 10000000
+#define IS18_IOC_WAKEUP _IOR(IS18_IOC_MY_MAGIC, IS18_IOC_NR_WAKEUP, struct is18_wakeup)
+#define IS18_IOC_SET_WAKEUP _IOW(IS18_IOC_MY_MAGIC, IS18_IOC_NR_SET_WAKEUP, struct is18_wakeup)
+
+/*
+ * Peek: copies up to len unread bytes, starting offset bytes after the read
+ * position of the fd, to buf without consuming them - a parser may look at a
+ * header before it reads or drops the bytes (IS18_IOC_DEL_COUNT). Never
+ * blocks, returns the number of copied bytes (0 if there are no more than
+ * offset unread bytes) and sets avail to the number of unread bytes. In
+ * packet mode the bytes include the IS18_PACKET_HDR_SIZE length of each message.
+ * char hdr[16];
+ * struct is18_peek peek = {(unsigned long)hdr, sizeof(hdr), 0, 0};
+ * int n = ioctl(fd, IS18_IOC_PEEK, &peek);
+ */
+struct is18_peek {
+    __u64 buf;      // user space buffer
+    __u32 len;      // size of buf in bytes
+    __u32 offset;   // unread bytes to skip first
+    __u32 avail;    // returns the number of unread bytes
+    __u32 flags;    // reserved, must be 0
+};
+
+#define IS18_IOC_PEEK _IOWR(IS18_IOC_MY_MAGIC, IS18_IOC_NR_PEEK, struct is18_peek)
 
 
 // makro erklaerung siehe: Linux Device Drivers (eCampus pdf Buch) S.138 (pdf 156)
@@ -44,20 +359,23 @@ der Verwendung von ioctl als dritter Parameter verwendet werden muss. (per addre
 Dass ein dritter Parameter bei ioctl verwendet werden muss,
 kann durch die Makros _IOW, _IOR und _IORW bestimmt werden. _IO hingegen
 bedeutet, dass kein Puffer beim dritten Parameter verwendet wird (siehe is18_IOC_OPENREADCNT).
-Fiktives Beispiel (nur zur Erklaerung. Muss euer Treiber nicht unterstuetzen!!!!):
-Bsp: Per "is18_IOC_DEL_COUNT" kann eine gewünschte Anzahl an Bytes von der Pipe gelöscht werden.
+Beispiel (war fiktiv, wird inzwischen vom Treiber unterstuetzt):
+Bsp: Per "IS18_IOC_DEL_COUNT" kann eine gewünschte Anzahl an Bytes von der Pipe gelöscht werden.
 */
 // 71 Zeichen von der Pipe verwerfen
 // int cnt = 71;
-// ioctl(fd, IOC_DEL_COUNT, cnt);
-#define IS18_IOC_DEL_COUNT _IOW(is18_IOC_MY_MAGIC, IS18_IOC_NR_DEL_COUNT, int)
+// int dropped = ioctl(fd, IS18_IOC_DEL_COUNT, cnt);
+// Only tail (the read position of the fd) moves on, nothing is copied.
+// Returns the number of dropped bytes (at most the unread ones), EINVAL in
+// packet mode (messages would be cut). Stops at a pending zero copy write.
+#define IS18_IOC_DEL_COUNT _IOW(IS18_IOC_MY_MAGIC, IS18_IOC_NR_DEL_COUNT, int)
 // Dieses Beispiel zeigt, wie der Wert 71 als int per ioctl uebergeben wird.
 // Natuerlich kann jeder beliebige Integerwert so per ioctl uebergeben werden.
 
 // 71 Zeichen von der Pipe verwerfen
 // int cnt = 71;
 // ioctl(fd, IOC_DEL_COUNT, cnt);
-//#define IS18_IOC_DEL_COUNT _IO(is18_IOC_MY_MAGIC, IS18_IOC_NR_DEL_COUNT)
+//#define IS18_IOC_DEL_COUNT _IO(IS18_IOC_MY_MAGIC, IS18_IOC_NR_DEL_COUNT)
 // Dieses Beispiel zeigt, wie der Wert 71 als int per ioctl uebergeben wird.
 // _IO reicht auch, da kein zeiger uebergeben wird, sondern ein wert.
 
@@ -0,0 +1,388 @@
+// KUnit tests of the ring and the blocking logic. Included at the end of
+// is18drv.c (CONFIG_IS18_KUNIT_TEST) to reach its static functions, see
+// .kunitconfig and Readme.md. Every test gets a device of its own, files are
+// opened with is18_open() like the VFS does and read/written through
+// read_iter/write_iter with kernel buffers. Blocking is tested with kthreads
+// and wait queue state instead of sleeps, so the tests don't depend on timing.
+#include <kunit/test.h>
+#include <linux/kthread.h>
+#include <linux/delay.h> //msleep
+#include <linux/vmalloc.h>
+
+#define IS18_TEST_RING 16                       // bytes, small so the tests wrap often
+#define IS18_TEST_BENCH_RING (64 * 1024)
+#define IS18_TEST_BENCH_BYTES (16 * 1024 * 1024)
+#define IS18_TEST_MAX_FILES 4
+#define IS18_TEST_TIMEOUT (5 * HZ)              // a hanging test fails instead of blocking kunit
+
+struct is18_test_ctx {
+    struct is18_cdev *dev;
+    struct inode inode;                         // only i_cdev is used by is18_open()
+    struct file *files[IS18_TEST_MAX_FILES];
+    int nr_files;
+};
+
+// a reader or writer kthread
+struct is18_test_thread {
+    struct file *filp;
+    char *buf;
+    size_t len;                                 // bytes to move in total
+    size_t chunk;                               // bytes per call
+    ssize_t result;                             // bytes moved or the error
+    struct completion done;
+};
+
+static int is18_test_init(struct kunit *test) {
+    struct is18_test_ctx *ctx = kunit_kzalloc(test, sizeof(*ctx), GFP_KERNEL);
+    struct is18_cdev *dev;
+
+    KUNIT_ASSERT_NOT_NULL(test, ctx);
+    mutex_lock(&is18_devs_lock);
+    dev = is18_create_dev(-1);
+    mutex_unlock(&is18_devs_lock);
+    KUNIT_ASSERT_FALSE_MSG(test, IS_ERR(dev), "is18_create_dev: %ld", PTR_ERR(dev));
+    ctx->dev = dev;
+    ctx->inode.i_cdev = &dev->chdev;
+    test->priv = ctx;
+    return 0;
+}
+
+static void is18_test_exit(struct kunit *test) {
+    struct is18_test_ctx *ctx = test->priv;
+
+    while(ctx->nr_files) {
+        is18_close(&ctx->inode, ctx->files[--ctx->nr_files]);
+    }
+    mutex_lock(&is18_devs_lock);
+    is18_destroy_dev(ctx->dev, false);
+    mutex_unlock(&is18_devs_lock);
+}
+
+// ring size of the test device, before the first file is opened (the first writer allocates the ring)
+static void is18_test_ring_size(struct kunit *test, int size) {
+    struct is18_test_ctx *ctx = test->priv;
+
+    KUNIT_ASSERT_EQ(test, ctx->nr_files, 0);
+    ctx->dev->buffer_size = size;
+    ctx->dev->buffer_mask = size - 1;
+    ctx->dev->ctrl->buffer_size = size;
+}
+
+static struct file *is18_test_open(struct kunit *test, fmode_t mode, unsigned int flags) {
+    struct is18_test_ctx *ctx = test->priv;
+    struct file *filp = kunit_kzalloc(test, sizeof(*filp), GFP_KERNEL);
+
+    KUNIT_ASSERT_NOT_NULL(test, filp);
+    KUNIT_ASSERT_LT(test, ctx->nr_files, IS18_TEST_MAX_FILES);
+    filp->f_mode = mode;
+    filp->f_flags = flags;
+    KUNIT_ASSERT_EQ(test, is18_open(&ctx->inode, filp), 0);
+    ctx->files[ctx->nr_files++] = filp;
+    return filp;
+}
+
+static ssize_t is18_test_write(struct file *filp, const void *buf, size_t len) {
+    struct kvec kv = { .iov_base = (void *)buf, .iov_len = len };
+    struct iov_iter from;
+    struct kiocb kiocb;
+
+    init_sync_kiocb(&kiocb, filp);
+    iov_iter_kvec(&from, WRITE, &kv, 1, len);
+    return is18_write_iter(&kiocb, &from);
+}
+
+static ssize_t is18_test_read(struct file *filp, void *buf, size_t len) {
+    struct kvec kv = { .iov_base = buf, .iov_len = len };
+    struct iov_iter to;
+    struct kiocb kiocb;
+
+    init_sync_kiocb(&kiocb, filp);
+    iov_iter_kvec(&to, READ, &kv, 1, len);
+    return is18_read_iter(&kiocb, &to);
+}
+
+static void is18_test_pattern(char *buf, size_t len) {
+    size_t i;
+
+    for(i = 0; i < len; ++i) {
+        buf[i] = (char)(i * 7 + i / 251);
+    }
+}
+
+static int is18_test_writer_fn(void *data) {
+    struct is18_test_thread *t = data;
+    size_t done = 0;
+
+    while(done < t->len) {
+        ssize_t rv = is18_test_write(t->filp, t->buf + done, min(t->chunk, t->len - done));
+
+        if(rv <= 0) {
+            t->result = rv;
+            break;
+        }
+        done += rv;
+    }
+    if(done == t->len) {
+        t->result = done;
+    }
+    complete(&t->done);
+    return 0;
+}
+
+static int is18_test_reader_fn(void *data) {
+    struct is18_test_thread *t = data;
+    size_t done = 0;
+
+    while(done < t->len) {
+        ssize_t rv = is18_test_read(t->filp, t->buf + done, min(t->chunk, t->len - done));
+
+        if(rv <= 0) {
+            t->result = rv;
+            break;
+        }
+        done += rv;
+    }
+    if(done == t->len) {
+        t->result = done;
+    }
+    complete(&t->done);
+    return 0;
+}
+
+static struct is18_test_thread *is18_test_start(struct kunit *test, int (*fn)(void *), struct file *filp,
+                                                char *buf, size_t len, size_t chunk) {
+    struct is18_test_thread *t = kunit_kzalloc(test, sizeof(*t), GFP_KERNEL);
+    struct task_struct *task;
+
+    KUNIT_ASSERT_NOT_NULL(test, t);
+    t->filp = filp;
+    t->buf = buf;
+    t->len = len;
+    t->chunk = chunk;
+    init_completion(&t->done);
+    task = kthread_run(fn, t, "is18_test");
+    KUNIT_ASSERT_FALSE(test, IS_ERR(task));
+    return t;
+}
+
+// waits for a thread of is18_test_start(). A thread that is stuck is freed
+// by emptying the ring (writer) or by filling it (reader), the test fails then.
+static ssize_t is18_test_join(struct kunit *test, struct is18_test_thread *t) {
+    struct is18_test_ctx *ctx = test->priv;
+    struct is18_cdev *dev = ctx->dev;
+
+    if(!wait_for_completion_timeout(&t->done, IS18_TEST_TIMEOUT)) {
+        KUNIT_FAIL(test, "thread did not finish in time");
+        while(!wait_for_completion_timeout(&t->done, HZ / 10)) {
+            is18_lock_ring(dev);
+            is18_ring_reset(dev);
+            // a waiting reader needs bytes, a waiting writer space
+            WRITE_ONCE(dev->ctrl->head, dev->buffer_size);
+            is18_unlock_ring(dev);
+            wake_up(&dev->wq_read_data_available);
+            wake_up(&dev->wq_free_space_available);
+        }
+    }
+    return t->result;
+}
+
+static long is18_test_ioctl(struct file *filp, unsigned int cmd) {
+    return is18_ioctl(filp, cmd, 0);
+}
+
+// counters and indexes across the end of the ring
+static void is18_test_wraparound(struct kunit *test) {
+    struct file *filp;
+    char buf[IS18_TEST_RING];
+    struct is18_cdev *dev;
+
+    is18_test_ring_size(test, IS18_TEST_RING);
+    filp = is18_test_open(test, FMODE_READ | FMODE_WRITE, O_NONBLOCK);
+    dev = ((struct is18_test_ctx *)test->priv)->dev;
+
+    KUNIT_EXPECT_EQ(test, is18_test_write(filp, "0123456789", 10), 10);
+    KUNIT_EXPECT_EQ(test, is18_test_read(filp, buf, 10), 10);
+    KUNIT_EXPECT_MEMEQ(test, buf, "0123456789", 10);
+
+    // 6 bytes up to the end of the ring, 6 at its start
+    KUNIT_EXPECT_EQ(test, is18_test_write(filp, "abcdefghijkl", 12), 12);
+    KUNIT_EXPECT_EQ(test, READ_ONCE(dev->ctrl->head), 22U);
+    KUNIT_EXPECT_EQ(test, is18_test_ioctl(filp, IS18_IOC_WRITE_INDEX), 6L);
+    KUNIT_EXPECT_EQ(test, is18_test_ioctl(filp, IS18_IOC_READ_INDEX), 10L);
+    KUNIT_EXPECT_EQ(test, is18_test_ioctl(filp, IS18_IOC_NUM_BUFFERED_BYTES), 12L);
+    KUNIT_EXPECT_MEMEQ(test, dev->buffer, "ghijkl", 6);
+    KUNIT_EXPECT_EQ(test, is18_test_read(filp, buf, sizeof(buf)), 12);
+    KUNIT_EXPECT_MEMEQ(test, buf, "abcdefghijkl", 12);
+    KUNIT_EXPECT_EQ(test, is18_test_ioctl(filp, IS18_IOC_NUM_BUFFERED_BYTES), 0L);
+
+    // the counters wrap at 2^32
+    is18_lock_ring(dev);
+    WRITE_ONCE(dev->ctrl->head, UINT_MAX - 3);
+    WRITE_ONCE(dev->ctrl->tail, UINT_MAX - 3);
+    is18_unlock_ring(dev);
+    KUNIT_EXPECT_EQ(test, is18_test_write(filp, "ABCDEFGH", 8), 8);
+    KUNIT_EXPECT_EQ(test, READ_ONCE(dev->ctrl->head), 4U);
+    KUNIT_EXPECT_EQ(test, is18_test_ioctl(filp, IS18_IOC_NUM_BUFFERED_BYTES), 8L);
+    KUNIT_EXPECT_EQ(test, is18_test_read(filp, buf, sizeof(buf)), 8);
+    KUNIT_EXPECT_MEMEQ(test, buf, "ABCDEFGH", 8);
+}
+
+// a full ring takes no more bytes, an empty one returns none
+static void is18_test_full_empty(struct kunit *test) {
+    struct file *filp;
+    char buf[2 * IS18_TEST_RING];
+
+    is18_test_ring_size(test, IS18_TEST_RING);
+    filp = is18_test_open(test, FMODE_READ | FMODE_WRITE, O_NONBLOCK);
+    is18_test_pattern(buf, sizeof(buf));
+
+    // only what fits is stored
+    KUNIT_EXPECT_EQ(test, is18_test_write(filp, buf, sizeof(buf)), IS18_TEST_RING);
+    KUNIT_EXPECT_EQ(test, is18_test_ioctl(filp, IS18_IOC_NUM_BUFFERED_BYTES), (long)IS18_TEST_RING);
+    // full: ENOSPC for O_NONBLOCK
+    KUNIT_EXPECT_EQ(test, is18_test_write(filp, buf, 1), -ENOSPC);
+
+    memset(buf, 0, sizeof(buf));
+    KUNIT_EXPECT_EQ(test, is18_test_read(filp, buf, sizeof(buf)), IS18_TEST_RING);
+    // empty: a nonblocking read returns 0
+    KUNIT_EXPECT_EQ(test, is18_test_read(filp, buf + IS18_TEST_RING, 1), 0);
+    // and the ring takes bytes again
+    KUNIT_EXPECT_EQ(test, is18_test_write(filp, buf, 1), 1);
+}
+
+static void is18_test_empty_buffer(struct kunit *test) {
+    struct file *filp;
+    char buf[IS18_TEST_RING];
+
+    is18_test_ring_size(test, IS18_TEST_RING);
+    filp = is18_test_open(test, FMODE_READ | FMODE_WRITE, O_NONBLOCK);
+
+    KUNIT_EXPECT_EQ(test, is18_test_write(filp, "0123456789", 10), 10);
+    KUNIT_EXPECT_EQ(test, is18_test_read(filp, buf, 3), 3);
+    KUNIT_EXPECT_EQ(test, is18_test_ioctl(filp, IS18_IOC_EMPTY_BUFFER), 0L);
+    KUNIT_EXPECT_EQ(test, is18_test_ioctl(filp, IS18_IOC_NUM_BUFFERED_BYTES), 0L);
+    KUNIT_EXPECT_EQ(test, is18_test_ioctl(filp, IS18_IOC_READ_INDEX), 0L);
+    KUNIT_EXPECT_EQ(test, is18_test_ioctl(filp, IS18_IOC_WRITE_INDEX), 0L);
+    KUNIT_EXPECT_EQ(test, is18_test_read(filp, buf, sizeof(buf)), 0);
+    // the whole ring is free again
+    KUNIT_EXPECT_EQ(test, is18_test_write(filp, "abcdefghijklmnop", IS18_TEST_RING), IS18_TEST_RING);
+    KUNIT_EXPECT_EQ(test, is18_test_read(filp, buf, sizeof(buf)), IS18_TEST_RING);
+    KUNIT_EXPECT_MEMEQ(test, buf, "abcdefghijklmnop", IS18_TEST_RING);
+}
+
+// a reader sleeping on the empty ring is woken by a write, a writer
+// sleeping on the full ring by a read
+static void is18_test_wakeup(struct kunit *test) {
+    struct is18_cdev *dev;
+    struct file *wfilp, *rfilp;
+    struct is18_test_thread *t;
+    char *buf = kunit_kzalloc(test, IS18_TEST_RING, GFP_KERNEL);
+    char fill[IS18_TEST_RING];
+    int i;
+
+    KUNIT_ASSERT_NOT_NULL(test, buf);
+    is18_test_ring_size(test, IS18_TEST_RING);
+    wfilp = is18_test_open(test, FMODE_WRITE, 0);
+    rfilp = is18_test_open(test, FMODE_READ, 0);
+    dev = ((struct is18_test_ctx *)test->priv)->dev;
+
+    t = is18_test_start(test, is18_test_reader_fn, rfilp, buf, 8, 8);
+    for(i = 0; i < 500 && !wq_has_sleeper(&dev->wq_read_data_available); ++i) {
+        msleep(1);
+    }
+    KUNIT_EXPECT_TRUE_MSG(test, wq_has_sleeper(&dev->wq_read_data_available), "reader did not block");
+    KUNIT_EXPECT_FALSE(test, completion_done(&t->done));
+    KUNIT_EXPECT_EQ(test, is18_test_write(wfilp, "01234567", 8), 8);
+    KUNIT_EXPECT_EQ(test, is18_test_join(test, t), 8);
+    KUNIT_EXPECT_MEMEQ(test, buf, "01234567", 8);
+
+    is18_test_pattern(fill, sizeof(fill));
+    KUNIT_EXPECT_EQ(test, is18_test_write(wfilp, fill, sizeof(fill)), IS18_TEST_RING);
+    t = is18_test_start(test, is18_test_writer_fn, wfilp, (char *)"abcd", 4, 4);
+    for(i = 0; i < 500 && !wq_has_sleeper(&dev->wq_free_space_available); ++i) {
+        msleep(1);
+    }
+    KUNIT_EXPECT_TRUE_MSG(test, wq_has_sleeper(&dev->wq_free_space_available), "writer did not block");
+    KUNIT_EXPECT_EQ(test, is18_test_read(rfilp, buf, IS18_TEST_RING), IS18_TEST_RING);
+    KUNIT_EXPECT_MEMEQ(test, buf, fill, IS18_TEST_RING);
+    KUNIT_EXPECT_EQ(test, is18_test_join(test, t), 4);
+    KUNIT_EXPECT_EQ(test, is18_test_read(rfilp, buf, 4), 4);
+    KUNIT_EXPECT_MEMEQ(test, buf, "abcd", 4);
+}
+
+// reader and writer kthreads with odd chunk sizes through a tiny ring: every
+// byte arrives once and in order
+static void is18_test_concurrent(struct kunit *test) {
+    const size_t len = 256 * 1024;
+    struct file *wfilp, *rfilp;
+    struct is18_test_thread *writer, *reader;
+    char *src = kunit_kmalloc(test, len, GFP_KERNEL);
+    char *dst = kunit_kzalloc(test, len, GFP_KERNEL);
+
+    KUNIT_ASSERT_NOT_NULL(test, src);
+    KUNIT_ASSERT_NOT_NULL(test, dst);
+    is18_test_pattern(src, len);
+    is18_test_ring_size(test, IS18_TEST_RING);
+    wfilp = is18_test_open(test, FMODE_WRITE, 0);
+    rfilp = is18_test_open(test, FMODE_READ, 0);
+
+    reader = is18_test_start(test, is18_test_reader_fn, rfilp, dst, len, 5);
+    writer = is18_test_start(test, is18_test_writer_fn, wfilp, src, len, 7);
+    KUNIT_EXPECT_EQ(test, is18_test_join(test, writer), (ssize_t)len);
+    KUNIT_EXPECT_EQ(test, is18_test_join(test, reader), (ssize_t)len);
+    KUNIT_EXPECT_MEMEQ(test, dst, src, len);
+}
+
+// throughput of a writer and a reader kthread, logged as bytes/ns (not checked)
+static void is18_test_throughput(struct kunit *test) {
+    static const size_t chunks[] = {64, 4096, IS18_TEST_BENCH_RING};
+    struct file *wfilp, *rfilp;
+    char *src = vzalloc(IS18_TEST_BENCH_BYTES);
+    char *dst = vzalloc(IS18_TEST_BENCH_BYTES);
+    int i;
+
+    if(!src || !dst) {
+        vfree(src);
+        vfree(dst);
+        kunit_skip(test, "no memory for %d bytes", IS18_TEST_BENCH_BYTES);
+    }
+    is18_test_ring_size(test, IS18_TEST_BENCH_RING);
+    wfilp = is18_test_open(test, FMODE_WRITE, 0);
+    rfilp = is18_test_open(test, FMODE_READ, 0);
+
+    for(i = 0; i < ARRAY_SIZE(chunks); ++i) {
+        size_t len = chunks[i] < 4096 ? IS18_TEST_BENCH_BYTES / 16 : IS18_TEST_BENCH_BYTES;
+        struct is18_test_thread *writer, *reader;
+        u64 start = ktime_get_ns();
+        u64 ns;
+
+        reader = is18_test_start(test, is18_test_reader_fn, rfilp, dst, len, IS18_TEST_BENCH_RING);
+        writer = is18_test_start(test, is18_test_writer_fn, wfilp, src, len, chunks[i]);
+        KUNIT_EXPECT_EQ(test, is18_test_join(test, writer), (ssize_t)len);
+        KUNIT_EXPECT_EQ(test, is18_test_join(test, reader), (ssize_t)len);
+        ns = ktime_get_ns() - start;
+        kunit_info(test, "writes of %zu bytes: %zu bytes in %llu ns, %llu.%03llu bytes/ns\n", chunks[i],
+                   len, ns, div64_u64((u64)len, ns), div64_u64((u64)len * 1000, ns) % 1000);
+    }
+    vfree(src);
+    vfree(dst);
+}
+
+static struct kunit_case is18_test_cases[] = {
+    KUNIT_CASE(is18_test_wraparound),
+    KUNIT_CASE(is18_test_full_empty),
+    KUNIT_CASE(is18_test_empty_buffer),
+    KUNIT_CASE(is18_test_wakeup),
+    KUNIT_CASE(is18_test_concurrent),
+    KUNIT_CASE_SLOW(is18_test_throughput),
+    {}
+};
+
+static struct kunit_suite is18_test_suite = {
+    .name = "is18drv",
+    .init = is18_test_init,
+    .exit = is18_test_exit,
+    .test_cases = is18_test_cases,
+};
+
+kunit_test_suite(is18_test_suite);
@@ -0,0 +1,128 @@
+// Ring core of the is18 driver: index arithmetic, wrapping copies and the
+// head/tail protocol of struct is18_ring_ctrl. Locking, waiting and the
+// modes stay in is18drv.c. Builds in the kernel and in user space (the
+// mmap protocol and bench_core.c, see "make bench-core").
+//
+// head and tail are free running counters, the position in the ring is
+// counter & (size - 1), size is a power of two. head - tail is the number of
+// unread bytes. The producer copies the data first and publishes it by storing
+// head with release semantics, the consumer loads head with acquire
+// semantics and frees the space by storing tail with release semantics.
+#ifndef IS18_RING_H
+#define IS18_RING_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/compiler.h> //READ_ONCE
+#include <linux/minmax.h>
+#include <linux/string.h>
+#include <asm/barrier.h> //smp_load_acquire
+#else
+#include <stddef.h>
+#include <string.h>
+
+// the kernel primitives used below, for user space builds
+#ifndef READ_ONCE
+#define READ_ONCE(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define smp_load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#endif
+#ifndef min_t
+#define min_t(type, a, b) ((type)(a) < (type)(b) ? (type)(a) : (type)(b))
+#endif
+#endif
+
+#include "is18_ioctl.h"
+
+// position of counter pos in the ring
+static inline unsigned int is18_core_index(unsigned int pos, unsigned int size) {
+    return pos & (size - 1);
+}
+
+// unread bytes between tail and head, a mapping user space side may have
+// stored garbage --> never more than size
+static inline unsigned int is18_core_fill(unsigned int head, unsigned int tail, unsigned int size) {
+    return min_t(unsigned int, head - tail, size);
+}
+
+// free bytes behind head
+static inline unsigned int is18_core_space(unsigned int head, unsigned int tail, unsigned int size) {
+    return size - is18_core_fill(head, tail, size);
+}
+
+// largest contiguous run of at most len bytes at counter pos (a run ends at
+// the end of the ring, a wrapped copy needs a second run)
+static inline size_t is18_core_run(unsigned int pos, unsigned int size, size_t len) {
+    return min_t(size_t, len, size - is18_core_index(pos, size));
+}
+
+// copies len bytes at counter pos out of the ring, handles the wrap
+static inline void is18_core_copy_out(const char *buffer, unsigned int size, unsigned int pos,
+                                      void *dst, size_t len) {
+    size_t first = is18_core_run(pos, size, len);
+
+    memcpy(dst, buffer + is18_core_index(pos, size), first);
+    memcpy((char *)dst + first, buffer, len - first);
+}
+
+// copies len bytes into the ring at counter pos, handles the wrap
+static inline void is18_core_copy_in(char *buffer, unsigned int size, unsigned int pos,
+                                     const void *src, size_t len) {
+    size_t first = is18_core_run(pos, size, len);
+
+    memcpy(buffer + is18_core_index(pos, size), src, first);
+    memcpy(buffer, (const char *)src + first, len - first);
+}
+
+// zeroes len bytes of the ring at counter pos
+static inline void is18_core_clear(char *buffer, unsigned int size, unsigned int pos, size_t len) {
+    size_t first = is18_core_run(pos, size, len);
+
+    memset(buffer + is18_core_index(pos, size), 0, first);
+    memset(buffer, 0, len - first);
+}
+
+// number of unread bytes as seen by a third party - tail is read first, so
+// the result never underflows even if both sides are moving (it may exceed
+// size for a moment)
+static inline unsigned int is18_core_used(struct is18_ring_ctrl *ctrl) {
+    unsigned int tail = READ_ONCE(ctrl->tail);
+    return smp_load_acquire(&ctrl->head) - tail;
+}
+
+// empties the ring, nobody may use it meanwhile
+static inline void is18_core_reset(struct is18_ring_ctrl *ctrl) {
+    WRITE_ONCE(ctrl->head, 0);
+    WRITE_ONCE(ctrl->tail, 0);
+}
+
+// Single producer: stores up to len bytes and publishes them, returns the
+// number of stored bytes (0 if the ring is full).
+static inline size_t is18_core_write(struct is18_ring_ctrl *ctrl, char *buffer, unsigned int size,
+                                     const void *src, size_t len) {
+    unsigned int head = READ_ONCE(ctrl->head); // only written by us
+    // pairs with is18_core_read(): the data was copied out before tail moved
+    unsigned int space = is18_core_space(head, smp_load_acquire(&ctrl->tail), size);
+
+    len = min_t(size_t, len, space);
+    is18_core_copy_in(buffer, size, head, src, len);
+    smp_store_release(&ctrl->head, head + len);
+    return len;
+}
+
+// Single consumer: takes up to len bytes, returns the number of taken
+// bytes (0 if the ring is empty).
+static inline size_t is18_core_read(struct is18_ring_ctrl *ctrl, const char *buffer, unsigned int size,
+                                    void *dst, size_t len) {
+    unsigned int tail = READ_ONCE(ctrl->tail); // only written by us
+    // pairs with is18_core_write(): the data is visible before head
+    unsigned int used = is18_core_fill(smp_load_acquire(&ctrl->head), tail, size);
+
+    len = min_t(size_t, len, used);
+    is18_core_copy_out(buffer, size, tail, dst, len);
+    smp_store_release(&ctrl->tail, tail + len);
+    return len;
+}
+
+#endif /* IS18_RING_H */
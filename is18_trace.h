@@ -0,0 +1,119 @@
+// Tracepoints of the is18 data path, see Documentation/trace/tracepoints.rst.
+// They cost a static branch while disabled, enable them with e.g.:
+//   perf record -e 'is18:*' ...
+//   trace-cmd record -e is18
+// The events are is18:is18_read, is18:is18_write, is18:is18_block and
+// is18:is18_wake: the name is also the name of the generated trace_<name>()
+// helpers, plain read/write would give trace_read()/trace_write() in the
+// driver's namespace.
+// Every event carries the device minor number. read/write carry the duration
+// of the whole call (including sleeps), block carries the time slept, so the
+// per call latency can be rebuilt without pairing events.
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM is18
+
+#if !defined(_IS18_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _IS18_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// read: read(), readv(), io_uring, splice, IS18_IOC_READ_BATCH, IS18_IOC_RECV_MMSG
+// write: write(), writev(), io_uring, splice, IS18_IOC_SEND_MMSG
+DECLARE_EVENT_CLASS(is18_rw,
+    TP_PROTO(int minor, size_t count, ssize_t ret, unsigned int head, unsigned int tail,
+             bool shared, u64 duration_ns),
+    TP_ARGS(minor, count, ret, head, tail, shared, duration_ns),
+
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(size_t, count)          // requested bytes (records for the mmsg ioctls)
+        __field(ssize_t, ret)           // return value of the call
+        __field(unsigned int, head)
+        __field(unsigned int, tail)
+        __field(bool, shared)           // sem_sync was taken (not single producer/consumer)
+        __field(u64, duration_ns)       // time spent in the call
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->count = count;
+        __entry->ret = ret;
+        __entry->head = head;
+        __entry->tail = tail;
+        __entry->shared = shared;
+        __entry->duration_ns = duration_ns;
+    ),
+
+    TP_printk("minor=%d count=%zu ret=%zd head=%u tail=%u shared=%d duration_ns=%llu",
+              __entry->minor, __entry->count, __entry->ret, __entry->head, __entry->tail,
+              __entry->shared, __entry->duration_ns)
+);
+
+DEFINE_EVENT(is18_rw, is18_read,
+    TP_PROTO(int minor, size_t count, ssize_t ret, unsigned int head, unsigned int tail,
+             bool shared, u64 duration_ns),
+    TP_ARGS(minor, count, ret, head, tail, shared, duration_ns));
+
+DEFINE_EVENT(is18_rw, is18_write,
+    TP_PROTO(int minor, size_t count, ssize_t ret, unsigned int head, unsigned int tail,
+             bool shared, u64 duration_ns),
+    TP_ARGS(minor, count, ret, head, tail, shared, duration_ns));
+
+// a reader slept on an empty ring (writer = 0) or a writer on a full ring
+// (writer = 1), emitted after waking up
+TRACE_EVENT(is18_block,
+    TP_PROTO(int minor, bool writer, unsigned int used, size_t need, int ret, u64 slept_ns),
+    TP_ARGS(minor, writer, used, need, ret, slept_ns),
+
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(bool, writer)
+        __field(unsigned int, used)     // bytes in the ring when going to sleep
+        __field(size_t, need)           // bytes (reader) or space (writer) waited for
+        __field(int, ret)               // result of wait_event_interruptible()
+        __field(u64, slept_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->writer = writer;
+        __entry->used = used;
+        __entry->need = need;
+        __entry->ret = ret;
+        __entry->slept_ns = slept_ns;
+    ),
+
+    TP_printk("minor=%d side=%s used=%u need=%zu ret=%d slept_ns=%llu",
+              __entry->minor, __entry->writer ? "writer" : "reader", __entry->used,
+              __entry->need, __entry->ret, __entry->slept_ns)
+);
+
+// the data path woke up sleepers of the other side
+TRACE_EVENT(is18_wake,
+    TP_PROTO(int minor, bool writers, unsigned int events),
+    TP_ARGS(minor, writers, events),
+
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(bool, writers)          // the writer queue was woken (else the reader queue)
+        __field(unsigned int, events)   // poll events passed to the wakeup
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->writers = writers;
+        __entry->events = events;
+    ),
+
+    TP_printk("minor=%d queue=%s events=0x%x",
+              __entry->minor, __entry->writers ? "writers" : "readers", __entry->events)
+);
+
+#endif /* _IS18_TRACE_H */
+
+// has to be outside of the include guard
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE is18_trace
+#include <trace/define_trace.h>
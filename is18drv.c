@@ -5,27 +5,92 @@
 #include <linux/semaphore.h>
 #include <linux/device.h>
 #include <linux/slab.h>  //kmalloc
+#include <linux/mm.h> //kvmalloc, vm_insert_page
+#include <linux/vmalloc.h> //vmap
+#include <linux/gfp.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/log2.h> //roundup_pow_of_two
 #include <linux/uaccess.h> //for copy to/from userspace
 #include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/uio.h> //iov_iter
+#include <linux/splice.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/bvec.h>
 #include <linux/completion.h>
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
+#include <linux/percpu.h>
+#include <linux/atomic.h>
+#include <linux/timekeeping.h> //ktime_get_ns
+#include <linux/bitops.h> //fls64
+#include <linux/math64.h> //div_u64
+#include <linux/xarray.h>
+#include <linux/capability.h>
+#include <linux/numa.h>
+#include <linux/topology.h> //numa_node_id, cpumask_of_node
+#include <linux/sched/clock.h> //local_clock
+#include <linux/sched/signal.h> //signal_pending
 
 #include "is18_ioctl.h"
+#include "is18_ring.h"
+
+#define CREATE_TRACE_POINTS
+#include "is18_trace.h"
 
 MODULE_LICENSE("Dual BSD/GPL");
 
 
-#define MINOR_COUNT 5
+#define DEFAULT_DEVICES 5 // devices created at load time, see module parameter nr_devices
+#define DEFAULT_MAX_DEVICES 1024 // see module parameter max_devices
 #define DRVNAME "is18drv"
-#define BUFFER_SIZE 16 // should be 1024--> 16 choosen just for testing purpose
+#define CTL_NAME "is18ctl"
+#define DEFAULT_BUFFER_SIZE 16 // 16 choosen just for testing purpose, see module parameter buffer_size
+// ring sizes are always a power of two, so index = counter & (size - 1)
+#define MAX_BUFFER_SIZE (16 * 1024 * 1024) // upper limit for module parameter and IS18_IOC_SET_BUFFER_SIZE
+#define PROC_DIR "is18"
 #define PROC_FILE "is18/info"
+#define PROC_STATS_FILE "is18/stats"
+#define PROC_LATENCY_FILE "is18/latency"
+
+// default ring size of every device, can be changed per device via IS18_IOC_SET_BUFFER_SIZE
+static int buffer_size = DEFAULT_BUFFER_SIZE;
+module_param(buffer_size, int, 0444);
+MODULE_PARM_DESC(buffer_size, "default ring buffer size in bytes of each device (rounded up to a power of two)");
+
+// devices can be created and destroyed at runtime via /dev/is18ctl
+static int nr_devices = DEFAULT_DEVICES;
+module_param(nr_devices, int, 0444);
+MODULE_PARM_DESC(nr_devices, "number of devices created at load time (is18dev0 ...)");
+
+static int max_devices = DEFAULT_MAX_DEVICES;
+module_param(max_devices, int, 0444);
+MODULE_PARM_DESC(max_devices, "max number of devices, reserved minor numbers");
+
+// NUMA node of the ring pages, can be changed per device via IS18_IOC_SET_NUMA_NODE
+static int numa_node = NUMA_NO_NODE;
+module_param(numa_node, int, 0444);
+MODULE_PARM_DESC(numa_node, "NUMA node of the rings, -1: node of the first writer (default)");
+
+// busy poll time of new files, can be changed per file via IS18_IOC_SET_BUSY_POLL
+static int busy_poll;
+module_param(busy_poll, int, 0644);
+MODULE_PARM_DESC(busy_poll, "us a blocked reader/writer spins before it sleeps, 0: off (default)");
 
 static int is18_open(struct inode *inode, struct file *filp);
 static int is18_close(struct inode *inode, struct file *filp);
-static ssize_t is18_read(struct file *filp, char __user *buff, size_t count, loff_t *offset);
-static ssize_t is18_write(struct file *filp, const char __user *buff, size_t count, loff_t *offset);
+static ssize_t is18_read_iter(struct kiocb *iocb, struct iov_iter *to);
+static ssize_t is18_write_iter(struct kiocb *iocb, struct iov_iter *from);
 static long is18_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+static long is18_ctl_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+static __poll_t is18_poll(struct file *filp, struct poll_table_struct *wait);
+static int is18_mmap(struct file *filp, struct vm_area_struct *vma);
+static ssize_t is18_splice_read(struct file *filp, loff_t *ppos, struct pipe_inode_info *pipe,
+                                size_t len, unsigned int flags);
+static ssize_t is18_splice_write(struct pipe_inode_info *pipe, struct file *filp, loff_t *ppos,
+                                 size_t len, unsigned int flags);
 
 // Die Struktur file_operations besitzt als Member Variablen
 // pro moeglichen System call (read, write, etc.) einen Funktionszeiger.
@@ -39,36 +104,219 @@ static struct file_operations is18_fcalls = {
     .owner = THIS_MODULE,
     .open = is18_open,
     .release = is18_close,
-    .read = is18_read,
-    .write = is18_write,
+    .read_iter = is18_read_iter,
+    .write_iter = is18_write_iter,
     .unlocked_ioctl = is18_ioctl,
+    .poll = is18_poll,
+    .mmap = is18_mmap,
+    .splice_read = is18_splice_read,
+    .splice_write = is18_splice_write,
+};
+
+// /dev/is18ctl only creates and destroys devices
+static struct file_operations is18_ctl_fcalls = {
+    .owner = THIS_MODULE,
+    .unlocked_ioctl = is18_ctl_ioctl,
+};
+
+// Statistics of a device, every CPU counts in its own copy --> no lock and
+// no shared cache line on the data path. Summed up by is18_get_stats().
+struct is18_pcpu_stats {
+    u64 bytes_in;       // bytes stored by writers
+    u64 bytes_out;      // bytes taken by readers
+    u64 reads;          // read syscalls (read, readv, splice, batch ioctls)
+    u64 writes;         // write syscalls
+    u64 read_blocked;   // times a reader slept on an empty ring
+    u64 write_blocked;  // times a writer slept on a full ring
+    u64 eagain;         // nonblocking calls that found the ring empty/full or the lock taken
+    u64 enospc;         // nonblocking writes that returned ENOSPC
+    u64 overwritten;    // bytes dropped by writers in overwrite mode
+};
+
+#define is18_stat_add(dev, field, val) this_cpu_add((dev)->stats->field, (val))
+#define is18_stat_inc(dev, field) this_cpu_inc((dev)->stats->field)
+
+// log2 latency histograms in ns: bucket i counts [2^i, 2^(i+1)) ns, bucket 0
+// also 0 ns and the last bucket everything above. Per CPU like the statistics.
+#define IS18_LAT_BUCKETS 32
+enum is18_lat {
+    IS18_LAT_BLOCKED_EMPTY, // time a reader slept on an empty ring
+    IS18_LAT_BLOCKED_FULL,  // time a writer slept on a full ring
+    IS18_LAT_RESIDENCY,     // time from publishing a write until its last byte was read
+    IS18_LAT_NR
+};
+
+struct is18_pcpu_latency {
+    u64 hist[IS18_LAT_NR][IS18_LAT_BUCKETS];
+};
+
+static inline unsigned int is18_lat_bucket(u64 ns) {
+    return ns ? min_t(unsigned int, fls64(ns) - 1, IS18_LAT_BUCKETS - 1) : 0;
+}
+
+#define is18_lat_add(dev, which, ns) this_cpu_inc((dev)->latency->hist[which][is18_lat_bucket(ns)])
+
+// Residency samples: before publishing head a writer stores the new head and
+// the time in a small ring next to the data ring, a reader takes the samples
+// whose bytes it has completely consumed after publishing tail. If the sample
+// ring is full the write is not sampled.
+#define IS18_STAMP_SLOTS 64 // power of two
+
+struct is18_stamp {
+    unsigned int end;   // head after the write
+    u64 ns;             // ktime_get_ns() when it was published
+};
+
+// Zero copy write (is18_write_gift): the user pages of a large write are
+// handed to the readers instead of being copied into the ring, a reference
+// is held on each. Lives on the stack of the writer, which waits until the
+// readers took it.
+#define IS18_GIFT_MAX (16 * 1024 * 1024) // bytes referenced at once, larger writes are several gifts
+
+struct is18_gift {
+    struct page **pages;    // pages of the write, a reference is held on each
+    unsigned int nr_pages;
+    size_t offset;          // of the data in the first page
+    size_t len;
+    size_t done;            // bytes the readers took, changed with read_lock held
+    unsigned int pos;       // head when it was posted, the gift follows the ring bytes before
 };
 
 // Pro Device gibt es eine Instanz dieser Struktur.
+// Allocated by is18_create_dev and freed by is18_dev_release once the last
+// reference is gone: open files hold the cdev, which holds the device.
 struct is18_cdev
 {
     struct semaphore sem_sync; //synchronisation for accessing critical section
-    int next_read_index;
-    int next_write_index;
-    // number of bytes which are still waiting for be read
-    //size of buffer is BUFFER_SIZE, allowed values between 0 and BUFFER_SIZE
-    int current_pipe_bytes; // number of unread bytes in fifo
+    // Ring state: free running counters head and tail in a page of its own,
+    // which can be mapped into user space next to the data (see is18_mmap).
+    // The buffer position is counter & buffer_mask.
+    // head - tail is the number of unread bytes, allowed values between 0 and buffer_size.
+    // head is only written by writers (holding write_lock), tail only by
+    // readers (holding read_lock) - each side reads the other counter with
+    // acquire semantics and publishes its own with release semantics.
+    // In overwrite mode writers move tail as well, then both sides only move
+    // it with cmpxchg (is18_overwrite, is18_release_tail).
+    // A mapped ring may be modified by user space at any time, so the
+    // counters are never trusted to be consistent, only masked.
+    struct is18_ring_ctrl *ctrl;
+    struct mutex read_lock ____cacheline_aligned_in_smp; // serialises readers
+    struct mutex write_lock; // serialises writers
+    // true while exactly one reader and one writer are open: the data path
+    // then runs without sem_sync (single producer / single consumer)
+    bool spsc;
+    int buffer_size; // size of the ring (power of two), only changed while the ring is empty
+    int numa_node; // node of the ring pages, NUMA_NO_NODE: node of the allocating writer
+    unsigned int buffer_mask; // buffer_size - 1
+    // packet mode: every write is stored as one message (__u32 length header
+    // + payload) and every read returns one message, only changed while the ring is empty
+    bool packet;
+    // broadcast mode (IS18_BROADCAST_*): every reader has a cursor of its own,
+    // tail is the cursor of the slowest reader. Only changed while the ring is empty.
+    int broadcast;
+    struct list_head readers; // struct is18_file of the open readers, protected by read_lock
+    // MPSC mode (multi producer): writers don't serialise on write_lock, they
+    // reserve space by moving reserve with cmpxchg, copy without a lock and
+    // publish head in the order of their reservations (is18_write_reserved).
+    // Only changed while the ring is empty.
+    bool mpsc;
+    // overwrite mode (flight recorder): a writer never waits for space, it
+    // moves tail over the oldest bytes (whole messages in packet mode), see is18_overwrite
+    bool overwrite;
+    // zero copy: blocking writes of at least zerocopy_min bytes (0: off) from
+    // user memory are handed to the readers as gift, only changed with the ring locked
+    int zerocopy_min;
+    // the pending zero copy write, published by its writer with release
+    // semantics, taken by readers (read_lock)
+    struct is18_gift *gift;
+    // MPSC writers hold it for reading while they own a reservation,
+    // is18_lock_ring() for writing --> no reservation is pending while the ring is locked
+    struct rw_semaphore mpsc_sem;
+    wait_queue_head_t wq_commit; // MPSC writers waiting for the commits of earlier reservations
+    // reservations whose writers did not wait for their turn (struct is18_pending_commit),
+    // the writer in front publishes them. It holds mpsc_sem until it did.
+    spinlock_t commit_lock;
+    struct list_head commits;
+    unsigned int reserve ____cacheline_aligned_in_smp; // end of the reserved space (MPSC mode), head <= reserve
     int current_open_read_cnt;
     int current_open_write_cnt;
-    int device_number;
-
-    char* buffer;
+    int device_number; // minor number, index in is18_devs
+    bool dead; // destroyed via /dev/is18ctl, no more opens
+
+    char* buffer; // vmap() of pages
+    struct page **pages; // single pages of the ring, mapped into user space by is18_mmap
+    unsigned int nr_pages;
+    atomic_t mmap_cnt; // number of user space mappings, the ring is not resized while mapped
+    // guards buffer, pages and the modes for is18_mmap, which runs with the
+    // mmap_lock of the mm held and so must not take the data path locks
+    // (they are held across user copies, which may fault). Taken last
+    // (is18_lock_ring), never held across a user copy.
+    struct mutex map_lock;
+    struct is18_pcpu_stats __percpu *stats;
+    atomic_t high_water; // max number of bytes that were in the ring at once
+    struct is18_pcpu_latency __percpu *latency;
+    // residency samples, stamp_head is only written by writers (write_lock),
+    // stamp_tail only by readers (read_lock), see is18_stamp_write/is18_stamp_read
+    struct is18_stamp stamps[IS18_STAMP_SLOTS];
+    unsigned int stamp_head;
+    unsigned int stamp_tail;
     wait_queue_head_t wq_free_space_available;
     wait_queue_head_t wq_read_data_available;
     struct completion comp_buffer_initialized;
     struct cdev chdev; // wird vom driver benoetigt. MUSS vorhanden sein!
+    struct device device; // /dev/is18dev<device_number>, owns the memory of the structure
 };
 
+// Pro offenem File gibt es eine Instanz dieser Struktur (filp->private_data).
+struct is18_file
+{
+    struct is18_cdev *dev;
+    struct list_head reader; // entry in dev->readers (readers only)
+    // broadcast mode: next byte this reader gets, between tail and head.
+    // Written with read_lock held, read locklessly by poll and the wait conditions.
+    unsigned int cursor;
+    u64 dropped; // bytes overwritten before this reader got them (lossy broadcast mode, read_lock)
+    unsigned int busy_poll_us; // spin before sleeping in read()/write(), IS18_IOC_SET_BUSY_POLL
+    // wakeup thresholds, IS18_IOC_SET_WAKEUP
+    unsigned int rcvlowat; // bytes a blocked reader waits for
+    unsigned int rcvdelay_us; // a blocked reader returns what it has after this time, 0: never
+    unsigned int sndlowat; // free bytes a blocked writer waits for
+};
+
+// wait_event_interruptible() which spins up to busy_poll_us of the file first
+// (like SO_BUSY_POLL): a handoff within that time costs no sleep and wakeup.
+// The spinning stops early if the CPU is needed or a signal is pending.
+// An exclusive waiter is woken alone, it has to pass the wakeup on if it
+// leaves data (space) for the next one (see is18_do_read/is18_do_write).
+#define is18_wait_event(f, wq, condition, exclusive)                                \
+({                                                                                  \
+    unsigned int __us = READ_ONCE((f)->busy_poll_us);                               \
+                                                                                    \
+    if(__us) {                                                                      \
+        u64 __end = local_clock() + (u64)__us * NSEC_PER_USEC;                      \
+                                                                                    \
+        while(!(condition) && !need_resched() && !signal_pending(current) &&        \
+              local_clock() < __end) {                                              \
+            cpu_relax();                                                            \
+        }                                                                           \
+    }                                                                               \
+    (exclusive) ? wait_event_interruptible_exclusive(wq, condition) :               \
+                  wait_event_interruptible(wq, condition);                          \
+})
+
+static inline struct is18_cdev *is18_dev(struct file *filp) {
+    return ((struct is18_file *)filp->private_data)->dev;
+}
+
 static struct class *is18_class;
 
 static dev_t dev_num; // dev_t = __kernel_dev_t = __u32 = unsigned int bei x86/amd64
 
-static struct is18_cdev is18_devs[MINOR_COUNT];
+// all devices by minor number, create/destroy and the proc files hold is18_devs_lock
+static DEFINE_XARRAY_ALLOC(is18_devs);
+static DEFINE_MUTEX(is18_devs_lock);
+
+static struct cdev is18_ctl_cdev;
 
 // procfs functions
 static int is18_seq_open (struct inode *, struct file *);
@@ -76,6 +324,10 @@ static void *is18_start (struct seq_file *, loff_t *);
 static void is18_stop (struct seq_file *, void *);
 static void *is18_next (struct seq_file *, void *, loff_t *);
 static int is18_show (struct seq_file *, void *);
+static int is18_stats_seq_open (struct inode *, struct file *);
+static int is18_show_stats (struct seq_file *, void *);
+static int is18_latency_seq_open (struct inode *, struct file *);
+static int is18_show_latency (struct seq_file *, void *);
 
 // procfs file ops
 static struct proc_ops is18_proc_fcalls = {
@@ -92,12 +344,225 @@ static struct seq_operations is18_proc_seq_ops = {
     .show = is18_show
 };
 
+// /proc/is18/stats: same iteration over the devices, one line per device
+static struct proc_ops is18_stats_proc_fcalls = {
+    .proc_open = is18_stats_seq_open,
+    .proc_read = seq_read,
+    .proc_lseek = seq_lseek,
+    .proc_release = seq_release
+};
+static struct seq_operations is18_stats_seq_ops = {
+    .start = is18_start,
+    .stop = is18_stop,
+    .next = is18_next,
+    .show = is18_show_stats
+};
+
+// /proc/is18/latency: one line per device and histogram
+static struct proc_ops is18_latency_proc_fcalls = {
+    .proc_open = is18_latency_seq_open,
+    .proc_read = seq_read,
+    .proc_lseek = seq_lseek,
+    .proc_release = seq_release
+};
+static struct seq_operations is18_latency_seq_ops = {
+    .start = is18_start,
+    .stop = is18_stop,
+    .next = is18_next,
+    .show = is18_show_latency
+};
+
+// Allocates the ring memory as single zeroed pages, mapped contiguously into
+// the kernel with vmap(). Single pages can be inserted into user space
+// mappings (is18_mmap) and large rings need no high order allocation.
+// The pages are taken from node (NUMA_NO_NODE: node of the calling CPU),
+// from another node only if it has no free memory left.
+static char *is18_alloc_ring(int size, int node, struct page ***pages_out, unsigned int *nr_pages_out) {
+    unsigned int nr_pages = PAGE_ALIGN(size) >> PAGE_SHIFT;
+    struct page **pages;
+    char *buffer;
+    unsigned int i;
+
+    if(node == NUMA_NO_NODE) {
+        node = numa_node_id();
+    }
+    pages = kvmalloc_node(array_size(nr_pages, sizeof(*pages)), GFP_KERNEL | __GFP_ZERO, node);
+    if(!pages) {
+        return NULL;
+    }
+    for(i = 0; i < nr_pages; ++i) {
+        pages[i] = alloc_pages_node(node, GFP_KERNEL | __GFP_ZERO, 0);
+        if(!pages[i]) {
+            goto err;
+        }
+    }
+    buffer = vmap(pages, nr_pages, VM_MAP, PAGE_KERNEL);
+    if(!buffer) {
+        goto err;
+    }
+    *pages_out = pages;
+    *nr_pages_out = nr_pages;
+    return buffer;
+err:
+    while(i--) {
+        put_page(pages[i]);
+    }
+    kvfree(pages);
+    return NULL;
+}
+
+// pages which are still mapped into user space are freed on munmap
+static void is18_free_ring(char *buffer, struct page **pages, unsigned int nr_pages) {
+    unsigned int i;
+
+    if(!buffer) {
+        return;
+    }
+    vunmap(buffer);
+    for(i = 0; i < nr_pages; ++i) {
+        put_page(pages[i]);
+    }
+    kvfree(pages);
+}
+
+// frees a device after the last reference is gone (see struct is18_cdev)
+static void is18_dev_release(struct device *device) {
+    struct is18_cdev *dev = container_of(device, struct is18_cdev, device);
+
+    is18_free_ring(dev->buffer, dev->pages, dev->nr_pages);
+    free_percpu(dev->latency);
+    free_percpu(dev->stats);
+    free_page((unsigned long)dev->ctrl);
+    kfree(dev);
+}
+
+// Creates /dev/is18dev<minor>, any free minor number if minor is negative.
+// The ring itself is allocated by the first writer (is18_open).
+// Must be called with is18_devs_lock held.
+static struct is18_cdev *is18_create_dev(int minor) {
+    struct is18_cdev *dev;
+    struct xa_limit limit = minor < 0 ? XA_LIMIT(0, max_devices - 1) : XA_LIMIT(minor, minor);
+    u32 id;
+    int rv;
+
+    if(minor >= max_devices) {
+        return ERR_PTR(-EINVAL);
+    }
+    dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+    if(!dev) {
+        return ERR_PTR(-ENOMEM);
+    }
+    // from here on put_device() frees everything allocated so far
+    device_initialize(&dev->device);
+    dev->device.class = is18_class;
+    dev->device.release = is18_dev_release;
+
+    // init member
+    dev->numa_node = numa_node;
+    sema_init(&dev->sem_sync, 1);
+    mutex_init(&dev->read_lock);
+    mutex_init(&dev->write_lock);
+    INIT_LIST_HEAD(&dev->readers);
+    init_rwsem(&dev->mpsc_sem);
+    init_waitqueue_head(&dev->wq_commit);
+    spin_lock_init(&dev->commit_lock);
+    INIT_LIST_HEAD(&dev->commits);
+    init_waitqueue_head(&dev->wq_free_space_available);
+    init_waitqueue_head(&dev->wq_read_data_available);
+    init_completion(&dev->comp_buffer_initialized);
+    atomic_set(&dev->mmap_cnt, 0);
+    mutex_init(&dev->map_lock);
+    atomic_set(&dev->high_water, 0);
+    dev->buffer_size = buffer_size;
+    dev->buffer_mask = buffer_size - 1;
+    dev->ctrl = (struct is18_ring_ctrl *)get_zeroed_page(GFP_KERNEL);
+    dev->stats = alloc_percpu(struct is18_pcpu_stats);
+    dev->latency = alloc_percpu(struct is18_pcpu_latency);
+    if(!dev->ctrl || !dev->stats || !dev->latency) {
+        rv = -ENOMEM;
+        goto err;
+    }
+    dev->ctrl->buffer_size = buffer_size;
+
+    // reserve the minor number, the device is stored once it is complete
+    rv = xa_alloc(&is18_devs, &id, NULL, limit, GFP_KERNEL);
+    if(rv) {
+        goto err;
+    }
+    dev->device_number = id;
+    dev->device.devt = MKDEV(MAJOR(dev_num), id);
+    rv = dev_set_name(&dev->device, "is18dev%u", id);
+    if(rv) {
+        goto err_erase;
+    }
+
+    cdev_init(&dev->chdev, &is18_fcalls);
+    dev->chdev.owner = THIS_MODULE;
+    // fuegt das device zum system und legt das device file an
+    rv = cdev_device_add(&dev->chdev, &dev->device);
+    if(rv) {
+        printk(KERN_WARNING "is18drv: cdev_device_add failed\n");
+        goto err_erase;
+    }
+    xa_store(&is18_devs, id, dev, GFP_KERNEL); // replaces the reserved entry, no allocation
+    pr_debug("is18drv: new device with major nr: %d, minor nr: %u\n", MAJOR(dev_num), id);
+    return dev;
+
+err_erase:
+    xa_erase(&is18_devs, id);
+err:
+    put_device(&dev->device);
+    return ERR_PTR(rv);
+}
+
+// Removes a device. Fails with EBUSY while it is open, unless the module is
+// unloaded (nothing can be open then). The memory is freed with the last
+// reference, an open() which already found the device fails with ENODEV.
+// Must be called with is18_devs_lock held.
+static int is18_destroy_dev(struct is18_cdev *dev, bool force) {
+    down(&dev->sem_sync);
+    if(!force && (dev->current_open_read_cnt || dev->current_open_write_cnt)) {
+        up(&dev->sem_sync);
+        return -EBUSY;
+    }
+    dev->dead = true;
+    up(&dev->sem_sync);
+    // readers waiting in open() for a writer give up
+    complete_all(&dev->comp_buffer_initialized);
+
+    xa_erase(&is18_devs, dev->device_number);
+    cdev_device_del(&dev->chdev, &dev->device);
+    pr_debug("is18drv: removed device %d\n", dev->device_number);
+    put_device(&dev->device);
+    return 0;
+}
+
 static int __init is18drv_init(void)
 {
     int rv;
-    int i, ii;
+    int i;
+    struct is18_cdev *dev;
+    unsigned long index;
     printk(KERN_INFO "Hello from my character driver %s!\n", DRVNAME);
-    rv = alloc_chrdev_region(&dev_num, 0 /* first minor nr */, MINOR_COUNT, DRVNAME);
+    if(buffer_size < 1 || buffer_size > MAX_BUFFER_SIZE) {
+        printk(KERN_WARNING "is18drv: invalid buffer_size %d, using %d\n", buffer_size, DEFAULT_BUFFER_SIZE);
+        buffer_size = DEFAULT_BUFFER_SIZE;
+    }
+    buffer_size = roundup_pow_of_two(buffer_size);
+    if(max_devices < 1 || max_devices > MINORMASK) {
+        printk(KERN_WARNING "is18drv: invalid max_devices %d, using %d\n", max_devices, DEFAULT_MAX_DEVICES);
+        max_devices = DEFAULT_MAX_DEVICES;
+    }
+    if(numa_node != NUMA_NO_NODE && (numa_node < 0 || numa_node >= MAX_NUMNODES || !node_online(numa_node))) {
+        printk(KERN_WARNING "is18drv: invalid numa_node %d, using the node of the writer\n", numa_node);
+        numa_node = NUMA_NO_NODE;
+    }
+    if(nr_devices < 0 || nr_devices > max_devices) {
+        printk(KERN_WARNING "is18drv: invalid nr_devices %d, using %d\n", nr_devices, min(DEFAULT_DEVICES, max_devices));
+        nr_devices = min(DEFAULT_DEVICES, max_devices);
+    }
+    // minor numbers 0 .. max_devices - 1 for the devices, max_devices for is18ctl
+    rv = alloc_chrdev_region(&dev_num, 0 /* first minor nr */, max_devices + 1, DRVNAME);
     if (rv) {
         goto err1;
     }
@@ -106,125 +571,538 @@ static int __init is18drv_init(void)
 
     is18_class = class_create(THIS_MODULE, "is18_driver_class");
     if(IS_ERR(is18_class)) {
+        rv = PTR_ERR(is18_class);
         goto err1b;
     }
 
-    if(NULL == (proc_create (PROC_FILE, 0, NULL, &is18_proc_fcalls))) {
+    if(NULL == proc_mkdir(PROC_DIR, NULL) ||
+       NULL == (proc_create (PROC_FILE, 0, NULL, &is18_proc_fcalls)) ||
+       NULL == (proc_create (PROC_STATS_FILE, 0, NULL, &is18_stats_proc_fcalls)) ||
+       NULL == (proc_create (PROC_LATENCY_FILE, 0, NULL, &is18_latency_proc_fcalls))) {
         printk(KERN_WARNING "is18drv: unable to create proc file\n");
+        rv = -ENOMEM;
         goto err1c;
     }
 
-    for (i = 0; i < MINOR_COUNT; ++i) {
-        dev_t cur_devnr = MKDEV(MAJOR(dev_num), MINOR(dev_num) + i);
-        cdev_init(&is18_devs[i].chdev, &is18_fcalls);
-        // init member
-        sema_init(&is18_devs[i].sem_sync, 1);
-        is18_devs[i].chdev.owner = THIS_MODULE;
-        is18_devs[i].next_read_index = 0;
-        is18_devs[i].next_write_index = 0;
-        is18_devs[i].current_pipe_bytes = 0;
-        is18_devs[i].current_open_read_cnt = 0;
-        is18_devs[i].current_open_write_cnt = 0;
-        is18_devs[i].device_number = MINOR(cur_devnr);
-
-        is18_devs[i].buffer = NULL;
-        init_waitqueue_head(&is18_devs[i].wq_free_space_available);
-        init_waitqueue_head(&is18_devs[i].wq_read_data_available);
-        init_completion(&is18_devs[i].comp_buffer_initialized);
-
-        // device file anlegen
-        if(IS_ERR(device_create(is18_class,NULL,cur_devnr,NULL, "is18dev%d",i))) {
-            rv = -ENODEV;
-            goto err2;
-        }
+    // control device
+    cdev_init(&is18_ctl_cdev, &is18_ctl_fcalls);
+    is18_ctl_cdev.owner = THIS_MODULE;
+    rv = cdev_add(&is18_ctl_cdev, MKDEV(MAJOR(dev_num), max_devices), 1);
+    if (rv < 0) {
+        goto err1c;
+    }
+    if(IS_ERR(device_create(is18_class, NULL, MKDEV(MAJOR(dev_num), max_devices), NULL, CTL_NAME))) {
+        rv = -ENODEV;
+        goto err1d;
+    }
 
-        // fuegt das device zum system
-        rv = cdev_add(&is18_devs[i].chdev, cur_devnr, 1);
-        if (rv < 0) {
-            //device_destroy(is00_class, is00_devs[i].chdev.dev);
-            device_destroy(is18_class, cur_devnr);
-            printk(KERN_WARNING "cdev_add failed\n");
+    mutex_lock(&is18_devs_lock);
+    for (i = 0; i < nr_devices; ++i) {
+        dev = is18_create_dev(i);
+        if(IS_ERR(dev)) {
+            rv = PTR_ERR(dev);
+            mutex_unlock(&is18_devs_lock);
             goto err2;
         }
         printk(KERN_INFO "new device with major nr: %d, minor nr: %d\n",
-               MAJOR(cur_devnr), MINOR(cur_devnr));
+               MAJOR(dev_num), dev->device_number);
     }
+    mutex_unlock(&is18_devs_lock);
     return 0;
 err2:
-    for (ii = 0; ii < i; ++ii) {
-        device_destroy(is18_class, is18_devs[ii].chdev.dev);
-        cdev_del(&is18_devs[ii].chdev);
+    mutex_lock(&is18_devs_lock);
+    xa_for_each(&is18_devs, index, dev) {
+        is18_destroy_dev(dev, true);
     }
-    class_destroy(is18_class);
+    mutex_unlock(&is18_devs_lock);
+    device_destroy(is18_class, MKDEV(MAJOR(dev_num), max_devices));
+err1d:
+    cdev_del(&is18_ctl_cdev);
 err1c:
-    remove_proc_entry(PROC_FILE, NULL);
+    remove_proc_subtree(PROC_DIR, NULL);
+    class_destroy(is18_class);
 err1b:
-    unregister_chrdev_region(dev_num, MINOR_COUNT);
+    unregister_chrdev_region(dev_num, max_devices + 1);
 err1:
     return rv;
 }
 
 static void __exit is18drv_exit(void)
 {
-    int i;
-    for (i = 0; i < MINOR_COUNT; i++) {
-        device_destroy(is18_class, is18_devs[i].chdev.dev);
-        cdev_del(&is18_devs[i].chdev);
-        if(is18_devs[i].buffer) {
-            printk("free buffer of device %d\n", i);
-            kfree(is18_devs[i].buffer);
-        }
-        printk("cleanup device %d\n", i);
+    struct is18_cdev *dev;
+    unsigned long index;
+
+    // no more proc readers, they walk is18_devs
+    remove_proc_subtree(PROC_DIR, NULL);
+    device_destroy(is18_class, MKDEV(MAJOR(dev_num), max_devices));
+    cdev_del(&is18_ctl_cdev);
+
+    mutex_lock(&is18_devs_lock);
+    xa_for_each(&is18_devs, index, dev) {
+        printk("cleanup device %d\n", dev->device_number);
+        is18_destroy_dev(dev, true);
     }
+    mutex_unlock(&is18_devs_lock);
+    xa_destroy(&is18_devs);
 
     class_destroy(is18_class);
-    unregister_chrdev_region(dev_num, MINOR_COUNT);
-    remove_proc_entry(PROC_FILE, NULL);
+    unregister_chrdev_region(dev_num, max_devices + 1);
     printk(KERN_INFO "Remove my character driver %s\n", DRVNAME);
 }
 
+// Helpers for the ring state, see struct is18_cdev.
+
+// number of unread bytes (may exceed buffer_size for a moment, callers
+// only compare against 0 and buffer_size)
+static inline unsigned int is18_ring_used(struct is18_cdev *dev) {
+    return is18_core_used(dev->ctrl);
+}
+
+// number of bytes reader f has not read yet (is18_ring_used() outside of broadcast mode)
+static inline unsigned int is18_reader_used(struct is18_cdev *dev, struct is18_file *f) {
+    unsigned int cursor = READ_ONCE(dev->broadcast) ? READ_ONCE(f->cursor) : READ_ONCE(dev->ctrl->tail);
+    return smp_load_acquire(&dev->ctrl->head) - cursor;
+}
+
+// wakes up the other side, without taking the wait queue lock if nobody
+// is waiting (wq_has_sleeper() contains the required memory barrier).
+// events are the poll events which became true, so epoll can filter the wakeup.
+static inline void is18_wake(struct is18_cdev *dev, wait_queue_head_t *wq, __poll_t events) {
+    if(wq_has_sleeper(wq)) {
+        trace_is18_wake(dev->device_number, wq == &dev->wq_free_space_available, (__force unsigned int)events);
+        wake_up_poll(wq, events);
+    }
+}
+
+// is18_wake() for a waker which goes to sleep right after it: the woken task
+// is not moved to another CPU to run in parallel, it may take over ours.
+static inline void is18_wake_sync(struct is18_cdev *dev, wait_queue_head_t *wq, __poll_t events) {
+    if(wq_has_sleeper(wq)) {
+        trace_is18_wake(dev->device_number, wq == &dev->wq_free_space_available, (__force unsigned int)events);
+        wake_up_interruptible_sync_poll(wq, events);
+    }
+}
+
+// Wait entry of a reader (writer) with a threshold: the waker skips it until
+// want bytes (free bytes) are in the ring, an exclusive wakeup goes on to the
+// next waiter meanwhile. So a trickling writer doesn't wake the reader for
+// every few bytes only to let it sleep again, and a writer needing much space
+// doesn't swallow the wakeup a writer behind it could use.
+struct is18_lowat_wait {
+    struct wait_queue_entry wait;
+    struct is18_cdev *dev;
+    struct is18_file *f;
+    unsigned int want;
+    bool writer;
+    bool mpsc; // writer waiting for a reservation (is18_write_reserved)
+};
+
+// the conditions of the waits in is18_do_read, is18_write_reserved and is18_do_write
+static bool is18_lowat_ready(struct is18_lowat_wait *w) {
+    struct is18_cdev *dev = w->dev;
+    unsigned int used;
+
+    if(!w->writer) {
+        return is18_reader_used(dev, w->f) >= w->want || READ_ONCE(dev->gift);
+    }
+    if(w->mpsc) {
+        return READ_ONCE(dev->reserve) - READ_ONCE(dev->ctrl->tail) + w->want <= dev->buffer_size ||
+               !READ_ONCE(dev->mpsc);
+    }
+    used = is18_ring_used(dev);
+    return used + w->want <= dev->buffer_size || !used || READ_ONCE(dev->overwrite);
+}
+
+// called by the waker (wait queue lock held), 0: not woken
+static int is18_lowat_wake(struct wait_queue_entry *wait, unsigned int mode, int sync, void *key) {
+    struct is18_lowat_wait *w = container_of(wait, struct is18_lowat_wait, wait);
+
+    if(!is18_lowat_ready(w)) {
+        return 0;
+    }
+    return autoremove_wake_function(wait, mode, sync, key);
+}
+
+// Sleeps until w is ready, a signal is pending (-ERESTARTSYS) or *timeout
+// jiffies passed (-ETIMEDOUT, *timeout is the rest otherwise). Spins for
+// busy_poll_us first like is18_wait_event.
+static int is18_wait_lowat(wait_queue_head_t *wq, struct is18_lowat_wait *w, bool exclusive, long *timeout) {
+    unsigned int us = READ_ONCE(w->f->busy_poll_us);
+    int rv = 0;
+
+    if(us) {
+        u64 end = local_clock() + (u64)us * NSEC_PER_USEC;
+
+        while(!is18_lowat_ready(w) && !need_resched() && !signal_pending(current) &&
+              local_clock() < end) {
+            cpu_relax();
+        }
+    }
+    init_wait_func(&w->wait, is18_lowat_wake);
+    for(;;) {
+        if(exclusive) {
+            prepare_to_wait_exclusive(wq, &w->wait, TASK_INTERRUPTIBLE);
+        } else {
+            prepare_to_wait(wq, &w->wait, TASK_INTERRUPTIBLE);
+        }
+        if(is18_lowat_ready(w)) {
+            break;
+        }
+        if(signal_pending(current)) {
+            rv = -ERESTARTSYS;
+            break;
+        }
+        if(!*timeout) {
+            rv = -ETIMEDOUT;
+            break;
+        }
+        *timeout = schedule_timeout(*timeout);
+    }
+    finish_wait(wq, &w->wait);
+    return rv;
+}
+
+// timestamps for the duration fields of the tracepoints, only taken while
+// the event is enabled (0 otherwise)
+#define is18_trace_clock(event) (trace_##event##_enabled() ? ktime_get_ns() : 0)
+#define is18_trace_since(start) ((start) ? ktime_get_ns() - (start) : 0)
+
+// lock free maximum of the fill level, called by writers after publishing head
+static inline void is18_update_high_water(struct is18_cdev *dev, unsigned int used) {
+    int old = atomic_read(&dev->high_water);
+
+    while((int)used > old && !atomic_try_cmpxchg(&dev->high_water, &old, used)) {
+        // old was updated by atomic_try_cmpxchg --> compare again
+    }
+}
+
+// Stores a residency sample for the bytes up to end, called by writers
+// (holding write_lock) before they publish head = end.
+static inline void is18_stamp_write(struct is18_cdev *dev, unsigned int end) {
+    unsigned int head = dev->stamp_head;
+    struct is18_stamp *stamp;
+
+    // pairs with smp_store_release() in is18_stamp_read: the slot is free
+    if(head - smp_load_acquire(&dev->stamp_tail) >= IS18_STAMP_SLOTS) {
+        return;
+    }
+    stamp = &dev->stamps[head & (IS18_STAMP_SLOTS - 1)];
+    stamp->end = end;
+    stamp->ns = ktime_get_ns();
+    smp_store_release(&dev->stamp_head, head + 1);
+}
+
+// Takes the residency samples of all writes that were read completely,
+// called by readers (holding read_lock) after they published tail.
+static void is18_stamp_read(struct is18_cdev *dev, unsigned int tail) {
+    unsigned int pos = dev->stamp_tail;
+    // pairs with smp_store_release() in is18_stamp_write: the slot is filled
+    unsigned int head = smp_load_acquire(&dev->stamp_head);
+    u64 now = 0;
+
+    while(pos != head) {
+        const struct is18_stamp *stamp = &dev->stamps[pos & (IS18_STAMP_SLOTS - 1)];
+
+        if((int)(stamp->end - tail) > 0) {
+            // some bytes of this write are still in the ring
+            break;
+        }
+        if(!now) {
+            now = ktime_get_ns();
+        }
+        is18_lat_add(dev, IS18_LAT_RESIDENCY, now - stamp->ns);
+        ++pos;
+    }
+    smp_store_release(&dev->stamp_tail, pos);
+}
+
+// forgets all residency samples, called with the ring locked (is18_lock_ring)
+// whenever head and tail are reset
+static void is18_stamp_reset(struct is18_cdev *dev) {
+    dev->stamp_head = 0;
+    dev->stamp_tail = 0;
+}
+
+// clears the histograms (a concurrent update may survive the reset)
+static void is18_reset_latency(struct is18_cdev *dev) {
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        memset(per_cpu_ptr(dev->latency, cpu), 0, sizeof(struct is18_pcpu_latency));
+    }
+}
+
+// Broadcast mode: a byte is retired (tail moves on) once every reader has
+// read it. Called with read_lock held by a reader whose cursor just left old,
+// only the slowest reader (old == tail) can move tail. Returns true if it did.
+static bool is18_retire(struct is18_cdev *dev, unsigned int old) {
+    unsigned int tail = READ_ONCE(dev->ctrl->tail);
+    unsigned int behind = UINT_MAX;
+    struct is18_file *f;
+
+    if(old != tail || list_empty(&dev->readers)) {
+        return false;
+    }
+    list_for_each_entry(f, &dev->readers, reader) {
+        behind = min(behind, f->cursor - tail);
+    }
+    if(!behind) {
+        return false;
+    }
+    smp_store_release(&dev->ctrl->tail, tail + behind);
+    is18_stamp_read(dev, tail + behind);
+    return true;
+}
+
+// Lossy broadcast mode: the writer needs the space up to new_tail, readers
+// which are behind lose their oldest bytes. Called by the writer with
+// read_lock and write_lock held, so no reader is copying meanwhile.
+static void is18_overrun(struct is18_cdev *dev, unsigned int new_tail) {
+    unsigned int tail = READ_ONCE(dev->ctrl->tail);
+    struct is18_file *f;
+
+    list_for_each_entry(f, &dev->readers, reader) {
+        if((int)(new_tail - f->cursor) > 0) {
+            f->dropped += new_tail - f->cursor;
+            WRITE_ONCE(f->cursor, new_tail);
+        }
+    }
+    if((int)(new_tail - tail) > 0) {
+        smp_store_release(&dev->ctrl->tail, new_tail);
+        is18_stamp_read(dev, new_tail);
+    }
+}
+
+// moves the cursor of every reader to pos, e.g. after emptying the ring.
+// Must be called with read_lock held.
+static void is18_reset_cursors(struct is18_cdev *dev, unsigned int pos) {
+    struct is18_file *f;
+
+    list_for_each_entry(f, &dev->readers, reader) {
+        WRITE_ONCE(f->cursor, pos);
+    }
+}
+
+// empties the ring, must be called with the ring locked (is18_lock_ring)
+// or while nobody has the device open
+static void is18_ring_reset(struct is18_cdev *dev) {
+    is18_core_reset(dev->ctrl);
+    dev->reserve = 0;
+    is18_stamp_reset(dev);
+    is18_reset_cursors(dev, 0);
+    if(dev->gift) {
+        // discarded like the bytes in the ring, its writer returns
+        struct is18_gift *gift = dev->gift;
+
+        WRITE_ONCE(dev->gift, NULL);
+        smp_store_release(&gift->done, gift->len);
+    }
+}
+
+// Readers publish tail after copying the bytes in front of it out. In
+// overwrite mode the writer may have moved tail over these bytes meanwhile
+// and overwritten them: false is returned, the copy has to be discarded.
+// Must be called with read_lock held.
+static inline bool is18_release_tail(struct is18_cdev *dev, unsigned int tail, unsigned int new_tail) {
+    if(!dev->overwrite) {
+        smp_store_release(&dev->ctrl->tail, new_tail);
+        return true;
+    }
+    // full barrier: the copy is done before, the writer only overwrites after moving tail
+    return try_cmpxchg(&dev->ctrl->tail, &tail, new_tail);
+}
+
+// sums up the per CPU counters (the single counters may be slightly
+// out of date against each other, they are not read under a lock)
+static void is18_get_stats(struct is18_cdev *dev, struct is18_stats *st) {
+    int cpu;
+
+    memset(st, 0, sizeof(*st));
+    st->version = IS18_STATS_VERSION;
+    st->size = sizeof(*st);
+    for_each_possible_cpu(cpu) {
+        const struct is18_pcpu_stats *pcpu = per_cpu_ptr(dev->stats, cpu);
+
+        st->bytes_in += READ_ONCE(pcpu->bytes_in);
+        st->bytes_out += READ_ONCE(pcpu->bytes_out);
+        st->reads += READ_ONCE(pcpu->reads);
+        st->writes += READ_ONCE(pcpu->writes);
+        st->read_blocked += READ_ONCE(pcpu->read_blocked);
+        st->write_blocked += READ_ONCE(pcpu->write_blocked);
+        st->eagain += READ_ONCE(pcpu->eagain);
+        st->enospc += READ_ONCE(pcpu->enospc);
+        st->overwritten += READ_ONCE(pcpu->overwritten);
+    }
+    st->high_water = atomic_read(&dev->high_water);
+}
+
+// The data path takes sem_sync only if the device is shared by more than one
+// reader or writer. Must be called with sem_sync held after changing the open counts.
+static void is18_update_spsc(struct is18_cdev *dev) {
+    WRITE_ONCE(dev->spsc, dev->current_open_read_cnt == 1 && dev->current_open_write_cnt == 1);
+}
+
+// Exclusive access to the whole ring (both sides of the data path and the
+// device state), e.g. for resetting or resizing it.
+// Lock order is always read_lock -> write_lock -> mpsc_sem -> sem_sync -> map_lock.
+static int is18_lock_ring(struct is18_cdev *dev) {
+    if(mutex_lock_interruptible(&dev->read_lock)) {
+        return -ERESTARTSYS;
+    }
+    if(mutex_lock_interruptible(&dev->write_lock)) {
+        mutex_unlock(&dev->read_lock);
+        return -ERESTARTSYS;
+    }
+    // waits for the pending reservations of MPSC writers
+    if(down_write_killable(&dev->mpsc_sem)) {
+        mutex_unlock(&dev->write_lock);
+        mutex_unlock(&dev->read_lock);
+        return -ERESTARTSYS;
+    }
+    if(down_interruptible(&dev->sem_sync)) {
+        up_write(&dev->mpsc_sem);
+        mutex_unlock(&dev->write_lock);
+        mutex_unlock(&dev->read_lock);
+        return -ERESTARTSYS;
+    }
+    // only held for short, by is18_mmap
+    mutex_lock(&dev->map_lock);
+    return 0;
+}
+
+static void is18_unlock_ring(struct is18_cdev *dev) {
+    mutex_unlock(&dev->map_lock);
+    up(&dev->sem_sync);
+    up_write(&dev->mpsc_sem);
+    mutex_unlock(&dev->write_lock);
+    mutex_unlock(&dev->read_lock);
+}
+
+// NUMA node the ring pages are on (the first page, the others were
+// allocated on the same node unless it was full)
+static int is18_ring_node(struct is18_cdev *dev) {
+    return dev->pages ? page_to_nid(dev->pages[0]) : NUMA_NO_NODE;
+}
+
+// Replaces the ring by a new empty one of size bytes on node, for resizing
+// or moving it. Only allowed while the ring is empty and not mapped.
+static int is18_replace_ring(struct is18_cdev *dev, int size, int node) {
+    char *new_buffer;
+    struct page **new_pages;
+    unsigned int new_nr_pages;
+
+    // allocate outside of the critical section - may sleep for large rings
+    new_buffer = is18_alloc_ring(size, node, &new_pages, &new_nr_pages);
+    if (!new_buffer) {
+        return -ENOMEM;
+    }
+
+    if(is18_lock_ring(dev)) {
+        is18_free_ring(new_buffer, new_pages, new_nr_pages);
+        return -ERESTARTSYS;
+    }
+    if (is18_ring_used(dev) || atomic_read(&dev->mmap_cnt)) {
+        // resizing is only allowed while the ring is empty and not mapped
+        is18_unlock_ring(dev);
+        is18_free_ring(new_buffer, new_pages, new_nr_pages);
+        return -EBUSY;
+    }
+    // an empty ring has no content worth keeping --> just swap it
+    swap(dev->buffer, new_buffer);
+    swap(dev->pages, new_pages);
+    swap(dev->nr_pages, new_nr_pages);
+    dev->buffer_size = size;
+    dev->buffer_mask = size - 1;
+    dev->numa_node = node;
+    WRITE_ONCE(dev->ctrl->buffer_size, size);
+    is18_ring_reset(dev);
+    is18_unlock_ring(dev);
+
+    // writers may wait for the additional space, all of them check again
+    wake_up_all(&dev->wq_free_space_available);
+    is18_free_ring(new_buffer, new_pages, new_nr_pages);
+    return 0;
+}
+
 static int is18_open(struct inode *inode, struct file *filp) {
     // container_of returns start adress of my device based on the offset from inode->i_cdev
     struct is18_cdev *dev = container_of(inode->i_cdev, struct is18_cdev, chdev);
+    struct is18_file *f;
+    int rv;
+
     //remember device in pricate data of device
     //enables easier access is is18_read & is18_write
-    filp->private_data = dev;
-
+    //(together with the state of this file, e.g. the cursor of a broadcast reader)
+    f = kzalloc(sizeof(*f), GFP_KERNEL);
+    if(!f) {
+        return -ENOMEM;
+    }
+    f->dev = dev;
+    INIT_LIST_HEAD(&f->reader);
+    f->busy_poll_us = clamp(READ_ONCE(busy_poll), 0, IS18_BUSY_POLL_MAX);
+    filp->private_data = f;
+    // read_iter/write_iter honour IOCB_NOWAIT --> io_uring may submit inline
+    filp->f_mode |= FMODE_NOWAIT;
 
     if(down_interruptible(&dev->sem_sync)) {
-        return -ERESTARTSYS;
+        rv = -ERESTARTSYS;
+        goto err;
+    }
+    if(dev->dead) {
+        // destroyed via /dev/is18ctl after the lookup
+        up(&dev->sem_sync);
+        rv = -ENODEV;
+        goto err;
     }
 
     if(filp->f_mode & FMODE_WRITE) {
         // file opened with write rights
         ++dev->current_open_write_cnt;
         if(!dev->buffer) {
-            dev->buffer = kmalloc(BUFFER_SIZE, GFP_KERNEL);
+            // NUMA_NO_NODE --> the ring lives on the node of the first writer
+            mutex_lock(&dev->map_lock);
+            dev->buffer = is18_alloc_ring(dev->buffer_size, dev->numa_node, &dev->pages, &dev->nr_pages);
+            mutex_unlock(&dev->map_lock);
+            if(!dev->buffer) {
+                --dev->current_open_write_cnt;
+                up(&dev->sem_sync);
+                rv = -ENOMEM;
+                goto err;
+            }
         }
         complete_all(&dev->comp_buffer_initialized);
     }
 
 
     if(filp->f_mode & FMODE_READ) {
-        if(!dev->buffer) {
+        // the ring of an idle device may be freed again while we wait --> check again
+        while(!dev->buffer) {
             if((filp->f_flags & O_NONBLOCK) | (filp->f_flags & O_NDELAY )) {
                 // no blocking/waiting allowed
-                printk(KERN_INFO "is18drv: open in NON-blocking mode");
+                pr_debug("is18drv: open in NON-blocking mode");
                 up(&dev->sem_sync);
-                return -EAGAIN;
+                rv = -EAGAIN;
+                goto err;
             } else {
                 // Readers that are not also writers and want to block until a buffer is available should wait here.
                 if(!(filp->f_mode & FMODE_WRITE)) {
                     up(&dev->sem_sync);
-                    printk(KERN_INFO "is18drv: 'open' will be delayed - waiting for init buffer completed\n");
+                    pr_debug("is18drv: 'open' will be delayed - waiting for init buffer completed\n");
 
                     if(wait_for_completion_interruptible(&dev->comp_buffer_initialized) == -ERESTARTSYS) {
-                        return -ERESTARTSYS;
+                        rv = -ERESTARTSYS;
+                        goto err;
                     }
-                    printk(KERN_INFO "is18drv: init buffer completed - will open now\n");
+                    pr_debug("is18drv: init buffer completed - will open now\n");
 
                     if(down_interruptible(&dev->sem_sync)) {
-                        return -ERESTARTSYS;
+                        rv = -ERESTARTSYS;
+                        goto err;
+                    }
+                    if(dev->dead) {
+                        up(&dev->sem_sync);
+                        rv = -ENODEV;
+                        goto err;
                     }
                 }
             }
@@ -232,20 +1110,46 @@ static int is18_open(struct inode *inode, struct file *filp) {
         // file opened with read rights
         ++dev->current_open_read_cnt;
     }
+    is18_update_spsc(dev);
 
-    printk(KERN_INFO "is18drv: 'open' is called! read_cnt: %d, write_cnt: %d\n", dev->current_open_read_cnt, dev->current_open_write_cnt);
+    pr_debug("is18drv: 'open' is called! read_cnt: %d, write_cnt: %d\n", dev->current_open_read_cnt, dev->current_open_write_cnt);
     up(&dev->sem_sync);
 
+    if(filp->f_mode & FMODE_READ) {
+        // a new reader gets the bytes that are in the ring (in broadcast mode as well)
+        mutex_lock(&dev->read_lock);
+        f->cursor = READ_ONCE(dev->ctrl->tail);
+        list_add_tail(&f->reader, &dev->readers);
+        mutex_unlock(&dev->read_lock);
+    }
+
     return 0;
+
+err:
+    kfree(f);
+    return rv;
 }
 
 static int is18_close(struct inode *inode, struct file *filp) {
-    struct is18_cdev *dev = filp->private_data;
+    struct is18_file *f = filp->private_data;
+    struct is18_cdev *dev = f->dev;
 
-    if(down_interruptible(&dev->sem_sync)) {
-        return -ERESTARTSYS;
+    if(filp->f_mode & FMODE_READ) {
+        bool retired;
+
+        // the bytes only this reader was missing are retired now
+        mutex_lock(&dev->read_lock);
+        list_del(&f->reader);
+        retired = dev->broadcast && is18_retire(dev, f->cursor);
+        mutex_unlock(&dev->read_lock);
+        if(retired) {
+            wake_up(&dev->wq_free_space_available);
+        }
     }
 
+    // the return value of release is ignored, the counts have to be right
+    down(&dev->sem_sync);
+
     if(filp->f_mode & FMODE_READ) {
         // file with read rights closed
         --dev->current_open_read_cnt;
@@ -255,143 +1159,1493 @@ static int is18_close(struct inode *inode, struct file *filp) {
         // file with write rights closed
         --dev->current_open_write_cnt;
     }
+    is18_update_spsc(dev);
+
+    pr_debug("is18drv: 'close' is called! read_cnt: %d, write_cnt: %d\n", dev->current_open_read_cnt, dev->current_open_write_cnt);
+
+    // pollers on the reading side have to see the hangup
+    if((filp->f_mode & FMODE_WRITE) && !dev->current_open_write_cnt) {
+        wake_up_poll(&dev->wq_read_data_available, EPOLLHUP);
+    }
 
-    printk(KERN_INFO "is18drv: 'close' is called! read_cnt: %d, write_cnt: %d\n", dev->current_open_read_cnt, dev->current_open_write_cnt);
+    // Idle device: nobody has it open (so no data path is running) and the
+    // ring is empty --> give the memory back, the next writer allocates a new
+    // ring. Bytes left in the ring are kept for the next reader.
+    if(!dev->current_open_read_cnt && !dev->current_open_write_cnt && dev->buffer &&
+       !is18_ring_used(dev) && !atomic_read(&dev->mmap_cnt)) {
+        mutex_lock(&dev->map_lock);
+        is18_free_ring(dev->buffer, dev->pages, dev->nr_pages);
+        dev->buffer = NULL;
+        dev->pages = NULL;
+        dev->nr_pages = 0;
+        mutex_unlock(&dev->map_lock);
+        is18_ring_reset(dev);
+        // readers block in open() again until there is a writer
+        reinit_completion(&dev->comp_buffer_initialized);
+    }
 
     up(&dev->sem_sync);
+    kfree(f);
 
     return 0;
 }
 
-static ssize_t is18_read(struct file *filp, char __user *buff, size_t count, loff_t *offset) {
-    int i;
-    ssize_t copied = 0;
-    struct is18_cdev *dev = filp->private_data;
-
-    printk(KERN_INFO "is18drv: 'read' is called!\n");
-
-    if(down_interruptible(&dev->sem_sync)) {
+// Takes the locks a reader (read_lock) or writer (write_lock) needs for the
+// data path. In single producer / single consumer mode the side lock is all
+// we need, it is never contended by the other side. Otherwise sem_sync is
+// taken as well, *shared tells whether sem_sync is held.
+// An overwrite mode writer never takes sem_sync: it must not sleep behind a
+// reader copying (and faulting) with sem_sync held, it only races with
+// readers for tail and that is done with cmpxchg (is18_overwrite,
+// is18_release_tail). The mode is stable while we hold write_lock.
+// nowait: only try the locks and return -EAGAIN if one is contended.
+static int is18_lock_side(struct is18_cdev *dev, struct mutex *side_lock, bool *shared, bool nowait) {
+    if(nowait) {
+        if(!mutex_trylock(side_lock)) {
+            return -EAGAIN;
+        }
+    } else if(mutex_lock_interruptible(side_lock)) {
         return -ERESTARTSYS;
     }
+    *shared = !READ_ONCE(dev->spsc) && !(side_lock == &dev->write_lock && dev->overwrite);
+    if(*shared) {
+        if(nowait ? down_trylock(&dev->sem_sync) : down_interruptible(&dev->sem_sync)) {
+            mutex_unlock(side_lock);
+            return nowait ? -EAGAIN : -ERESTARTSYS;
+        }
+    }
+    return 0;
+}
+
+static void is18_unlock_side(struct is18_cdev *dev, struct mutex *side_lock, bool shared) {
+    if(shared) {
+        up(&dev->sem_sync);
+    }
+    mutex_unlock(side_lock);
+}
 
-    for(i = 0; i < count; ++i) {
-        if(dev->current_pipe_bytes <= 0) {
-            // --> pipe is empty
-            if((filp->f_flags & O_NONBLOCK) | (filp->f_flags & O_NDELAY )) {
-                // no blocking/waiting allowed
-                printk(KERN_INFO "read in NON-blocking mode");
-                up(&dev->sem_sync); // Semaphore freigeben
-                return copied;
-            }
-            printk(KERN_INFO "read in blocking mode - nonblock: %d - ndelay: %d \n", filp->f_flags & O_NONBLOCK,  filp->f_flags & O_NDELAY );
-            while(dev->current_pipe_bytes < 1) {
-                //wait for content
-                pr_info("is18drv: please wait, currently no data for reading available...\n");
-                // release sem before waiting
-                up(&dev->sem_sync);
-                // wait until space is available again
-                if(wait_event_interruptible(dev->wq_read_data_available,
-                                            (dev->current_pipe_bytes > 0)) != 0 ) {
-                    return -ERESTARTSYS;
-                }
-                // space is available again --> get semaphore again
-                if(down_interruptible(&dev->sem_sync)) {
-                    return -ERESTARTSYS;
+// is18_lock_side() for writers. A lossy broadcast writer moves the cursors of
+// the readers (is18_overrun) and needs read_lock as well, *lossy tells
+// whether it is held.
+static int is18_lock_writer(struct is18_cdev *dev, bool *shared, bool *lossy, bool nowait) {
+    int rv;
+
+    for(;;) {
+        *lossy = READ_ONCE(dev->broadcast) == IS18_BROADCAST_LOSSY;
+        if(*lossy) {
+            if(nowait) {
+                if(!mutex_trylock(&dev->read_lock)) {
+                    return -EAGAIN;
                 }
+            } else if(mutex_lock_interruptible(&dev->read_lock)) {
+                return -ERESTARTSYS;
             }
-
-
         }
-        //still free space for at least 1 byte
-        if (put_user(dev->buffer[dev->next_read_index], buff + i) != 0) {
+        rv = is18_lock_side(dev, &dev->write_lock, shared, nowait);
+        if(rv || *lossy == (dev->broadcast == IS18_BROADCAST_LOSSY)) {
+            break;
+        }
+        // the mode was switched before we got the locks
+        is18_unlock_side(dev, &dev->write_lock, *shared);
+        if(*lossy) {
+            mutex_unlock(&dev->read_lock);
+        }
+    }
+    if(!rv && dev->mpsc) {
+        // switched to MPSC mode by this fd meanwhile
+        is18_unlock_side(dev, &dev->write_lock, *shared);
+        rv = -EINVAL;
+    }
+    if(rv && *lossy) {
+        mutex_unlock(&dev->read_lock);
+    }
+    return rv;
+}
+
+static void is18_unlock_writer(struct is18_cdev *dev, bool shared, bool lossy) {
+    is18_unlock_side(dev, &dev->write_lock, shared);
+    if(lossy) {
+        mutex_unlock(&dev->read_lock);
+    }
+}
+
+// flags for is18_do_read/is18_do_write
+#define IS18_NONBLOCK 0x1   // return instead of waiting for data/space
+#define IS18_NOWAIT 0x2     // IOCB_NOWAIT: don't sleep on the locks either, report -EAGAIN (implies IS18_NONBLOCK)
+#define IS18_WAIT_ALL 0x4   // read: block until the whole iov_iter is filled (read() semantics)
+
+// O_NONBLOCK and O_NDELAY both mean: no blocking/waiting allowed
+static inline int is18_nonblock(struct file *filp) {
+    return ((filp->f_flags & O_NONBLOCK) | (filp->f_flags & O_NDELAY)) ? IS18_NONBLOCK : 0;
+}
+
+// copies len bytes at counter pos out of the ring, handles the wrap
+static void is18_ring_peek(struct is18_cdev *dev, unsigned int pos, void *dst, size_t len) {
+    is18_core_copy_out(dev->buffer, dev->buffer_size, pos, dst, len);
+}
+
+// copies len bytes into the ring at counter pos, handles the wrap
+static void is18_ring_poke(struct is18_cdev *dev, unsigned int pos, const void *src, size_t len) {
+    is18_core_copy_in(dev->buffer, dev->buffer_size, pos, src, len);
+}
+
+// zeroes len bytes of the ring at counter pos
+static void is18_ring_clear(struct is18_cdev *dev, unsigned int pos, size_t len) {
+    is18_core_clear(dev->buffer, dev->buffer_size, pos, len);
+}
+
+// copies len bytes at counter pos out of the ring into an iov_iter,
+// returns the number of copied bytes (less on a fault)
+static size_t is18_ring_to_iter(struct is18_cdev *dev, unsigned int pos, size_t len, struct iov_iter *to) {
+    size_t first = is18_core_run(pos, dev->buffer_size, len);
+    size_t done = copy_to_iter(dev->buffer + is18_core_index(pos, dev->buffer_size), first, to);
+
+    if(done < first) {
+        return done;
+    }
+    return done + copy_to_iter(dev->buffer, len - first, to);
+}
+
+// copies len bytes from an iov_iter into the ring at counter pos,
+// returns the number of copied bytes (less on a fault)
+static size_t is18_ring_from_iter(struct is18_cdev *dev, unsigned int pos, size_t len, struct iov_iter *from) {
+    size_t first = is18_core_run(pos, dev->buffer_size, len);
+    size_t done = copy_from_iter(dev->buffer + is18_core_index(pos, dev->buffer_size), first, from);
+
+    if(done < first) {
+        return done;
+    }
+    return done + copy_from_iter(dev->buffer, len - first, from);
+}
+
+// Copies want bytes of the pending gift to the reader, straight from the
+// pages of the writer (read_lock held). The last bytes end the gift: once
+// done == len the writer drops its page references and returns, don't touch it after that.
+static size_t is18_read_gift(struct is18_cdev *dev, struct is18_gift *gift, struct iov_iter *to, size_t want) {
+    size_t done = 0;
+
+    while(done < want) {
+        size_t pos = gift->offset + gift->done + done;
+        size_t off = offset_in_page(pos);
+        size_t n = min_t(size_t, want - done, PAGE_SIZE - off);
+        size_t c = copy_page_to_iter(gift->pages[pos >> PAGE_SHIFT], off, n, to);
+
+        done += c;
+        if(c < n) {
+            break;
+        }
+    }
+    if(gift->done + done < gift->len) {
+        WRITE_ONCE(gift->done, gift->done + done);
+    } else {
+        // the bytes written after the gift come next
+        WRITE_ONCE(dev->gift, NULL);
+        smp_store_release(&gift->done, gift->len);
+        wake_up(&dev->wq_free_space_available);
+    }
+    return done;
+}
+
+// Packet mode: takes whole messages (header + payload) starting at tail.
+// msgs == NULL: read() - the payload of one message, the part that does not
+// fit into the iov_iter is discarded (like a pipe in packet mode).
+// msgs != NULL: IS18_IOC_READ_BATCH - as many whole messages as fit, each
+// with its header, *msgs returns how many.
+// Returns the number of copied bytes, the consumed messages are removed.
+// -EAGAIN: the messages were overwritten while we copied them (overwrite
+// mode), nothing was consumed and the caller reads again.
+static ssize_t is18_read_packets(struct is18_cdev *dev, unsigned int tail, unsigned int used,
+                                 struct iov_iter *to, unsigned int *msgs) {
+    ssize_t copied = 0;
+    unsigned int pos = tail;
+
+    if(msgs) {
+        *msgs = 0;
+    }
+    while(pos - tail < used) {
+        unsigned int left = used - (pos - tail);
+        __u32 len = 0;
+        size_t want;
+
+        if(left >= IS18_PACKET_HDR_SIZE) {
+            is18_ring_peek(dev, pos, &len, IS18_PACKET_HDR_SIZE);
+        }
+        if(left < IS18_PACKET_HDR_SIZE || len > left - IS18_PACKET_HDR_SIZE) {
+            // overwrite mode: the writer moved tail before it overwrote the header
+            smp_rmb();
+            if(READ_ONCE(dev->ctrl->tail) != tail) {
+                iov_iter_revert(to, max_t(ssize_t, copied, 0));
+                return -EAGAIN;
+            }
+            // can not happen, writes store whole messages
+            pr_err_ratelimited("is18drv: corrupt message header %u at %u\n", len, pos);
+            copied = copied ? copied : -EIO;
+            break;
+        }
+        if(!msgs) {
+            want = min_t(size_t, len, iov_iter_count(to));
+            if(is18_ring_to_iter(dev, pos + IS18_PACKET_HDR_SIZE, want, to) < want) {
+                return -EFAULT;
+            }
+            copied = want;
+            pos += IS18_PACKET_HDR_SIZE + len;
+            break;
+        }
+        want = IS18_PACKET_HDR_SIZE + len;
+        if(want > iov_iter_count(to)) {
+            // the first message has to fit at least
+            copied = copied ? copied : -EMSGSIZE;
+            break;
+        }
+        if(is18_ring_to_iter(dev, pos, want, to) < want) {
+            // messages are only removed once they were copied completely
+            copied = copied ? copied : -EFAULT;
+            break;
+        }
+        copied += want;
+        pos += want;
+        ++*msgs;
+    }
+
+    // hand the space back to the writer after the data was copied out
+    if(!is18_release_tail(dev, tail, pos)) {
+        // overwrite mode: the writer dropped the messages while we copied them
+        iov_iter_revert(to, max_t(ssize_t, copied, 0));
+        return -EAGAIN;
+    }
+    is18_stamp_read(dev, pos);
+    if(copied > 0) {
+        is18_stat_add(dev, bytes_out, copied);
+    }
+    return copied;
+}
+
+// Moves bytes out of the ring into an iov_iter (user buffer, iovec array,
+// pipe, ...). The whole iov_iter is handled under one lock acquisition.
+// flags: IS18_NONBLOCK, IS18_NOWAIT and IS18_WAIT_ALL, without IS18_WAIT_ALL
+// it returns as soon as some bytes were copied.
+// In packet mode one message is read, or a batch of whole messages if msgs
+// is given (see is18_read_packets). In broadcast mode f reads from its own
+// cursor, the bytes are retired once every reader has them.
+static ssize_t is18_do_read(struct is18_cdev *dev, struct is18_file *f, struct iov_iter *to, int flags,
+                            unsigned int *msgs) {
+    ssize_t copied = 0;
+    size_t count = iov_iter_count(to);
+    bool nowait = flags & IS18_NOWAIT;
+    bool woken = false; // got the exclusive wakeup of a writer
+    bool shared;
+    int rv;
+    u64 start = is18_trace_clock(is18_read);
+    // max delay of the low watermark, after it the read returns what it has
+    unsigned int delay = READ_ONCE(f->rcvdelay_us);
+    unsigned long deadline = jiffies + usecs_to_jiffies(delay);
+    bool expired = false;
+
+    is18_stat_inc(dev, reads);
+    rv = is18_lock_side(dev, &dev->read_lock, &shared, nowait);
+    if(rv) {
+        if(rv == -EAGAIN) {
+            is18_stat_inc(dev, eagain);
+        }
+        return rv;
+    }
+    if(msgs && !dev->packet) {
+        is18_unlock_side(dev, &dev->read_lock, shared);
+        return -EINVAL;
+    }
+
+    while(copied < count) {
+        // only changed with read_lock held (is18_lock_ring)
+        bool broadcast = dev->broadcast;
+        // only changed by readers (and lossy writers) --> we hold read_lock,
+        // in overwrite mode the writer moves it as well (is18_release_tail notices)
+        unsigned int tail = broadcast ? f->cursor : READ_ONCE(dev->ctrl->tail);
+        // pairs with smp_store_release() of the writer: data is visible before head,
+        // a mapping user space producer may have stored garbage
+        unsigned int used = is18_core_fill(smp_load_acquire(&dev->ctrl->head), tail, dev->buffer_size);
+        struct is18_gift *gift;
+        unsigned int want = 1;
+        size_t chunk;
+        size_t done;
+
+        // loaded after head: the bytes after a gift are written after it was posted
+        gift = broadcast ? NULL : smp_load_acquire(&dev->gift);
+        if(gift) {
+            if(tail == gift->pos) {
+                // the bytes in front of the gift are read --> copy from the writer's pages
+                size_t take = min_t(size_t, count - copied, gift->len - gift->done);
+
+                done = is18_read_gift(dev, gift, to, take);
+                copied += done;
+                is18_stat_add(dev, bytes_out, done);
+                if(done < take) {
+                    if (!copied) {
+                        copied = -EFAULT;
+                    }
+                    break;
+                }
+                continue;
+            }
+            used = min_t(unsigned int, used, gift->pos - tail);
+        }
+        // low watermark: a read which may block waits for more than the first
+        // bytes (a nonblocking read takes what is there)
+        if(!expired && !gift && !(flags & (IS18_NONBLOCK | IS18_NOWAIT)) &&
+           (!copied || (flags & IS18_WAIT_ALL))) {
+            want = clamp_t(size_t, READ_ONCE(f->rcvlowat), 1,
+                           min_t(size_t, count - copied, dev->buffer_size));
+        }
+        if(used < want) {
+            u64 sleep_start;
+            u64 slept;
+
+            // --> pipe is empty
+            if(flags & (IS18_NONBLOCK | IS18_NOWAIT)) {
+                // no blocking/waiting allowed
+                break;
+            }
+            if(copied && (!(flags & IS18_WAIT_ALL) || expired)) {
+                break;
+            }
+            // a writer may wait for the space we already freed, we sleep next
+            if(copied) {
+                is18_wake_sync(dev, &dev->wq_free_space_available, EPOLLOUT | EPOLLWRNORM);
+            }
+            //wait for content
+            // release locks before waiting
+            is18_unlock_side(dev, &dev->read_lock, shared);
+            // a mapping producer has to notify us (barrier is in wait_event)
+            WRITE_ONCE(dev->ctrl->reader_waiting, 1);
+            is18_stat_inc(dev, read_blocked);
+            sleep_start = ktime_get_ns();
+            // a broadcast reader needs every byte --> not exclusive, otherwise
+            // a writer wakes one reader instead of all of them
+            if(!expired && (want > 1 || delay)) {
+                struct is18_lowat_wait w = {.dev = dev, .f = f, .want = want};
+                long timeout = delay ? max_t(long, (long)(deadline - jiffies), 0) : MAX_SCHEDULE_TIMEOUT;
+
+                rv = is18_wait_lowat(&dev->wq_read_data_available, &w, !broadcast, &timeout);
+                if(rv == -ETIMEDOUT) {
+                    // the bytes which are there are delivered now
+                    expired = true;
+                    rv = 0;
+                }
+            } else {
+                rv = is18_wait_event(f, dev->wq_read_data_available,
+                                     (is18_reader_used(dev, f) > 0 || READ_ONCE(dev->gift)), !broadcast);
+            }
+            woken = woken || !broadcast;
+            slept = ktime_get_ns() - sleep_start;
+            is18_lat_add(dev, IS18_LAT_BLOCKED_EMPTY, slept);
+            trace_is18_block(dev->device_number, false, used, want, rv, slept);
+            if(rv) {
+                copied = copied ? copied : -ERESTARTSYS;
+                goto out;
+            }
+            // data is available again --> get locks again (the mode may have changed meanwhile)
+            if(is18_lock_side(dev, &dev->read_lock, &shared, false)) {
+                copied = copied ? copied : -ERESTARTSYS;
+                goto out;
+            }
+            continue;
+        }
+
+        if(dev->packet) {
+            // a stream read that already got bytes must not swallow a message
+            // (only possible if the mode was switched while we slept)
+            if(!copied) {
+                copied = is18_read_packets(dev, tail, used, to, msgs);
+                if(copied == -EAGAIN) {
+                    // overwritten while we copied, the writer has made room at the new tail
+                    copied = 0;
+                    continue;
+                }
+            }
+            break;
+        }
+
+        // largest contiguous run: limited by the request, the fill level
+        // and the end of the ring (a wrapped ring needs a second run)
+        chunk = is18_core_run(tail, dev->buffer_size, min_t(size_t, count - copied, used));
+
+        // returns: num of copied bytes, less on a fault (or a full pipe)
+        done = copy_to_iter(dev->buffer + is18_core_index(tail, dev->buffer_size), chunk, to);
+
+        if(broadcast) {
+            // the space goes back to the writer once the slowest reader is done
+            WRITE_ONCE(f->cursor, tail + done);
+            is18_retire(dev, tail);
+        } else if(is18_release_tail(dev, tail, tail + done)) {
+            // the space was handed back to the writer after the data was copied out
+            is18_stamp_read(dev, tail + done);
+        } else {
+            // overwrite mode: the bytes were overwritten while we copied them,
+            // read again from the new tail
+            iov_iter_revert(to, done);
+            continue;
+        }
+        copied += done;
+        is18_stat_add(dev, bytes_out, done);
+
+        if(done < chunk) {
             if (!copied) {
                 copied = -EFAULT;
             }
             break;
         }
+    }
 
-        ++copied;
-        --dev->current_pipe_bytes;
-        ++dev->next_read_index;
-        dev->next_read_index %= BUFFER_SIZE;
+    is18_unlock_side(dev, &dev->read_lock, shared);
 
-        printk(KERN_INFO "is18drv: copied %ld\n",copied);
-        printk(KERN_INFO "is18drv: dev->current_pipe_bytes %d\n",dev->current_pipe_bytes);
-        printk(KERN_INFO "is18drv: dev->next_write_index %d\n",dev->next_write_index);
-        wake_up(&dev->wq_free_space_available);
+out:
+    // one wakeup per syscall instead of one per byte
+    if(copied > 0) {
+        is18_wake(dev, &dev->wq_free_space_available, EPOLLOUT | EPOLLWRNORM);
+    }
+    // we took the wakeup of a writer: the bytes we left (or did not take
+    // because of a signal) go to the next waiting reader
+    if(woken && (is18_ring_used(dev) || READ_ONCE(dev->gift))) {
+        is18_wake(dev, &dev->wq_read_data_available, EPOLLIN | EPOLLRDNORM);
     }
+    trace_is18_read(dev->device_number, count, copied, READ_ONCE(dev->ctrl->head),
+                    READ_ONCE(dev->ctrl->tail), shared, is18_trace_since(start));
+
+    if(!copied && count && (flags & (IS18_NONBLOCK | IS18_NOWAIT))) {
+        // a nonblocking read() returns 0 on an empty ring, counted as EAGAIN as well
+        is18_stat_inc(dev, eagain);
+        // io_uring arms poll and retries on -EAGAIN
+        if(nowait) {
+            return -EAGAIN;
+        }
+    }
+    return copied;
+}
 
-    up(&dev->sem_sync);
+// IS18_IOC_DEL_COUNT: drops up to count unread bytes of f without copying
+// them, only tail (the cursor of f in broadcast mode) moves on. Not in
+// packet mode, it would cut messages. Stops at a pending zero copy write.
+// Returns the number of dropped bytes.
+static ssize_t is18_discard(struct is18_cdev *dev, struct is18_file *f, size_t count) {
+    ssize_t dropped;
+    bool shared;
+    int rv;
+
+    rv = is18_lock_side(dev, &dev->read_lock, &shared, false);
+    if(rv) {
+        return rv;
+    }
+    if(dev->packet) {
+        is18_unlock_side(dev, &dev->read_lock, shared);
+        return -EINVAL;
+    }
+    for(;;) {
+        // only changed with read_lock held (is18_lock_ring)
+        bool broadcast = dev->broadcast;
+        unsigned int tail = broadcast ? f->cursor : READ_ONCE(dev->ctrl->tail);
+        unsigned int used = is18_core_fill(smp_load_acquire(&dev->ctrl->head), tail, dev->buffer_size);
+        struct is18_gift *gift = broadcast ? NULL : smp_load_acquire(&dev->gift);
+
+        if(gift) {
+            used = min_t(unsigned int, used, gift->pos - tail);
+        }
+        dropped = min_t(size_t, count, used);
+        if(broadcast) {
+            WRITE_ONCE(f->cursor, tail + dropped);
+            is18_retire(dev, tail);
+            break;
+        }
+        if(is18_release_tail(dev, tail, tail + dropped)) {
+            is18_stamp_read(dev, tail + dropped);
+            break;
+        }
+        // overwrite mode: the writer moved tail meanwhile, drop from the new tail
+    }
+    is18_unlock_side(dev, &dev->read_lock, shared);
 
+    if(dropped) {
+        is18_wake(dev, &dev->wq_free_space_available, EPOLLOUT | EPOLLWRNORM);
+    }
+    return dropped;
+}
+
+// IS18_IOC_PEEK: copies up to len unread bytes of f, starting offset bytes
+// after its read position, to buf without consuming them. Never blocks.
+// Sets *avail to the number of unread bytes, returns the number of copied bytes.
+static ssize_t is18_peek(struct is18_cdev *dev, struct is18_file *f, char __user *buf, size_t len,
+                         size_t offset, unsigned int *avail) {
+    ssize_t copied;
+    bool shared;
+    int rv;
+
+    rv = is18_lock_side(dev, &dev->read_lock, &shared, false);
+    if(rv) {
+        return rv;
+    }
+    for(;;) {
+        bool broadcast = dev->broadcast;
+        unsigned int tail = broadcast ? f->cursor : READ_ONCE(dev->ctrl->tail);
+        unsigned int used = is18_core_fill(smp_load_acquire(&dev->ctrl->head), tail, dev->buffer_size);
+        struct is18_gift *gift = broadcast ? NULL : smp_load_acquire(&dev->gift);
+        unsigned int pos = tail + offset;
+        size_t first;
+
+        if(gift) {
+            // the bytes of the gift are in the pages of the writer
+            used = min_t(unsigned int, used, gift->pos - tail);
+        }
+        *avail = used;
+        if(offset >= used) {
+            copied = 0;
+            break;
+        }
+        copied = min_t(size_t, len, used - offset);
+        first = is18_core_run(pos, dev->buffer_size, copied);
+        if(copy_to_user(buf, dev->buffer + is18_core_index(pos, dev->buffer_size), first) ||
+           copy_to_user(buf + first, dev->buffer, copied - first)) {
+            copied = -EFAULT;
+            break;
+        }
+        // overwrite mode: the writer moves tail before it overwrites bytes,
+        // if it did while we copied the copy may be garbage --> again
+        smp_rmb();
+        if(broadcast || !dev->overwrite || READ_ONCE(dev->ctrl->tail) == tail) {
+            break;
+        }
+    }
+    is18_unlock_side(dev, &dev->read_lock, shared);
     return copied;
 }
 
-static ssize_t is18_write(struct file *filp, const char __user *buff, size_t count, loff_t *offset) {
-    int i;
+// Overwrite mode: moves tail on until need bytes are free behind head,
+// over the oldest bytes or in packet mode over the oldest whole messages.
+// Never waits for a reader: a reader moving tail at the same time makes the
+// cmpxchg fail and we only try again. Called by the writer (write_lock held).
+// Returns the free space.
+static unsigned int is18_overwrite(struct is18_cdev *dev, unsigned int head, size_t need) {
+    unsigned int tail = smp_load_acquire(&dev->ctrl->tail);
+    unsigned int new_tail;
+
+    do {
+        new_tail = tail;
+        while(head - new_tail + need > dev->buffer_size) {
+            __u32 len;
+
+            if(!dev->packet) {
+                new_tail = head + need - dev->buffer_size;
+                break;
+            }
+            // the messages between tail and head were stored by writers --> valid headers
+            is18_ring_peek(dev, new_tail, &len, IS18_PACKET_HDR_SIZE);
+            new_tail += IS18_PACKET_HDR_SIZE + min_t(__u32, len, head - new_tail - IS18_PACKET_HDR_SIZE);
+        }
+        if(new_tail == tail) {
+            // a reader made room meanwhile
+            return dev->buffer_size - (head - tail);
+        }
+    } while(!try_cmpxchg(&dev->ctrl->tail, &tail, new_tail));
+
+    is18_stat_add(dev, overwritten, new_tail - tail);
+    return dev->buffer_size - (head - new_tail);
+}
+
+// MPSC mode: reserves need bytes at *pos, false if they don't fit.
+// Usually one cmpxchg, a retry only if another writer reserved meanwhile.
+static bool is18_reserve(struct is18_cdev *dev, size_t need, unsigned int *pos) {
+    unsigned int r = READ_ONCE(dev->reserve);
+
+    do {
+        // pairs with smp_store_release() of the reader: data was copied out before tail moved
+        if(r - smp_load_acquire(&dev->ctrl->tail) + need > dev->buffer_size) {
+            return false;
+        }
+    } while(!try_cmpxchg(&dev->reserve, &r, r + need));
+    *pos = r;
+    return true;
+}
+
+// MPSC mode: a copied reservation whose writer does not wait for its turn
+// to commit (nonblocking or killed), see is18_hand_over
+struct is18_pending_commit {
+    struct list_head list;
+    unsigned int pos;
+    size_t need;
+};
+
+// publishes [pos, pos + need), head is at pos: until head moves on we are
+// the only one committing (stamps, high water)
+static void is18_publish(struct is18_cdev *dev, unsigned int pos, size_t need) {
+    is18_stamp_write(dev, pos + need);
+    is18_update_high_water(dev, pos + need - READ_ONCE(dev->ctrl->tail));
+    smp_store_release(&dev->ctrl->head, pos + need);
+}
+
+// publishes the handed over reservations which are next in line
+static void is18_commit_pending(struct is18_cdev *dev) {
+    struct is18_pending_commit *c, *tmp;
+    bool found;
+
+    spin_lock(&dev->commit_lock);
+    do {
+        found = false;
+        list_for_each_entry_safe(c, tmp, &dev->commits, list) {
+            if(c->pos == READ_ONCE(dev->ctrl->head)) {
+                is18_publish(dev, c->pos, c->need);
+                list_del(&c->list);
+                kfree(c);
+                found = true;
+            }
+        }
+    } while(found);
+    spin_unlock(&dev->commit_lock);
+}
+
+// Hands the commit of the copied reservation [pos, pos + need) over to the
+// writer in front, which still holds mpsc_sem. Takes c, freed once published.
+static void is18_hand_over(struct is18_cdev *dev, struct is18_pending_commit *c, unsigned int pos,
+                           size_t need) {
+    c->pos = pos;
+    c->need = need;
+    spin_lock(&dev->commit_lock);
+    list_add_tail(&c->list, &dev->commits);
+    spin_unlock(&dev->commit_lock);
+    // head may have reached pos meanwhile, then the writer in front did not
+    // see c (pairs with the barrier in is18_commit)
+    smp_mb();
+    is18_commit_pending(dev);
+    if(wq_has_sleeper(&dev->wq_commit)) {
+        wake_up(&dev->wq_commit);
+    }
+}
+
+// MPSC mode: publishes the reserved bytes [pos, pos + need) to the reader
+// once all earlier reservations are published. A nonblocking writer passes
+// the entry it allocated before reserving in *c and never waits or allocates
+// here: the entry is handed over (*c set to NULL) if the writer in front is
+// still copying. A waiting writer can be killed: the bytes are complete,
+// the writer in front publishes them then.
+static void is18_commit(struct is18_cdev *dev, unsigned int pos, size_t need,
+                        struct is18_pending_commit **c) {
+    // usually the writer before us is done already, otherwise it is still copying
+    if(smp_load_acquire(&dev->ctrl->head) != pos) {
+        if(*c) {
+            is18_hand_over(dev, *c, pos, need);
+            *c = NULL;
+            return;
+        }
+        if(wait_event_killable(dev->wq_commit, smp_load_acquire(&dev->ctrl->head) == pos)) {
+            is18_hand_over(dev, kmalloc(sizeof(**c), GFP_KERNEL | __GFP_NOFAIL), pos, need);
+            return;
+        }
+    }
+    is18_publish(dev, pos, need);
+    // reservations handed over to us (pairs with the barrier in is18_hand_over)
+    smp_mb();
+    if(!list_empty(&dev->commits)) {
+        is18_commit_pending(dev);
+    }
+    // the next writer in line (wq_has_sleeper() contains the barrier)
+    if(wq_has_sleeper(&dev->wq_commit)) {
+        wake_up(&dev->wq_commit);
+    }
+}
+
+// is18_do_write() in MPSC mode: writers don't serialise, each one reserves
+// the space for its write (is18_reserve), copies without holding a lock and
+// commits in the order of the reservations (is18_commit). A write that fits
+// into the ring is reserved as a whole and never interleaves with other
+// writes, larger writes are stored in pieces of buffer_size bytes.
+// A nonblocking write stores nothing if the (first) piece doesn't fit.
+// A fault can't give reserved space back: the rest of the piece is zeroed.
+static ssize_t is18_write_reserved(struct is18_cdev *dev, struct is18_file *f, struct iov_iter *from,
+                                   int flags, u64 start) {
+    struct is18_pending_commit *c = NULL; // nonblocking: for is18_commit, allocated before reserving
     ssize_t copied = 0;
-    struct is18_cdev *dev = filp->private_data;
+    size_t count = iov_iter_count(from);
+    bool nowait = flags & IS18_NOWAIT;
+    bool woken = false; // got the exclusive wakeup of a reader
+    int rv;
 
-    printk(KERN_INFO "is18drv: 'write' is called!\n");
+    if(nowait ? !down_read_trylock(&dev->mpsc_sem) : down_read_killable(&dev->mpsc_sem)) {
+        is18_stat_inc(dev, eagain);
+        return nowait ? -EAGAIN : -ERESTARTSYS;
+    }
+    if(!dev->mpsc) {
+        // switched back by this fd meanwhile
+        up_read(&dev->mpsc_sem);
+        return -EINVAL;
+    }
+    while(copied < count) {
+        unsigned int hdr = dev->packet ? IS18_PACKET_HDR_SIZE : 0;
+        // a message is reserved as a whole, bytes in pieces of at most the ring size
+        size_t len = hdr ? count : min_t(size_t, count - copied, dev->buffer_size);
+        size_t need = hdr + len;
+        unsigned int pos;
+        size_t done;
+
+        if(need > dev->buffer_size) {
+            copied = -EMSGSIZE;
+            break;
+        }
+        // reserved space can't be given back, so allocate while nothing is reserved
+        if((flags & (IS18_NONBLOCK | IS18_NOWAIT)) && !c) {
+            c = kmalloc(sizeof(*c), nowait ? GFP_NOWAIT : GFP_KERNEL);
+            if(!c) {
+                if(!copied) {
+                    is18_stat_inc(dev, eagain);
+                    copied = -EAGAIN;
+                }
+                break;
+            }
+        }
+        if(!is18_reserve(dev, need, &pos)) {
+            struct is18_lowat_wait w;
+            long timeout;
+            u64 sleep_start;
+            u64 slept;
 
-    if(down_interruptible(&dev->sem_sync)) {
-        return -ERESTARTSYS;
+            // --> pipe is full
+            if(flags & (IS18_NONBLOCK | IS18_NOWAIT)) {
+                break;
+            }
+            // a reader may wait for the data we already stored, we sleep next
+            if(copied) {
+                is18_wake_sync(dev, &dev->wq_read_data_available, EPOLLIN | EPOLLRDNORM);
+            }
+            // nothing reserved --> lock_ring may run meanwhile
+            up_read(&dev->mpsc_sem);
+            is18_stat_inc(dev, write_blocked);
+            sleep_start = ktime_get_ns();
+            // the waker skips us until need (at least sndlowat) bytes are
+            // free, a writer behind us needing less gets the wakeup then
+            w = (struct is18_lowat_wait){.dev = dev, .f = f, .writer = true, .mpsc = true,
+                .want = max_t(size_t, need, min(READ_ONCE(f->sndlowat), dev->buffer_size))};
+            timeout = MAX_SCHEDULE_TIMEOUT;
+            rv = is18_wait_lowat(&dev->wq_free_space_available, &w, true, &timeout);
+            woken = true;
+            slept = ktime_get_ns() - sleep_start;
+            is18_lat_add(dev, IS18_LAT_BLOCKED_FULL, slept);
+            trace_is18_block(dev->device_number, true, is18_ring_used(dev), need, rv, slept);
+            if(rv || down_read_killable(&dev->mpsc_sem)) {
+                copied = copied ? copied : -ERESTARTSYS;
+                goto out;
+            }
+            if(!dev->mpsc) {
+                up_read(&dev->mpsc_sem);
+                copied = copied ? copied : -EINVAL;
+                goto out;
+            }
+            continue;
+        }
+
+        if(hdr) {
+            __u32 hlen = len;
+            is18_ring_poke(dev, pos, &hlen, hdr);
+        }
+        done = is18_ring_from_iter(dev, pos + hdr, len, from);
+        if(done < len) {
+            // the reader gets zeros instead of the bytes we could not copy
+            is18_ring_clear(dev, pos + hdr + done, len - done);
+        }
+        is18_commit(dev, pos, need, &c);
+        is18_stat_add(dev, bytes_in, done);
+
+        if(done < len) {
+            // a message was not stored completely, bytes up to the fault were
+            copied = (hdr || !(copied + done)) ? -EFAULT : copied + done;
+            break;
+        }
+        copied += len;
+        if(fatal_signal_pending(current)) {
+            // killed, maybe while waiting in is18_commit: no more pieces
+            break;
+        }
     }
-    for(i = 0; i < count; ++i) {
-        while(dev->current_pipe_bytes >= BUFFER_SIZE) {
-            printk(KERN_INFO "Pipe is full\n");
+    up_read(&dev->mpsc_sem);
+    kfree(c);
+
+    if(!copied) {
+        if(nowait) {
+            is18_stat_inc(dev, eagain);
+            copied = -EAGAIN;
+        } else {
+            is18_stat_inc(dev, enospc);
+            copied = -ENOSPC;
+        }
+    }
+out:
+    // one wakeup per syscall instead of one per byte
+    if(copied > 0) {
+        is18_wake(dev, &dev->wq_read_data_available, EPOLLIN | EPOLLRDNORM);
+    }
+    // we took the wakeup of a reader: the space we left goes to the next writer
+    if(woken && READ_ONCE(dev->reserve) - READ_ONCE(dev->ctrl->tail) < dev->buffer_size) {
+        is18_wake(dev, &dev->wq_free_space_available, EPOLLOUT | EPOLLWRNORM);
+    }
+    trace_is18_write(dev->device_number, count, copied, READ_ONCE(dev->ctrl->head),
+                     READ_ONCE(dev->ctrl->tail), false, is18_trace_since(start));
+    return copied;
+}
+
+// Zero copy write: a reference is taken on the user pages of the write and
+// they are handed to the readers as a gift, which they copy straight into their buffers - one copy
+// instead of two. The gift follows the ring bytes in front of head at the
+// time it was posted, bytes written later follow the gift. One gift is
+// pending at a time, the writer waits until the readers took all of it (the
+// buffer may be reused once write() returns) and takes the rest back on a
+// signal. Used for blocking writes of at least zerocopy_min bytes from user memory.
+static ssize_t is18_write_gift(struct is18_cdev *dev, struct iov_iter *from, u64 start) {
+    ssize_t copied = 0;
+    size_t count = iov_iter_count(from);
+    bool shared = false;
+    int rv = 0;
+
+    while(copied < count) {
+        struct is18_gift gift = {};
+        unsigned int i;
+        ssize_t len;
+
+        rv = is18_lock_side(dev, &dev->write_lock, &shared, false);
+        if(rv) {
+            break;
+        }
+        if(READ_ONCE(dev->gift)) {
+            // the gift of another writer is still pending
+            is18_unlock_side(dev, &dev->write_lock, shared);
+            is18_stat_inc(dev, write_blocked);
+            rv = wait_event_interruptible(dev->wq_free_space_available, !READ_ONCE(dev->gift));
+            if(rv) {
+                break;
+            }
+            continue;
+        }
+        if(!dev->zerocopy_min) {
+            // switched off by this fd meanwhile
+            is18_unlock_side(dev, &dev->write_lock, shared);
+            rv = -EINVAL;
+            break;
+        }
+        // takes a reference on the pages and advances from
+        len = iov_iter_get_pages_alloc2(from, &gift.pages, min_t(size_t, count - copied, IS18_GIFT_MAX),
+                                        &gift.offset);
+        if(len <= 0) {
+            is18_unlock_side(dev, &dev->write_lock, shared);
+            rv = len ? len : -EFAULT;
+            break;
+        }
+        gift.nr_pages = DIV_ROUND_UP(gift.offset + len, PAGE_SIZE);
+        gift.len = len;
+        gift.pos = READ_ONCE(dev->ctrl->head); // only changed by writers --> we hold write_lock
+        // readers stop at gift.pos until they took the gift
+        smp_store_release(&dev->gift, &gift);
+        is18_unlock_side(dev, &dev->write_lock, shared);
+        // we sleep until the readers took it
+        is18_wake_sync(dev, &dev->wq_read_data_available, EPOLLIN | EPOLLRDNORM);
+
+        // the page references are held until the readers copied them
+        rv = wait_event_interruptible(dev->wq_free_space_available,
+                                      smp_load_acquire(&gift.done) == gift.len);
+        if(rv) {
+            // take the rest back, readers copy with read_lock held
+            mutex_lock(&dev->read_lock);
+            if(dev->gift == &gift) {
+                WRITE_ONCE(dev->gift, NULL);
+            }
+            mutex_unlock(&dev->read_lock);
+        }
+        for(i = 0; i < gift.nr_pages; ++i) {
+            put_page(gift.pages[i]);
+        }
+        kvfree(gift.pages);
+        copied += gift.done;
+        is18_stat_add(dev, bytes_in, gift.done);
+        if(rv) {
+            break;
+        }
+    }
+
+    trace_is18_write(dev->device_number, count, copied ? copied : rv, READ_ONCE(dev->ctrl->head),
+                     READ_ONCE(dev->ctrl->tail), shared, is18_trace_since(start));
+    return copied ? copied : rv;
+}
+
+// Moves bytes from an iov_iter (user buffer, iovec array, pipe buffer, ...)
+// into the ring, the whole iov_iter under one lock acquisition.
+// flags: IS18_NONBLOCK returns instead of waiting for space, otherwise it
+// blocks until everything is stored. IS18_NOWAIT is like IS18_NONBLOCK but
+// without sleeping on the locks, a full ring is reported with -EAGAIN
+// instead of -ENOSPC.
+// In packet mode the iov_iter is stored as one message, all or nothing.
+// In lossy broadcast mode it never waits for space, the bytes readers did not
+// get yet are overwritten instead (see is18_overrun), in overwrite mode the
+// oldest bytes are dropped (see is18_overwrite).
+static ssize_t is18_do_write(struct is18_cdev *dev, struct is18_file *f, struct iov_iter *from, int flags) {
+    ssize_t copied = 0;
+    size_t count = iov_iter_count(from);
+    bool nowait = flags & IS18_NOWAIT;
+    bool woken = false; // got the exclusive wakeup of a reader
+    bool shared;
+    bool lossy;
+    int rv;
+    u64 start = is18_trace_clock(is18_write);
+
+    is18_stat_inc(dev, writes);
+    if(READ_ONCE(dev->mpsc)) {
+        return is18_write_reserved(dev, f, from, flags, start);
+    }
+    if(READ_ONCE(dev->zerocopy_min) && count >= READ_ONCE(dev->zerocopy_min) &&
+       !(flags & (IS18_NONBLOCK | IS18_NOWAIT)) && user_backed_iter(from)) {
+        return is18_write_gift(dev, from, start);
+    }
+    rv = is18_lock_writer(dev, &shared, &lossy, nowait);
+    if(rv) {
+        if(rv == -EAGAIN) {
+            is18_stat_inc(dev, eagain);
+        }
+        return rv;
+    }
+    while(copied < count) {
+        unsigned int head = READ_ONCE(dev->ctrl->head); // only changed by writers --> we hold write_lock
+        // pairs with smp_store_release() of the reader: data was copied out before tail moved,
+        // a mapping user space consumer may have stored garbage
+        unsigned int space = is18_core_space(head, smp_load_acquire(&dev->ctrl->tail), dev->buffer_size);
+        // a message is only stored as a whole, bytes as soon as there is any space
+        size_t need = dev->packet ? IS18_PACKET_HDR_SIZE + count : 1;
+        size_t chunk;
+        size_t done;
+
+        if(dev->packet) {
+            if(copied) {
+                // the mode was switched while we slept, don't mix bytes into messages
+                break;
+            }
+            if(need > dev->buffer_size) {
+                copied = -EMSGSIZE;
+                break;
+            }
+        }
+        if(lossy != (dev->broadcast == IS18_BROADCAST_LOSSY) || dev->mpsc) {
+            // switched by this fd while we slept, we lack (or hold) read_lock
+            // or the MPSC writers don't take write_lock
+            break;
+        }
+        if(dev->overwrite && space < (dev->packet ? need : count - copied)) {
+            // flight recorder: the oldest bytes (messages) make room, we never wait
+            space = is18_overwrite(dev, head, dev->packet ? need :
+                                   min_t(size_t, count - copied, dev->buffer_size));
+        }
+        if(lossy && space < count - copied) {
+            // make room for as much as fits, slow readers lose their oldest bytes
+            size_t want = min_t(size_t, count - copied, dev->buffer_size);
+
+            is18_overrun(dev, head + want - dev->buffer_size);
+            space = want;
+        }
+
+        if(space < need) {
+            struct is18_lowat_wait w;
+            long timeout;
+            u64 sleep_start;
+            u64 slept;
+
             // --> pipe is full
-            if((filp->f_flags & O_NONBLOCK) | (filp->f_flags & O_NDELAY ))  {
+            if(flags & (IS18_NONBLOCK | IS18_NOWAIT))  {
                 // no blocking/waiting allowed
-                up(&dev->sem_sync); // Semaphore freigeben
-                return copied ? copied : -ENOSPC;
-            }
-            pr_info("please wait, currently no space available...");
-            // release sem before waiting
-            up(&dev->sem_sync);
-            // wait until space is available again
-            if(wait_event_interruptible(dev->wq_free_space_available,
-                                        (dev->current_pipe_bytes < BUFFER_SIZE )) != 0 ) {
-                return -ERESTARTSYS;
+                break;
             }
-            // space is available again --> get semaphore again
-            if(down_interruptible(&dev->sem_sync)) {
-                return -ERESTARTSYS;
+            // a reader may wait for the data we already stored, we sleep next
+            if(copied) {
+                is18_wake_sync(dev, &dev->wq_read_data_available, EPOLLIN | EPOLLRDNORM);
+            }
+            // release locks before waiting (never lossy, it always has space)
+            is18_unlock_side(dev, &dev->write_lock, shared);
+            // a mapping consumer has to notify us (barrier is in wait_event)
+            WRITE_ONCE(dev->ctrl->writer_waiting, 1);
+            is18_stat_inc(dev, write_blocked);
+            sleep_start = ktime_get_ns();
+            // wait until space is available again (an empty ring is checked
+            // again in any case, it may have been resized meanwhile)
+            // the waker skips us until need (at least sndlowat) bytes are
+            // free, a writer behind us needing less gets the wakeup then
+            w = (struct is18_lowat_wait){.dev = dev, .f = f, .writer = true,
+                .want = max_t(size_t, need, min(READ_ONCE(f->sndlowat), dev->buffer_size))};
+            timeout = MAX_SCHEDULE_TIMEOUT;
+            rv = is18_wait_lowat(&dev->wq_free_space_available, &w, true, &timeout);
+            woken = true;
+            slept = ktime_get_ns() - sleep_start;
+            is18_lat_add(dev, IS18_LAT_BLOCKED_FULL, slept);
+            trace_is18_block(dev->device_number, true, dev->buffer_size - space, need, rv, slept);
+            if(rv) {
+                copied = copied ? copied : -ERESTARTSYS;
+                goto out;
+            }
+            // space is available again --> get locks again (the mode may have changed meanwhile)
+            if(is18_lock_side(dev, &dev->write_lock, &shared, false)) {
+                copied = copied ? copied : -ERESTARTSYS;
+                goto out;
+            }
+            continue;
+        }
+
+        if(dev->packet) {
+            __u32 len = count;
+
+            // header and payload are published together --> readers never see half a message
+            is18_ring_poke(dev, head, &len, IS18_PACKET_HDR_SIZE);
+            if(is18_ring_from_iter(dev, head + IS18_PACKET_HDR_SIZE, count, from) < count) {
+                copied = -EFAULT;
+                break;
             }
+            is18_stamp_write(dev, head + need);
+            smp_store_release(&dev->ctrl->head, head + need);
+            is18_stat_add(dev, bytes_in, count);
+            is18_update_high_water(dev, dev->buffer_size - space + need);
+            copied = count;
+            break;
+        }
+
+        // largest contiguous run: limited by the request, the free space
+        // and the end of the ring (a wrapped ring needs a second run)
+        chunk = is18_core_run(head, dev->buffer_size, min_t(size_t, count - copied, space));
+
+        //just like memcpy - returns: num of copied bytes, less on a fault
+        done = copy_from_iter(dev->buffer + is18_core_index(head, dev->buffer_size), chunk, from);
+
+        copied += done;
+        // publish the data to the reader
+        if(done) {
+            is18_stamp_write(dev, head + done);
         }
-        //just like memcpy:
-        // copy_from_user(dev->buffer + dev->next_write_index, //to here
-        // buff + i, // from here
-        // 1); <-- num ob bytes --> could be tricky with fifo
-        // returns: num of NOT copied bytes
+        smp_store_release(&dev->ctrl->head, head + done);
+        is18_stat_add(dev, bytes_in, done);
+        is18_update_high_water(dev, dev->buffer_size - space + done);
 
-        //still free space for at least 1 byte
-        if (get_user(dev->buffer[dev->next_write_index], buff + i) != 0) {
+        if(done < chunk) {
             if (!copied) {
                 copied = -EFAULT;
             }
             break;
         }
+    }
+    is18_unlock_writer(dev, shared, lossy);
+
+    if(!copied) {
+        if(nowait) {
+            is18_stat_inc(dev, eagain);
+            copied = -EAGAIN;
+        } else {
+            is18_stat_inc(dev, enospc);
+            copied = -ENOSPC;
+        }
+    }
+out:
+    // one wakeup per syscall instead of one per byte
+    if(copied > 0) {
+        is18_wake(dev, &dev->wq_read_data_available, EPOLLIN | EPOLLRDNORM);
+    }
+    // we took the wakeup of a reader: the space we left goes to the next writer
+    if(woken && is18_ring_used(dev) < dev->buffer_size) {
+        is18_wake(dev, &dev->wq_free_space_available, EPOLLOUT | EPOLLWRNORM);
+    }
+    trace_is18_write(dev->device_number, count, copied, READ_ONCE(dev->ctrl->head),
+                     READ_ONCE(dev->ctrl->tail), shared, is18_trace_since(start));
+    return copied;
+}
 
-        ++copied;
-        ++dev->current_pipe_bytes;
-        ++dev->next_write_index;
-        dev->next_write_index %= BUFFER_SIZE;
-        printk(KERN_INFO "is18drv: copied %ld\n",copied);
-        printk(KERN_INFO "is18drv: dev->current_pipe_bytes %d\n",dev->current_pipe_bytes);
-        printk(KERN_INFO "is18drv: dev->next_write_index %d\n",dev->next_write_index);
+// read() and readv() end up here, as do io_uring reads: one call drains the
+// ring into the whole iovec array
+static ssize_t is18_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    struct file *filp = iocb->ki_filp;
+    struct is18_file *f = filp->private_data;
+
+    return is18_do_read(f->dev, f, to, is18_nonblock(filp) | IS18_WAIT_ALL |
+                        ((iocb->ki_flags & IOCB_NOWAIT) ? IS18_NOWAIT : 0), NULL);
+}
 
-        wake_up(&dev->wq_read_data_available);
+// write() and writev() end up here, as do io_uring writes
+static ssize_t is18_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+    struct file *filp = iocb->ki_filp;
+    struct is18_file *f = filp->private_data;
 
+    return is18_do_write(f->dev, f, from, is18_nonblock(filp) |
+                         ((iocb->ki_flags & IOCB_NOWAIT) ? IS18_NOWAIT : 0));
+}
+
+// splice from the device into a pipe: the ring is copied once into the
+// pipe pages, from there on the data is passed on by reference.
+// Returns as soon as some bytes were moved, like a pipe does.
+// Messages of packet mode would lose their boundaries in the pipe --> stream mode only.
+static ssize_t is18_splice_read(struct file *filp, loff_t *ppos, struct pipe_inode_info *pipe,
+                                size_t len, unsigned int flags) {
+    struct is18_file *f = filp->private_data;
+    struct is18_cdev *dev = f->dev;
+    struct iov_iter to;
+    int nonblock = is18_nonblock(filp) | ((flags & SPLICE_F_NONBLOCK) ? IS18_NONBLOCK : 0);
+    ssize_t rv;
+
+    if(READ_ONCE(dev->packet)) {
+        return -EINVAL;
     }
-    up(&dev->sem_sync);
+    // splice_read is only called with len limited to the free pipe slots
+    iov_iter_pipe(&to, READ, pipe, len);
+    rv = is18_do_read(dev, f, &to, nonblock, NULL);
+    // 0 would mean end of file to the caller
+    return (rv == 0 && nonblock) ? -EAGAIN : rv;
+}
+
+// splice_from_pipe() actor: copies one pipe buffer straight into the ring
+static int is18_pipe_to_ring(struct pipe_inode_info *pipe, struct pipe_buffer *buf,
+                             struct splice_desc *sd) {
+    struct file *filp = sd->u.file;
+    struct is18_file *f = filp->private_data;
+    struct bio_vec bvec = {
+        .bv_page = buf->page,
+        .bv_offset = buf->offset,
+        .bv_len = sd->len,
+    };
+    struct iov_iter from;
+    ssize_t rv;
+
+    iov_iter_bvec(&from, WRITE, &bvec, 1, sd->len);
+    rv = is18_do_write(f->dev, f, &from,
+                       is18_nonblock(filp) | ((sd->flags & SPLICE_F_NONBLOCK) ? IS18_NONBLOCK : 0));
+    // a full ring is no error for splice, try again later
+    return rv == -ENOSPC ? -EAGAIN : rv;
+}
+
+// splice from a pipe into the device without a user space bounce buffer
+// (stream mode only, pipe buffers are no messages)
+static ssize_t is18_splice_write(struct pipe_inode_info *pipe, struct file *filp, loff_t *ppos,
+                                 size_t len, unsigned int flags) {
+    struct is18_cdev *dev = is18_dev(filp);
 
-    return copied ? copied : -ENOSPC;
+    if(READ_ONCE(dev->packet)) {
+        return -EINVAL;
+    }
+
+    return splice_from_pipe(pipe, filp, ppos, len, flags, is18_pipe_to_ring);
+}
+
+// IS18_IOC_SEND_MMSG: stores up to vlen records under one lock hold, each one
+// as a whole (in packet mode as one message). Blocks (unless nonblocking)
+// until the first record fits, the rest is only stored as far as there is
+// space. head is published and the reader woken up once for the whole batch.
+// Returns the number of stored records.
+static long is18_send_mmsg(struct is18_cdev *dev, struct is18_mmsg __user *arg, int flags) {
+    struct is18_mmsg mmsg;
+    struct is18_msg __user *msgs;
+    unsigned int head;
+    unsigned int done = 0;
+    size_t bytes = 0;
+    long rv = 0;
+    bool shared;
+    u64 start = is18_trace_clock(is18_write);
+
+    if(copy_from_user(&mmsg, arg, sizeof(mmsg))) {
+        return -EFAULT;
+    }
+    if(mmsg.flags) {
+        return -EINVAL;
+    }
+    msgs = u64_to_user_ptr(mmsg.msgs);
+    // like sendmmsg(): larger batches are cut
+    mmsg.vlen = min_t(__u32, mmsg.vlen, IS18_MMSG_MAX);
+
+    is18_stat_inc(dev, writes);
+    if(is18_lock_side(dev, &dev->write_lock, &shared, false)) {
+        return -ERESTARTSYS;
+    }
+    if(dev->broadcast == IS18_BROADCAST_LOSSY || dev->mpsc || dev->overwrite) {
+        // records are not overwritten, MPSC writers don't take write_lock --> use write()
+        is18_unlock_side(dev, &dev->write_lock, shared);
+        return -EINVAL;
+    }
+    head = READ_ONCE(dev->ctrl->head); // only changed by writers --> we hold write_lock
+    while(done < mmsg.vlen) {
+        struct is18_msg msg;
+        struct iovec iov;
+        struct iov_iter from;
+        unsigned int used = head - smp_load_acquire(&dev->ctrl->tail);
+        unsigned int space = dev->buffer_size - min_t(unsigned int, used, dev->buffer_size);
+        unsigned int hdr = dev->packet ? IS18_PACKET_HDR_SIZE : 0;
+        size_t need;
+        u64 sleep_start;
+        u64 slept;
+
+        if(copy_from_user(&msg, &msgs[done], sizeof(msg))) {
+            rv = -EFAULT;
+            break;
+        }
+        need = hdr + msg.len;
+        if(need > dev->buffer_size) {
+            rv = -EMSGSIZE;
+            break;
+        }
+        if(space < need) {
+            if(done || (flags & IS18_NONBLOCK)) {
+                rv = -EAGAIN;
+                break;
+            }
+            // nothing stored so far --> nothing to publish before sleeping
+            is18_unlock_side(dev, &dev->write_lock, shared);
+            WRITE_ONCE(dev->ctrl->writer_waiting, 1);
+            sleep_start = ktime_get_ns();
+            is18_stat_inc(dev, write_blocked);
+            rv = wait_event_interruptible(dev->wq_free_space_available,
+                                          (is18_ring_used(dev) + need <= dev->buffer_size ||
+                                           !is18_ring_used(dev)));
+            slept = ktime_get_ns() - sleep_start;
+            is18_lat_add(dev, IS18_LAT_BLOCKED_FULL, slept);
+            trace_is18_block(dev->device_number, true, used, need, rv, slept);
+            if(rv) {
+                return -ERESTARTSYS;
+            }
+            if(is18_lock_side(dev, &dev->write_lock, &shared, false)) {
+                return -ERESTARTSYS;
+            }
+            if(dev->broadcast == IS18_BROADCAST_LOSSY || dev->mpsc || dev->overwrite) {
+                is18_unlock_side(dev, &dev->write_lock, shared);
+                return -EINVAL;
+            }
+            head = READ_ONCE(dev->ctrl->head);
+            continue;
+        }
+
+        rv = import_single_range(WRITE, u64_to_user_ptr(msg.buf), msg.len, &iov, &from);
+        if(rv) {
+            break;
+        }
+        if(hdr) {
+            __u32 len = msg.len;
+            is18_ring_poke(dev, head, &len, hdr);
+        }
+        if(is18_ring_from_iter(dev, head + hdr, msg.len, &from) < msg.len ||
+           put_user(msg.len, &msgs[done].result)) {
+            rv = -EFAULT;
+            break;
+        }
+        head += need;
+        bytes += msg.len;
+        ++done;
+    }
+    // publish the whole batch to the reader at once (one residency sample)
+    if(done) {
+        is18_stamp_write(dev, head);
+    }
+    smp_store_release(&dev->ctrl->head, head);
+    is18_unlock_side(dev, &dev->write_lock, shared);
+    trace_is18_write(dev->device_number, mmsg.vlen, done ? done : rv, READ_ONCE(dev->ctrl->head),
+             READ_ONCE(dev->ctrl->tail), shared, is18_trace_since(start));
+
+    if(done) {
+        is18_stat_add(dev, bytes_in, bytes);
+        is18_update_high_water(dev, min_t(unsigned int, is18_ring_used(dev), dev->buffer_size));
+        is18_wake(dev, &dev->wq_read_data_available, EPOLLIN | EPOLLRDNORM);
+        return done;
+    }
+    if(rv == -EAGAIN) {
+        is18_stat_inc(dev, eagain);
+    }
+    return rv;
+}
+
+// IS18_IOC_RECV_MMSG: takes up to vlen records under one lock hold. In packet
+// mode every descriptor gets one message (truncated like read()), in byte
+// stream mode every descriptor is a record of exactly len bytes. Blocks
+// (unless nonblocking) until the first record is available, tail is
+// published and the writer woken up once for the whole batch.
+// Returns the number of received records.
+static long is18_recv_mmsg(struct is18_cdev *dev, struct is18_mmsg __user *arg, int flags) {
+    struct is18_mmsg mmsg;
+    struct is18_msg __user *msgs;
+    unsigned int tail;
+    unsigned int done = 0;
+    size_t bytes = 0;
+    long rv = 0;
+    bool shared;
+    u64 start = is18_trace_clock(is18_read);
+
+    if(copy_from_user(&mmsg, arg, sizeof(mmsg))) {
+        return -EFAULT;
+    }
+    if(mmsg.flags) {
+        return -EINVAL;
+    }
+    msgs = u64_to_user_ptr(mmsg.msgs);
+    mmsg.vlen = min_t(__u32, mmsg.vlen, IS18_MMSG_MAX);
+
+    is18_stat_inc(dev, reads);
+    if(is18_lock_side(dev, &dev->read_lock, &shared, false)) {
+        return -ERESTARTSYS;
+    }
+    if(dev->broadcast || dev->overwrite || dev->zerocopy_min || READ_ONCE(dev->gift)) {
+        // works on the shared tail, broadcast readers use read(), records
+        // that are overwritten while we copy can't be taken back from the user,
+        // records would have to be cut at the position of a gift
+        is18_unlock_side(dev, &dev->read_lock, shared);
+        return -EINVAL;
+    }
+    tail = READ_ONCE(dev->ctrl->tail); // only changed by readers --> we hold read_lock
+    while(done < mmsg.vlen) {
+        struct is18_msg msg;
+        struct iovec iov;
+        struct iov_iter to;
+        // a mapping user space producer may have stored garbage
+        unsigned int used = min_t(unsigned int, smp_load_acquire(&dev->ctrl->head) - tail,
+                                  dev->buffer_size);
+        unsigned int hdr = dev->packet ? IS18_PACKET_HDR_SIZE : 0;
+        size_t need;    // bytes that have to be in the ring for the next record
+        u64 sleep_start;
+        u64 slept;
+        size_t want;    // bytes copied to the user
+        __u32 len;
+
+        if(copy_from_user(&msg, &msgs[done], sizeof(msg))) {
+            rv = -EFAULT;
+            break;
+        }
+        if(!hdr && msg.len > dev->buffer_size) {
+            rv = -EMSGSIZE;
+            break;
+        }
+        need = hdr ? 1 : msg.len;
+        if(used < need) {
+            if(done || (flags & IS18_NONBLOCK)) {
+                rv = -EAGAIN;
+                break;
+            }
+            // nothing taken so far --> nothing to publish before sleeping
+            is18_unlock_side(dev, &dev->read_lock, shared);
+            WRITE_ONCE(dev->ctrl->reader_waiting, 1);
+            sleep_start = ktime_get_ns();
+            is18_stat_inc(dev, read_blocked);
+            rv = wait_event_interruptible(dev->wq_read_data_available,
+                                          (is18_ring_used(dev) >= need ||
+                                           dev->buffer_size < need));
+            slept = ktime_get_ns() - sleep_start;
+            is18_lat_add(dev, IS18_LAT_BLOCKED_EMPTY, slept);
+            trace_is18_block(dev->device_number, false, used, need, rv, slept);
+            if(rv) {
+                return -ERESTARTSYS;
+            }
+            if(is18_lock_side(dev, &dev->read_lock, &shared, false)) {
+                return -ERESTARTSYS;
+            }
+            if(dev->broadcast || dev->overwrite || dev->zerocopy_min || READ_ONCE(dev->gift)) {
+                is18_unlock_side(dev, &dev->read_lock, shared);
+                return -EINVAL;
+            }
+            tail = READ_ONCE(dev->ctrl->tail);
+            continue;
+        }
+
+        if(hdr) {
+            len = 0;
+            if(used >= hdr) {
+                is18_ring_peek(dev, tail, &len, hdr);
+            }
+            if(used < hdr || len > used - hdr) {
+                // can not happen, writes store whole messages
+                pr_err_ratelimited("is18drv: corrupt message header %u at %u\n", len, tail);
+                rv = -EIO;
+                break;
+            }
+            want = min_t(size_t, len, msg.len);
+        } else {
+            len = msg.len;
+            want = msg.len;
+        }
+
+        rv = import_single_range(READ, u64_to_user_ptr(msg.buf), want, &iov, &to);
+        if(rv) {
+            break;
+        }
+        // records are only removed once they were copied completely
+        if(is18_ring_to_iter(dev, tail + hdr, want, &to) < want ||
+           put_user(want, &msgs[done].result)) {
+            rv = -EFAULT;
+            break;
+        }
+        tail += hdr + len;
+        bytes += want;
+        ++done;
+    }
+    // hand the space of the whole batch back to the writer at once
+    smp_store_release(&dev->ctrl->tail, tail);
+    is18_stamp_read(dev, tail);
+    is18_unlock_side(dev, &dev->read_lock, shared);
+    trace_is18_read(dev->device_number, mmsg.vlen, done ? done : rv, READ_ONCE(dev->ctrl->head),
+             READ_ONCE(dev->ctrl->tail), shared, is18_trace_since(start));
+
+    if(done) {
+        is18_stat_add(dev, bytes_out, bytes);
+        is18_wake(dev, &dev->wq_free_space_available, EPOLLOUT | EPOLLWRNORM);
+        return done;
+    }
+    if(rv == -EAGAIN) {
+        is18_stat_inc(dev, eagain);
+    }
+    return rv;
 }
 
 
+// Reports the state of the ring for poll/select/epoll. Both wait queues are
+// registered, the wakeups of the data path carry the events that became true.
+// Like a pipe, readers get EPOLLHUP while no writer is open. Writers get no
+// error without readers, the data just stays in the ring for the next reader.
+static __poll_t is18_poll(struct file *filp, struct poll_table_struct *wait) {
+    struct is18_file *f = filp->private_data;
+    struct is18_cdev *dev = f->dev;
+    __poll_t mask = 0;
+    unsigned int used;
+    unsigned int unread; // bytes this file can read (its own cursor in broadcast mode)
+    // writers that never wait for space
+    bool lossy = READ_ONCE(dev->broadcast) == IS18_BROADCAST_LOSSY || READ_ONCE(dev->overwrite);
+
+    if(filp->f_mode & FMODE_READ) {
+        poll_wait(filp, &dev->wq_read_data_available, wait);
+    }
+    if(filp->f_mode & FMODE_WRITE) {
+        poll_wait(filp, &dev->wq_free_space_available, wait);
+    }
+
+    used = is18_ring_used(dev);
+    unread = is18_reader_used(dev, f);
+    if(((filp->f_mode & FMODE_READ) && !unread) ||
+       ((filp->f_mode & FMODE_WRITE) && used >= dev->buffer_size && !lossy)) {
+        // the caller will probably sleep --> a mapping producer/consumer has to notify us
+        if(filp->f_mode & FMODE_READ) {
+            WRITE_ONCE(dev->ctrl->reader_waiting, 1);
+        }
+        if(filp->f_mode & FMODE_WRITE) {
+            WRITE_ONCE(dev->ctrl->writer_waiting, 1);
+        }
+        // pairs with the barrier between publishing and checking the flag in user space
+        smp_mb();
+        used = is18_ring_used(dev);
+        unread = is18_reader_used(dev, f);
+    }
+    if(filp->f_mode & FMODE_READ) {
+        if(unread || READ_ONCE(dev->gift)) {
+            mask |= EPOLLIN | EPOLLRDNORM;
+        }
+        if(!READ_ONCE(dev->current_open_write_cnt)) {
+            mask |= EPOLLHUP;
+        }
+    }
+    if(filp->f_mode & FMODE_WRITE) {
+        // a lossy writer never waits for space
+        if(used < dev->buffer_size || lossy) {
+            mask |= EPOLLOUT | EPOLLWRNORM;
+        }
+    }
+
+    return mask;
+}
+
 static long is18_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
-    struct is18_cdev *dev = filp->private_data;
+    struct is18_file *f = filp->private_data;
+    struct is18_cdev *dev = f->dev;
     long rv = 0; // return value
 
     if (_IOC_TYPE(cmd) != IS18_IOC_MY_MAGIC) {
@@ -410,163 +2664,876 @@ static long is18_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
             // ...
             break;
         }
-        printk(KERN_INFO "is18drv: called IS18_IOC_OPENREADCNT via ioctl\n");
+        pr_debug("is18drv: called IS18_IOC_OPENREADCNT via ioctl\n");
+
+        if(down_interruptible(&dev->sem_sync)) {
+            return -ERESTARTSYS;
+        }
+        rv = dev->current_open_read_cnt;
+        up(&dev->sem_sync);
+
+        break;
+    case IS18_IOC_NR_OPENWRITECNT:
+        if (_IOC_DIR(cmd) != _IOC_NONE) {
+            // wrong direction. Must be "no data transfer" (because arg is not used)
+            // ...
+            break;
+        }
+
+        pr_debug("is18drv: called IS18_IOC_OPENWRITECNT via ioctl\n");
+        if(down_interruptible(&dev->sem_sync)) {
+            return -ERESTARTSYS;
+        }
+        rv = dev->current_open_write_cnt;
+        up(&dev->sem_sync);
+
+        break;
+    case IS18_IOC_NR_DEL_COUNT:
+    {
+        int del_count;
+        if (_IOC_DIR(cmd) != _IOC_WRITE) {
+            // wrong direction. Must be "writing to the device"
+            pr_debug("is18drv: WRONG direction for ioctl with IS18_IOC_DEL_COUNT\n");
+            rv = -EINVAL;
+            break;
+        }
+        pr_debug("is18drv: called IS18_IOC_DEL_COUNT via ioctl\n");
+
+        // access_ok() muss hier NICHT verwendet werden.
+        // Wird nur benoetigt, wenn ein Puffer per arg uebergeben wird. (Also
+        // wenn arg als Zeiger verwendet wird. Ist aber hier nicht der Fall.
+        // es wurde einfach nur ein Integerwert uebergeben.)
+        del_count = arg;
+        pr_debug("is18drv: ioctl from user space use the value %d\n", del_count);
+        if (!(filp->f_mode & FMODE_READ)) {
+            rv = -EBADF;
+            break;
+        }
+        if (del_count < 0) {
+            rv = -EINVAL;
+            break;
+        }
+        // tail moves on, no bytes are copied
+        rv = is18_discard(dev, f, del_count);
+        break;
+    }
+    case IS18_IOC_NR_PEEK:
+    {
+        struct is18_peek peek;
+        unsigned int avail = 0;
+        if (_IOC_DIR(cmd) != (_IOC_READ | _IOC_WRITE)) {
+            // wrong direction. Must be "reading and writing"
+            pr_debug("is18drv: WRONG direction for ioctl with IS18_IOC_PEEK\n");
+            rv = -EINVAL;
+            break;
+        }
+        pr_debug("is18drv: called IS18_IOC_PEEK via ioctl\n");
+
+        if (!(filp->f_mode & FMODE_READ)) {
+            rv = -EBADF;
+            break;
+        }
+        if (copy_from_user(&peek, (void __user *)arg, sizeof(peek))) {
+            rv = -EFAULT;
+            break;
+        }
+        if (peek.flags) {
+            rv = -EINVAL;
+            break;
+        }
+        rv = is18_peek(dev, f, u64_to_user_ptr(peek.buf), peek.len, peek.offset, &avail);
+        if (rv < 0) {
+            break;
+        }
+        if (put_user(avail, &((struct is18_peek __user *)arg)->avail)) {
+            rv = -EFAULT;
+        }
+        break;
+    }
+    case IS18_IOC_NR_READ_INDEX:
+        if (_IOC_DIR(cmd) != _IOC_NONE) {
+            // wrong direction. Must be "no data transfer" (because arg is not used)
+            // ...
+            break;
+        }
+        pr_debug("is18drv: called IS18_IOC_READ_INDEX via ioctl\n");
+
+        if(down_interruptible(&dev->sem_sync)) {
+            return -ERESTARTSYS;
+        }
+        rv = READ_ONCE(dev->ctrl->tail) & dev->buffer_mask;
+        up(&dev->sem_sync);
+
+        break;
+    case IS18_IOC_NR_WRITE_INDEX :
+        if (_IOC_DIR(cmd) != _IOC_NONE) {
+            // wrong direction. Must be "no data transfer" (because arg is not used)
+            // ...
+            break;
+        }
+        pr_debug("is18drv: called IS18_IOC_WRITE_INDEX via ioctl\n");
+
+
+        if(down_interruptible(&dev->sem_sync)) {
+            return -ERESTARTSYS;
+        }
+        rv = READ_ONCE(dev->ctrl->head) & dev->buffer_mask;
+        up(&dev->sem_sync);
+
+        break;
+    case IS18_IOC_NR_NUM_BUFFERED_BYTES:
+        if (_IOC_DIR(cmd) != _IOC_NONE) {
+            // wrong direction. Must be "no data transfer" (because arg is not used)
+            // ...
+            break;
+        }
+        pr_debug("is18drv: called IS18_IOC_NUM_BUFFERED_BYTES via ioctl\n");
+
+
+        if(down_interruptible(&dev->sem_sync)) {
+            return -ERESTARTSYS;
+        }
+        rv = min_t(unsigned int, is18_ring_used(dev), dev->buffer_size);
+        up(&dev->sem_sync);
+
+        break;
+    case IS18_IOC_NR_EMPTY_BUFFER:
+        if (_IOC_DIR(cmd) != _IOC_NONE) {
+            // wrong direction. Must be "no data transfer" (because arg is not used)
+            // ...
+            break;
+        }
+        pr_debug("is18drv: called IS18_IOC_EMPTY_BUFFER via ioctl\n");
+
+
+        // readers and writers may run without sem_sync --> lock both sides
+        if(is18_lock_ring(dev)) {
+            return -ERESTARTSYS;
+        }
+        //set read/write index and number of bytes in buffer to 0 --> empty
+        is18_ring_reset(dev);
+        rv = 0;
+
+        is18_unlock_ring(dev);
+        // writers may wait for the space, all of them check again
+        wake_up_all(&dev->wq_free_space_available);
+        break;
+    case IS18_IOC_NR_BUFFER_SIZE:
+        if (_IOC_DIR(cmd) != _IOC_NONE) {
+            // wrong direction. Must be "no data transfer" (because arg is not used)
+            // ...
+            break;
+        }
+        pr_debug("is18drv: called IS18_IOC_BUFFER_SIZE via ioctl\n");
+
+        if(down_interruptible(&dev->sem_sync)) {
+            return -ERESTARTSYS;
+        }
+        rv = dev->buffer_size;
+        up(&dev->sem_sync);
+
+        break;
+    case IS18_IOC_NR_SET_BUFFER_SIZE:
+    {
+        int new_size;
+        if (_IOC_DIR(cmd) != _IOC_WRITE) {
+            // wrong direction. Must be "writing to the device"
+            pr_debug("is18drv: WRONG direction for ioctl with IS18_IOC_SET_BUFFER_SIZE\n");
+            rv = -EINVAL;
+            break;
+        }
+        pr_debug("is18drv: called IS18_IOC_SET_BUFFER_SIZE via ioctl\n");
+
+        if (get_user(new_size, (int __user *)arg)) {
+            rv = -EFAULT;
+            break;
+        }
+        if (new_size < 1 || new_size > MAX_BUFFER_SIZE) {
+            rv = -EINVAL;
+            break;
+        }
+        new_size = roundup_pow_of_two(new_size);
+
+        rv = is18_replace_ring(dev, new_size, READ_ONCE(dev->numa_node));
+        break;
+    }
+    case IS18_IOC_NR_NUMA_NODE:
+        if (_IOC_DIR(cmd) != _IOC_NONE) {
+            // wrong direction. Must be "no data transfer" (because arg is not used)
+            // ...
+            break;
+        }
+        pr_debug("is18drv: called IS18_IOC_NUMA_NODE via ioctl\n");
+
+        if(down_interruptible(&dev->sem_sync)) {
+            return -ERESTARTSYS;
+        }
+        rv = is18_ring_node(dev);
+        up(&dev->sem_sync);
+
+        break;
+    case IS18_IOC_NR_SET_NUMA_NODE:
+    {
+        int node;
+        if (_IOC_DIR(cmd) != _IOC_WRITE) {
+            // wrong direction. Must be "writing to the device"
+            pr_debug("is18drv: WRONG direction for ioctl with IS18_IOC_SET_NUMA_NODE\n");
+            rv = -EINVAL;
+            break;
+        }
+        pr_debug("is18drv: called IS18_IOC_SET_NUMA_NODE via ioctl\n");
+
+        if (get_user(node, (int __user *)arg)) {
+            rv = -EFAULT;
+            break;
+        }
+        if (node != NUMA_NO_NODE && (node < 0 || node >= MAX_NUMNODES || !node_online(node))) {
+            rv = -EINVAL;
+            break;
+        }
+        // the ring is moved by replacing it, like resizing
+        rv = is18_replace_ring(dev, dev->buffer_size, node);
+        break;
+    }
+    case IS18_IOC_NR_RING_NOTIFY:
+        if (_IOC_DIR(cmd) != _IOC_NONE) {
+            // wrong direction. Must be "no data transfer" (because arg is not used)
+            // ...
+            break;
+        }
+        // user space moved head and/or tail of the mapped ring
+        // --> wake up both sides, they check their condition again
+        WRITE_ONCE(dev->ctrl->reader_waiting, 0);
+        WRITE_ONCE(dev->ctrl->writer_waiting, 0);
+        is18_wake(dev, &dev->wq_read_data_available, EPOLLIN | EPOLLRDNORM);
+        is18_wake(dev, &dev->wq_free_space_available, EPOLLOUT | EPOLLWRNORM);
+        break;
+    case IS18_IOC_NR_PACKET_MODE:
+        if (_IOC_DIR(cmd) != _IOC_NONE) {
+            // wrong direction. Must be "no data transfer" (because arg is not used)
+            // ...
+            break;
+        }
+        pr_debug("is18drv: called IS18_IOC_PACKET_MODE via ioctl\n");
 
         if(down_interruptible(&dev->sem_sync)) {
             return -ERESTARTSYS;
         }
-        rv = dev->current_open_read_cnt;
+        rv = dev->packet;
         up(&dev->sem_sync);
 
         break;
-    case IS18_IOC_NR_OPENWRITECNT:
+    case IS18_IOC_NR_SET_PACKET_MODE:
+    {
+        int packet;
+        if (_IOC_DIR(cmd) != _IOC_WRITE) {
+            // wrong direction. Must be "writing to the device"
+            pr_debug("is18drv: WRONG direction for ioctl with IS18_IOC_SET_PACKET_MODE\n");
+            rv = -EINVAL;
+            break;
+        }
+        pr_debug("is18drv: called IS18_IOC_SET_PACKET_MODE via ioctl\n");
+
+        if (get_user(packet, (int __user *)arg)) {
+            rv = -EFAULT;
+            break;
+        }
+
+        if(is18_lock_ring(dev)) {
+            return -ERESTARTSYS;
+        }
+        if (packet && (dev->broadcast || dev->zerocopy_min)) {
+            // broadcast readers only read bytes, a gift is no message
+            rv = -EINVAL;
+        } else if (!!packet != dev->packet && (is18_ring_used(dev) || atomic_read(&dev->mmap_cnt))) {
+            // bytes in the ring can not be reinterpreted as messages (and vice versa),
+            // a mapping works on the byte stream
+            rv = -EBUSY;
+        } else {
+            dev->packet = !!packet;
+        }
+        is18_unlock_ring(dev);
+        break;
+    }
+    case IS18_IOC_NR_BROADCAST:
         if (_IOC_DIR(cmd) != _IOC_NONE) {
             // wrong direction. Must be "no data transfer" (because arg is not used)
             // ...
             break;
         }
+        pr_debug("is18drv: called IS18_IOC_BROADCAST via ioctl\n");
 
-        printk(KERN_INFO "is18drv: called IS18_IOC_OPENWRITECNT via ioctl\n");
-        if(down_interruptible(&dev->sem_sync)) {
+        rv = READ_ONCE(dev->broadcast);
+        break;
+    case IS18_IOC_NR_SET_BROADCAST:
+    {
+        int mode;
+        if (_IOC_DIR(cmd) != _IOC_WRITE) {
+            // wrong direction. Must be "writing to the device"
+            pr_debug("is18drv: WRONG direction for ioctl with IS18_IOC_SET_BROADCAST\n");
+            rv = -EINVAL;
+            break;
+        }
+        pr_debug("is18drv: called IS18_IOC_SET_BROADCAST via ioctl\n");
+
+        if (get_user(mode, (int __user *)arg)) {
+            rv = -EFAULT;
+            break;
+        }
+        if (mode < IS18_BROADCAST_OFF || mode > IS18_BROADCAST_LOSSY) {
+            rv = -EINVAL;
+            break;
+        }
+
+        if(is18_lock_ring(dev)) {
             return -ERESTARTSYS;
         }
-        rv = dev->current_open_write_cnt;
-        up(&dev->sem_sync);
+        if (mode == dev->broadcast) {
+            rv = 0;
+        } else if ((mode && (dev->packet || dev->overwrite || dev->zerocopy_min)) ||
+                   (mode == IS18_BROADCAST_LOSSY && dev->mpsc)) {
+            // broadcast readers only read bytes, reservations are never overwritten
+            rv = -EINVAL;
+        } else if (is18_ring_used(dev) || atomic_read(&dev->mmap_cnt) ||
+                   dev->current_open_write_cnt > !!(filp->f_mode & FMODE_WRITE)) {
+            // the cursors only start at an empty ring, and no other writer
+            // may be sleeping in the data path with the locks of the old mode
+            rv = -EBUSY;
+        } else {
+            WRITE_ONCE(dev->broadcast, mode);
+            is18_reset_cursors(dev, READ_ONCE(dev->ctrl->tail));
+        }
+        is18_unlock_ring(dev);
+        break;
+    }
+    case IS18_IOC_NR_DROPPED:
+    {
+        u64 dropped;
+        if (_IOC_DIR(cmd) != _IOC_READ) {
+            // wrong direction. Must be "reading from the device"
+            pr_debug("is18drv: WRONG direction for ioctl with IS18_IOC_DROPPED\n");
+            rv = -EINVAL;
+            break;
+        }
+        if (!(filp->f_mode & FMODE_READ)) {
+            rv = -EBADF;
+            break;
+        }
+        // updated by lossy writers holding read_lock
+        if(mutex_lock_interruptible(&dev->read_lock)) {
+            return -ERESTARTSYS;
+        }
+        dropped = f->dropped;
+        mutex_unlock(&dev->read_lock);
+        if (put_user(dropped, (__u64 __user *)arg)) {
+            rv = -EFAULT;
+        }
+        break;
+    }
+    case IS18_IOC_NR_OVERWRITE:
+        if (_IOC_DIR(cmd) != _IOC_NONE) {
+            // wrong direction. Must be "no data transfer" (because arg is not used)
+            // ...
+            break;
+        }
+        pr_debug("is18drv: called IS18_IOC_OVERWRITE via ioctl\n");
 
+        rv = READ_ONCE(dev->overwrite);
         break;
-    case IS18_IOC_NR_DEL_COUNT:
+    case IS18_IOC_NR_SET_OVERWRITE:
     {
-        int del_count;
+        int overwrite;
         if (_IOC_DIR(cmd) != _IOC_WRITE) {
             // wrong direction. Must be "writing to the device"
-            printk(KERN_ERR "is18drv: WRONG direction for ioctl with is18_IOC_DEL_COUNT\n");
-            // ...
+            pr_debug("is18drv: WRONG direction for ioctl with IS18_IOC_SET_OVERWRITE\n");
+            rv = -EINVAL;
             break;
         }
-        printk(KERN_INFO "is18drv: called IS18_IOC_DEL_COUNT via ioctl\n");
+        pr_debug("is18drv: called IS18_IOC_SET_OVERWRITE via ioctl\n");
 
-        // access_ok() muss hier NICHT verwendet werden.
-        // Wird nur benoetigt, wenn ein Puffer per arg uebergeben wird. (Also
-        // wenn arg als Zeiger verwendet wird. Ist aber hier nicht der Fall.
-        // es wurde einfach nur ein Integerwert uebergeben.)
-        del_count = arg;
-        printk("is18drv: ioctl from user space use the value %d\n", del_count);
-        // ....
+        if (get_user(overwrite, (int __user *)arg)) {
+            rv = -EFAULT;
+            break;
+        }
+
+        if(is18_lock_ring(dev)) {
+            return -ERESTARTSYS;
+        }
+        if (overwrite && (dev->broadcast || dev->mpsc || dev->zerocopy_min)) {
+            // broadcast has its own lossy mode, reservations are never overwritten
+            rv = -EINVAL;
+        } else if (overwrite && atomic_read(&dev->mmap_cnt)) {
+            // a mapping consumer doesn't notice that its bytes were overwritten
+            rv = -EBUSY;
+        } else {
+            // the ring does not have to be empty, no writer holds write_lock now
+            // (writers skip sem_sync in overwrite mode, see is18_lock_side)
+            WRITE_ONCE(dev->overwrite, !!overwrite);
+        }
+        is18_unlock_ring(dev);
+        if (!rv && overwrite) {
+            // writers waiting for space may overwrite now, all of them
+            wake_up_all(&dev->wq_free_space_available);
+        }
         break;
     }
-    case IS18_IOC_NR_READ_INDEX:
+    case IS18_IOC_NR_ZEROCOPY:
         if (_IOC_DIR(cmd) != _IOC_NONE) {
             // wrong direction. Must be "no data transfer" (because arg is not used)
             // ...
             break;
         }
-        printk(KERN_INFO "is18drv: called IS18_IOC_READ_INDEX via ioctl\n");
+        pr_debug("is18drv: called IS18_IOC_ZEROCOPY via ioctl\n");
 
-        if(down_interruptible(&dev->sem_sync)) {
-            return -ERESTARTSYS;
+        rv = READ_ONCE(dev->zerocopy_min);
+        break;
+    case IS18_IOC_NR_SET_ZEROCOPY:
+    {
+        int zerocopy_min;
+        if (_IOC_DIR(cmd) != _IOC_WRITE) {
+            // wrong direction. Must be "writing to the device"
+            pr_debug("is18drv: WRONG direction for ioctl with IS18_IOC_SET_ZEROCOPY\n");
+            rv = -EINVAL;
+            break;
+        }
+        pr_debug("is18drv: called IS18_IOC_SET_ZEROCOPY via ioctl\n");
+
+        if (get_user(zerocopy_min, (int __user *)arg)) {
+            rv = -EFAULT;
+            break;
+        }
+        if (zerocopy_min < 0 || (zerocopy_min && zerocopy_min < PAGE_SIZE)) {
+            // taking page references pays off for whole pages only
+            rv = -EINVAL;
+            break;
         }
-        rv = dev->next_read_index;
-        up(&dev->sem_sync);
 
+        if(is18_lock_ring(dev)) {
+            return -ERESTARTSYS;
+        }
+        if (zerocopy_min && (dev->packet || dev->broadcast || dev->mpsc || dev->overwrite)) {
+            // a gift is a byte stream for all readers, handed over under write_lock
+            rv = -EINVAL;
+        } else if (zerocopy_min && atomic_read(&dev->mmap_cnt)) {
+            // a mapping consumer only sees the ring
+            rv = -EBUSY;
+        } else {
+            WRITE_ONCE(dev->zerocopy_min, zerocopy_min);
+        }
+        is18_unlock_ring(dev);
         break;
-    case IS18_IOC_NR_WRITE_INDEX :
+    }
+    case IS18_IOC_NR_BUSY_POLL:
         if (_IOC_DIR(cmd) != _IOC_NONE) {
             // wrong direction. Must be "no data transfer" (because arg is not used)
             // ...
             break;
         }
-        printk(KERN_INFO "is18drv: called IS18_IOC_WRITE_INDEX via ioctl\n");
+        pr_debug("is18drv: called IS18_IOC_BUSY_POLL via ioctl\n");
 
+        rv = READ_ONCE(f->busy_poll_us);
+        break;
+    case IS18_IOC_NR_SET_BUSY_POLL:
+    {
+        int us;
+        if (_IOC_DIR(cmd) != _IOC_WRITE) {
+            // wrong direction. Must be "writing to the device"
+            pr_debug("is18drv: WRONG direction for ioctl with IS18_IOC_SET_BUSY_POLL\n");
+            rv = -EINVAL;
+            break;
+        }
+        pr_debug("is18drv: called IS18_IOC_SET_BUSY_POLL via ioctl\n");
 
-        if(down_interruptible(&dev->sem_sync)) {
-            return -ERESTARTSYS;
+        if (get_user(us, (int __user *)arg)) {
+            rv = -EFAULT;
+            break;
         }
-        rv = dev->next_write_index;
-        up(&dev->sem_sync);
+        if (us < 0 || us > IS18_BUSY_POLL_MAX) {
+            rv = -EINVAL;
+            break;
+        }
+        // only this file, read by its own waits --> no lock needed
+        WRITE_ONCE(f->busy_poll_us, us);
+        break;
+    }
+    case IS18_IOC_NR_WAKEUP:
+    {
+        struct is18_wakeup w = {
+            .rcvlowat = READ_ONCE(f->rcvlowat),
+            .rcvdelay_us = READ_ONCE(f->rcvdelay_us),
+            .sndlowat = READ_ONCE(f->sndlowat),
+        };
+        if (_IOC_DIR(cmd) != _IOC_READ) {
+            // wrong direction. Must be "reading from the device"
+            pr_debug("is18drv: WRONG direction for ioctl with IS18_IOC_WAKEUP\n");
+            rv = -EINVAL;
+            break;
+        }
+        pr_debug("is18drv: called IS18_IOC_WAKEUP via ioctl\n");
 
+        if (copy_to_user((void __user *)arg, &w, sizeof(w))) {
+            rv = -EFAULT;
+        }
         break;
-    case IS18_IOC_NR_NUM_BUFFERED_BYTES:
+    }
+    case IS18_IOC_NR_SET_WAKEUP:
+    {
+        struct is18_wakeup w;
+        if (_IOC_DIR(cmd) != _IOC_WRITE) {
+            // wrong direction. Must be "writing to the device"
+            pr_debug("is18drv: WRONG direction for ioctl with IS18_IOC_SET_WAKEUP\n");
+            rv = -EINVAL;
+            break;
+        }
+        pr_debug("is18drv: called IS18_IOC_SET_WAKEUP via ioctl\n");
+
+        if (copy_from_user(&w, (void __user *)arg, sizeof(w))) {
+            rv = -EFAULT;
+            break;
+        }
+        if (w.rcvdelay_us > IS18_WAKEUP_DELAY_MAX) {
+            rv = -EINVAL;
+            break;
+        }
+        // only this file, read by its own waits --> no lock needed
+        // (the thresholds are limited to the ring size where they are used)
+        WRITE_ONCE(f->rcvlowat, w.rcvlowat);
+        WRITE_ONCE(f->rcvdelay_us, w.rcvdelay_us);
+        WRITE_ONCE(f->sndlowat, w.sndlowat);
+        break;
+    }
+    case IS18_IOC_NR_MPSC:
         if (_IOC_DIR(cmd) != _IOC_NONE) {
             // wrong direction. Must be "no data transfer" (because arg is not used)
             // ...
             break;
         }
-        printk(KERN_INFO "is18drv: called IS18_IOC_NUM_BUFFERED_BYTES via ioctl\n");
+        pr_debug("is18drv: called IS18_IOC_MPSC via ioctl\n");
+
+        rv = READ_ONCE(dev->mpsc);
+        break;
+    case IS18_IOC_NR_SET_MPSC:
+    {
+        int mpsc;
+        if (_IOC_DIR(cmd) != _IOC_WRITE) {
+            // wrong direction. Must be "writing to the device"
+            pr_debug("is18drv: WRONG direction for ioctl with IS18_IOC_SET_MPSC\n");
+            rv = -EINVAL;
+            break;
+        }
+        pr_debug("is18drv: called IS18_IOC_SET_MPSC via ioctl\n");
 
+        if (get_user(mpsc, (int __user *)arg)) {
+            rv = -EFAULT;
+            break;
+        }
 
-        if(down_interruptible(&dev->sem_sync)) {
+        if(is18_lock_ring(dev)) {
             return -ERESTARTSYS;
         }
-        rv = dev->current_pipe_bytes;
-        up(&dev->sem_sync);
+        if (!!mpsc == dev->mpsc) {
+            rv = 0;
+        } else if (mpsc && (dev->broadcast == IS18_BROADCAST_LOSSY || dev->overwrite || dev->zerocopy_min)) {
+            // reservations are never overwritten
+            rv = -EINVAL;
+        } else if (is18_ring_used(dev) || atomic_read(&dev->mmap_cnt) ||
+                   dev->current_open_write_cnt > !!(filp->f_mode & FMODE_WRITE)) {
+            // no other writer may be sleeping in the data path with the locks of the old mode
+            rv = -EBUSY;
+        } else {
+            // no reservation is pending (lock_ring) --> the reserved space ends at head
+            dev->reserve = READ_ONCE(dev->ctrl->head);
+            WRITE_ONCE(dev->mpsc, !!mpsc);
+        }
+        is18_unlock_ring(dev);
+        break;
+    }
+    case IS18_IOC_NR_READ_BATCH:
+    {
+        struct is18_batch batch;
+        struct iovec iov;
+        struct iov_iter to;
+        unsigned int msgs = 0;
+        if (_IOC_DIR(cmd) != (_IOC_READ | _IOC_WRITE)) {
+            // wrong direction. Must be "reading and writing"
+            pr_debug("is18drv: WRONG direction for ioctl with IS18_IOC_READ_BATCH\n");
+            rv = -EINVAL;
+            break;
+        }
+        pr_debug("is18drv: called IS18_IOC_READ_BATCH via ioctl\n");
 
+        if (!(filp->f_mode & FMODE_READ)) {
+            rv = -EBADF;
+            break;
+        }
+        if (copy_from_user(&batch, (void __user *)arg, sizeof(batch))) {
+            rv = -EFAULT;
+            break;
+        }
+        rv = import_single_range(READ, u64_to_user_ptr(batch.buf), batch.len, &iov, &to);
+        if (rv) {
+            break;
+        }
+        // blocks until there is at least one message, like read()
+        rv = is18_do_read(dev, f, &to, is18_nonblock(filp), &msgs);
+        if (rv < 0) {
+            break;
+        }
+        batch.count = msgs;
+        if (put_user(batch.count, &((struct is18_batch __user *)arg)->count)) {
+            rv = -EFAULT;
+        }
         break;
-    case IS18_IOC_NR_EMPTY_BUFFER:
+    }
+    case IS18_IOC_NR_STATS:
+    {
+        struct is18_stats st;
+        if (_IOC_DIR(cmd) != _IOC_READ) {
+            // wrong direction. Must be "reading from the device"
+            pr_debug("is18drv: WRONG direction for ioctl with IS18_IOC_STATS\n");
+            rv = -EINVAL;
+            break;
+        }
+        // lock free counters --> no sem_sync needed
+        is18_get_stats(dev, &st);
+        // callers built against an older version get the fields they know
+        if (copy_to_user((void __user *)arg, &st, min_t(size_t, _IOC_SIZE(cmd), sizeof(st)))) {
+            rv = -EFAULT;
+        }
+        break;
+    }
+    case IS18_IOC_NR_RESET_LATENCY:
         if (_IOC_DIR(cmd) != _IOC_NONE) {
             // wrong direction. Must be "no data transfer" (because arg is not used)
             // ...
             break;
         }
-        printk(KERN_INFO "is18drv: called IS18_IOC_EMPTY_BUFFER via ioctl\n");
+        pr_debug("is18drv: called IS18_IOC_RESET_LATENCY via ioctl\n");
+        // per CPU counters --> no sem_sync needed
+        is18_reset_latency(dev);
+        break;
+    case IS18_IOC_NR_SEND_MMSG:
+        if (_IOC_DIR(cmd) != (_IOC_READ | _IOC_WRITE)) {
+            // wrong direction. Must be "reading and writing"
+            pr_debug("is18drv: WRONG direction for ioctl with IS18_IOC_SEND_MMSG\n");
+            rv = -EINVAL;
+            break;
+        }
+        if (!(filp->f_mode & FMODE_WRITE)) {
+            rv = -EBADF;
+            break;
+        }
+        rv = is18_send_mmsg(dev, (struct is18_mmsg __user *)arg, is18_nonblock(filp));
+        break;
+    case IS18_IOC_NR_RECV_MMSG:
+        if (_IOC_DIR(cmd) != (_IOC_READ | _IOC_WRITE)) {
+            // wrong direction. Must be "reading and writing"
+            pr_debug("is18drv: WRONG direction for ioctl with IS18_IOC_RECV_MMSG\n");
+            rv = -EINVAL;
+            break;
+        }
+        if (!(filp->f_mode & FMODE_READ)) {
+            rv = -EBADF;
+            break;
+        }
+        rv = is18_recv_mmsg(dev, (struct is18_mmsg __user *)arg, is18_nonblock(filp));
+        break;
+    default:
+        break;
+        // ...
+    }
 
+    return rv;
+}
 
-        if(down_interruptible(&dev->sem_sync)) {
+
+// ioctls of /dev/is18ctl: IS18_IOC_CREATE_DEVICE and IS18_IOC_DESTROY_DEVICE
+static long is18_ctl_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct is18_cdev *dev;
+    int minor;
+    long rv;
+
+    if (_IOC_TYPE(cmd) != IS18_IOC_MY_MAGIC) {
+        return -ENOTTY;
+    }
+    // every device costs memory, only the administrator may create them
+    if (!capable(CAP_SYS_ADMIN)) {
+        return -EPERM;
+    }
+    if (get_user(minor, (int __user *)arg)) {
+        return -EFAULT;
+    }
+    if (minor < -1 || minor >= max_devices) {
+        return -EINVAL;
+    }
+
+    switch (_IOC_NR(cmd)) {
+    case IS18_IOC_NR_CREATE_DEVICE:
+        if (_IOC_DIR(cmd) != (_IOC_READ | _IOC_WRITE)) {
+            // wrong direction. Must be "reading and writing"
+            return -EINVAL;
+        }
+        pr_debug("is18drv: called IS18_IOC_CREATE_DEVICE via ioctl\n");
+        if (mutex_lock_interruptible(&is18_devs_lock)) {
             return -ERESTARTSYS;
         }
-        //set read/write index and number of bytes in buffer to 0 --> empty
-        dev->next_read_index = 0;
-        dev->next_write_index = 0;
-        dev->current_pipe_bytes = 0;
-        rv = 0;
-
-        up(&dev->sem_sync);
+        dev = is18_create_dev(minor);
+        rv = IS_ERR(dev) ? PTR_ERR(dev) : dev->device_number;
+        mutex_unlock(&is18_devs_lock);
+        if (rv >= 0 && put_user((int)rv, (int __user *)arg)) {
+            rv = -EFAULT;
+        }
+        break;
+    case IS18_IOC_NR_DESTROY_DEVICE:
+        if (_IOC_DIR(cmd) != _IOC_WRITE) {
+            // wrong direction. Must be "writing to the device"
+            return -EINVAL;
+        }
+        pr_debug("is18drv: called IS18_IOC_DESTROY_DEVICE via ioctl\n");
+        if (mutex_lock_interruptible(&is18_devs_lock)) {
+            return -ERESTARTSYS;
+        }
+        dev = minor < 0 ? NULL : xa_load(&is18_devs, minor);
+        rv = dev ? is18_destroy_dev(dev, false) : -ENODEV;
+        mutex_unlock(&is18_devs_lock);
         break;
     default:
+        rv = -ENOTTY;
         break;
-        // ...
     }
 
     return rv;
 }
 
+static void is18_vma_open(struct vm_area_struct *vma) {
+    struct is18_cdev *dev = vma->vm_private_data;
+    atomic_inc(&dev->mmap_cnt);
+}
+
+static void is18_vma_close(struct vm_area_struct *vma) {
+    struct is18_cdev *dev = vma->vm_private_data;
+    atomic_dec(&dev->mmap_cnt);
+}
+
+static const struct vm_operations_struct is18_vm_ops = {
+    .open = is18_vma_open,
+    .close = is18_vma_close,
+};
+
+// Maps the control page (page offset IS18_MMAP_CTRL_PGOFF) and the ring
+// pages (from IS18_MMAP_DATA_PGOFF on) into user space, see is18_ioctl.h.
+// The pages are inserted directly, so there are no page faults later on.
+static int is18_mmap(struct file *filp, struct vm_area_struct *vma) {
+    struct is18_cdev *dev = is18_dev(filp);
+    unsigned long first = vma->vm_pgoff;
+    unsigned long count = vma_pages(vma);
+    unsigned long i;
+    int rv = 0;
+
+    if(!(vma->vm_flags & VM_SHARED)) {
+        // a private copy of the ring is useless
+        return -EINVAL;
+    }
+
+    // not is18_lock_ring(): we hold the mmap_lock of the mm, a reader or
+    // writer holding the data path locks may fault and wait for it
+    if(mutex_lock_interruptible(&dev->map_lock)) {
+        return -ERESTARTSYS;
+    }
+    if(!dev->buffer) {
+        rv = -ENXIO;
+        goto out;
+    }
+    if(dev->packet || dev->broadcast || dev->mpsc || dev->overwrite || dev->zerocopy_min) {
+        // the mmap protocol is a byte stream with a single producer and consumer
+        rv = -EINVAL;
+        goto out;
+    }
+    if(first + count > IS18_MMAP_DATA_PGOFF + dev->nr_pages) {
+        rv = -EINVAL;
+        goto out;
+    }
+
+    for(i = 0; i < count; ++i) {
+        unsigned long pgoff = first + i;
+        struct page *page;
+
+        if(pgoff == IS18_MMAP_CTRL_PGOFF) {
+            page = virt_to_page(dev->ctrl);
+        } else {
+            page = dev->pages[pgoff - IS18_MMAP_DATA_PGOFF];
+        }
+        rv = vm_insert_page(vma, vma->vm_start + i * PAGE_SIZE, page);
+        if(rv) {
+            goto out;
+        }
+    }
+
+    vma->vm_ops = &is18_vm_ops;
+    vma->vm_private_data = dev;
+    is18_vma_open(vma);
+out:
+    mutex_unlock(&dev->map_lock);
+    return rv;
+}
 
 static int is18_seq_open (struct inode *inode, struct file *filp) {
     return seq_open(filp, &is18_proc_seq_ops);
 }
 
-// If *off is zero, returns a pointer to the first is18_devs entry.
-// Otherwise, returns NULL.
+// The proc files walk is18_devs in order of the minor numbers, holding
+// is18_devs_lock from start to stop, so no device disappears meanwhile.
+// *pos is 0 for the header (SEQ_START_TOKEN), minor + 1 for a device.
+static void *is18_seq_find(loff_t *pos, unsigned long index) {
+    struct is18_cdev *dev = xa_find(&is18_devs, &index, ULONG_MAX, XA_PRESENT);
+
+    *pos = index + 1;
+    return dev;
+}
+
 static void *is18_start (struct seq_file *sf, loff_t *pos) {
-    printk(KERN_INFO "is18drv: is18_start() called with offset %llu\n", *pos);
+    pr_debug("is18drv: is18_start() called with offset %llu\n", *pos);
+    mutex_lock(&is18_devs_lock);
     if(!(*pos)) {
-        return is18_devs;
+        return SEQ_START_TOKEN;
     }
-    return NULL;
+    return is18_seq_find(pos, *pos - 1);
 }
 
 static void is18_stop (struct seq_file *sf, void *it) {
-    printk(KERN_INFO "is18drv: is18_stop() called\n");
+    pr_debug("is18drv: is18_stop() called\n");
+    mutex_unlock(&is18_devs_lock);
 }
 
-//  get next character device
+//  get next character device (O(log n) lookup of the next used minor number)
 static void *is18_next (struct seq_file *sf, void *it, loff_t *pos) {
-    // return 0, when there are no more devices
-    if(++*pos >= MINOR_COUNT) {
-        return NULL;
+    // returns NULL, when there are no more devices
+    if(it == SEQ_START_TOKEN) {
+        return is18_seq_find(pos, 0);
     }
-
-    return is18_devs + *pos;
+    return is18_seq_find(pos, ((struct is18_cdev *)it)->device_number + 1);
 }
 // show device details
 static int is18_show (struct seq_file *sf, void *it) {
     struct is18_cdev *dev = it;
+    struct is18_stats st;
+    if(it == SEQ_START_TOKEN) {
+        return 0;
+    }
     if(down_interruptible(&dev->sem_sync)) {
         return -ERESTARTSYS;
     }
 
     // print device state
-    seq_printf(sf, "# device: %d \n - buffered bytes: %d\n - read index: %d\n - write index: %d\n - open read cnt: %d\n - open write cnt: %d\n\n", dev->device_number, dev->current_pipe_bytes, dev->next_read_index, dev->next_write_index, dev->current_open_read_cnt, dev->current_open_write_cnt);
+    is18_get_stats(dev, &st);
+    seq_printf(sf, "# device: %d \n - buffer size: %d\n - buffered bytes: %u\n - read index: %u\n - write index: %u\n - open read cnt: %d\n - open write cnt: %d\n - lockless spsc: %d\n - packet mode: %d\n - broadcast: %d\n - mpsc: %d\n - overwrite: %d\n - zerocopy min: %d\n - ring allocated: %d\n - numa node: %d\n - ring node: %d\n", dev->device_number, dev->buffer_size, min_t(unsigned int, is18_ring_used(dev), dev->buffer_size), READ_ONCE(dev->ctrl->tail) & dev->buffer_mask, READ_ONCE(dev->ctrl->head) & dev->buffer_mask, dev->current_open_read_cnt, dev->current_open_write_cnt, dev->spsc, dev->packet, dev->broadcast, dev->mpsc, dev->overwrite, dev->zerocopy_min, dev->buffer != NULL, dev->numa_node, is18_ring_node(dev));
+    if(is18_ring_node(dev) != NUMA_NO_NODE) {
+        // affinity hint: producer and consumer should run on these CPUs
+        seq_printf(sf, " - ring node cpus: %*pbl\n", cpumask_pr_args(cpumask_of_node(is18_ring_node(dev))));
+    }
     up(&dev->sem_sync);
+    seq_printf(sf, " - bytes in: %llu\n - bytes out: %llu\n - reads: %llu\n - writes: %llu\n - reader blocked: %llu\n - writer blocked: %llu\n - eagain: %llu\n - enospc: %llu\n - overwritten: %llu\n - high water mark: %u\n\n", st.bytes_in, st.bytes_out, st.reads, st.writes, st.read_blocked, st.write_blocked, st.eagain, st.enospc, st.overwritten, st.high_water);
 
     return 0;
 }
@@ -578,4 +3545,96 @@ module_init(is18drv_init);
 // Function to be run when driver is removed.
 module_exit(is18drv_exit);
 
+static int is18_stats_seq_open (struct inode *inode, struct file *filp) {
+    return seq_open(filp, &is18_stats_seq_ops);
+}
+
+// one line per device, the first line names the columns
+static int is18_show_stats (struct seq_file *sf, void *it) {
+    struct is18_cdev *dev = it;
+    struct is18_stats st;
+
+    if(it == SEQ_START_TOKEN) {
+        seq_puts(sf, "device bytes_in bytes_out reads writes read_blocked write_blocked eagain enospc high_water overwritten\n");
+        return 0;
+    }
+    is18_get_stats(dev, &st);
+    seq_printf(sf, "%d %llu %llu %llu %llu %llu %llu %llu %llu %u %llu\n", dev->device_number,
+               st.bytes_in, st.bytes_out, st.reads, st.writes, st.read_blocked, st.write_blocked,
+               st.eagain, st.enospc, st.high_water, st.overwritten);
+
+    return 0;
+}
+
+static int is18_latency_seq_open (struct inode *inode, struct file *filp) {
+    return seq_open(filp, &is18_latency_seq_ops);
+}
+
+// upper bound in ns of the bucket which reaches permille of all samples
+static u64 is18_lat_percentile(const u64 *hist, u64 samples, unsigned int permille) {
+    u64 rank = div_u64(samples * permille + 999, 1000);
+    u64 sum = 0;
+    unsigned int i;
+
+    for(i = 0; i < IS18_LAT_BUCKETS - 1; ++i) {
+        sum += hist[i];
+        if(sum >= rank) {
+            break;
+        }
+    }
+    return 1ULL << (i + 1);
+}
+
+// one line per device and histogram: number of samples, p50, p99 and p99.9
+// (upper bounds of the log2 buckets) and the used buckets as <upper bound>:<count>
+static int is18_show_latency (struct seq_file *sf, void *it) {
+    static const char * const names[IS18_LAT_NR] = {
+        [IS18_LAT_BLOCKED_EMPTY] = "blocked_empty",
+        [IS18_LAT_BLOCKED_FULL] = "blocked_full",
+        [IS18_LAT_RESIDENCY] = "residency",
+    };
+    struct is18_cdev *dev = it;
+    u64 hist[IS18_LAT_BUCKETS];
+    unsigned int which, i;
+    int cpu;
+
+    if(it == SEQ_START_TOKEN) {
+        seq_puts(sf, "device histogram samples p50_ns p99_ns p999_ns buckets(<ns:count)\n");
+        return 0;
+    }
+    for(which = 0; which < IS18_LAT_NR; ++which) {
+        u64 samples = 0;
+
+        memset(hist, 0, sizeof(hist));
+        for_each_possible_cpu(cpu) {
+            const struct is18_pcpu_latency *pcpu = per_cpu_ptr(dev->latency, cpu);
+
+            for(i = 0; i < IS18_LAT_BUCKETS; ++i) {
+                hist[i] += READ_ONCE(pcpu->hist[which][i]);
+            }
+        }
+        for(i = 0; i < IS18_LAT_BUCKETS; ++i) {
+            samples += hist[i];
+        }
+        seq_printf(sf, "%d %s %llu", dev->device_number, names[which], samples);
+        if(samples) {
+            seq_printf(sf, " %llu %llu %llu", is18_lat_percentile(hist, samples, 500),
+                       is18_lat_percentile(hist, samples, 990), is18_lat_percentile(hist, samples, 999));
+        } else {
+            seq_puts(sf, " 0 0 0");
+        }
+        for(i = 0; i < IS18_LAT_BUCKETS; ++i) {
+            if(hist[i]) {
+                seq_printf(sf, " %llu:%llu", 1ULL << (i + 1), hist[i]);
+            }
+        }
+        seq_putc(sf, '\n');
+    }
+
+    return 0;
+}
 
+#if IS_ENABLED(CONFIG_IS18_KUNIT_TEST)
+// the tests use the static functions above
+#include "is18_kunit.c"
+#endif
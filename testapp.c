@@ -1,18 +1,53 @@
+#define _GNU_SOURCE  // splice
+#include <errno.h>
+#include <sched.h>
 #include <fcntl.h>
+#include <linux/io_uring.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "is18_ioctl.h"
 
 #define READBUF_SIZE 32
 #define PROC_FILE "/proc/is18/info"
+#define PROC_STATS_FILE "/proc/is18/stats"
+#define PROC_LATENCY_FILE "/proc/is18/latency"
+#define BENCH_TOTAL_BYTES (64 * 1024 * 1024)  // bytes transferred per benchmark run
+#define BENCH_CHUNK_SIZE (64 * 1024)           // bytes per read/write call
+#define EPOLL_WAKEUPS 10000                    // number of messages for the epoll benchmark
+#define BENCH_IOV_CNT 64                       // records per batch in the submission benchmark
+#define BENCH_IOV_SIZE 512                     // bytes per record in the submission benchmark
+#define BENCH_RECORDS 200000                   // records per run of the small record benchmark
+#define BENCH_RECORD_SIZE 64                   // bytes per small record
+#define BENCH_MMSG_BATCH 64                    // records per IS18_IOC_SEND_MMSG/RECV_MMSG call
+#define BENCH_NUMA_RING_SIZE (4 * 1024 * 1024)  // larger than the caches, so the memory node matters
+#define MAX_NODES 64
+#define BENCH_MPSC_BYTES (32 * 1024 * 1024)    // bytes per run of the multi writer benchmark
+#define BENCH_MPSC_MAX_WRITERS 64
+#define ZEROCOPY_MIN (64 * 1024)               // IS18_IOC_SET_ZEROCOPY of the zero copy test/benchmark
+#define ZEROCOPY_TEST_SIZE (1024 * 1024)       // the large write of the zero copy test
+#define PINGPONG_BUSY_POLL 50                  // IS18_IOC_SET_BUSY_POLL (us) of the busy poll run
+#define BENCH_MSG_SIZE 4096                    // default --msg-size of bench_throughput/bench_scaling
+#define BENCH_SCALING_THREADS 8                // default --threads of bench_scaling
+#define BENCH_MAX_THREADS 64
+#define BENCH_MAX_CPUS 256                     // entries of --cpus
+#define WAKEUP_READERS 16                      // blocked readers of the wakeup test
+#define WAKEUP_BYTES 100                       // bytes every reader of the wakeup test reads
+#define LOWAT_BYTES 32                         // IS18_IOC_SET_WAKEUP rcvlowat of the lowat test
+#define LOWAT_DELAY_US 50000                   // IS18_IOC_SET_WAKEUP rcvdelay_us of the lowat test
 
 //colours
 #define KNRM "\x1B[0m"   //normal
@@ -24,15 +59,197 @@ void print_help(void);
 int testcase_ioctrl(char* device);
 int testcase_read_write_nonblocking(char* device);
 int testcase_read_write_blocking(char* device);
+int testcase_mmap(char* device);
+int testcase_splice(char* device);
+int testcase_packet(char* device);
+int testcase_stats(char* device);
+int testcase_latency(char* device);
+int testcase_ctl(char* device);
+int testcase_broadcast(char* device);
+int testcase_overwrite(char* device);
+int testcase_zerocopy(char* device);
+void* zerocopy_writer_thread(void* args);
+int testcase_wakeup(char* device);
+void* wakeup_reader_thread(void* args);
+long ctxt_switches(void);
+int testcase_lowat(char* device);
+void* trickle_writer_thread(void* args);
+int read_latency(int minor, const char* histogram, unsigned long long* samples, unsigned long long* p99);
 void* writer_thread(void* args);
 void* reader_thread(void* args);
 int  print_file(char* filename);
+int bench_ring_sizes(char* device);
+void* bench_reader_thread(void* args);
+double elapsed_sec(struct timespec* start, struct timespec* end);
+int bench_epoll(char* device);
+int compare_double(const void* a, const void* b);
+void* epoll_writer_thread(void* args);
+double percentile(double* sorted, int num, double p);
+int bench_submit(char* device);
+void* bench_submit_reader(void* args);
+int bench_small_records(char* device);
+void* bench_record_reader(void* args);
+int bench_numa(char* device);
+int bench_mpsc(char* device);
+void* bench_mpsc_writer(void* args);
+int bench_zerocopy(char* device);
+int bench_pingpong(char* device);
+void* pingpong_echo_thread(void* args);
+int bench_throughput(char* device);
+int bench_scaling(char* device);
+int run_throughput(char* device, int writers, const char* name);
+void* throughput_writer_thread(void* args);
+void* throughput_reader_thread(void* args);
+int parse_bench_option(char* arg);
+void pin_self(int index);
+int node_cpus(int node, cpu_set_t* cpus, int max_cpus);
 
 struct thread_args {
     unsigned int delay_sec;
     int file;
 };
 
+struct bench_args {
+    int file;
+    size_t total_bytes;  // bytes to transfer
+    size_t chunk_size;   // bytes per syscall
+    int errors;
+};
+
+enum submit_method { SUBMIT_SCALAR, SUBMIT_VECTORED, SUBMIT_IO_URING };
+
+// io_uring instance set up with the raw syscalls (no liburing)
+struct uring {
+    int fd;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+};
+
+struct submit_args {
+    int file;
+    enum submit_method method;
+    size_t total_bytes;
+    int errors;
+};
+
+struct record_args {
+    int file;
+    int use_mmsg;  // 1: IS18_IOC_RECV_MMSG, 0: one read() per record
+    int errors;
+};
+
+struct mpsc_args {
+    int file;               // every writer thread has a fd of its own
+    unsigned char id;       // every record of the writer is filled with it
+    unsigned int records;   // records to write
+    int errors;
+};
+
+struct zerocopy_args {
+    int file;
+    char* buf;      // written between two small writes
+    size_t len;
+    int errors;
+};
+
+struct wakeup_args {
+    char* device;   // every reader opens a fd of its own
+    long switches;  // context switches of the reader while it read WAKEUP_BYTES
+    int errors;
+};
+
+struct trickle_args {
+    int file;
+    int bytes;      // written one byte per write()
+    int gap_us;     // pause between two writes
+    int errors;
+};
+
+struct pingpong_args {
+    int in;     // ping device, read by the echo thread
+    int out;    // pong device
+    size_t msg_size;
+    int errors;
+};
+
+enum bench_format { FORMAT_TEXT, FORMAT_JSON, FORMAT_CSV };
+
+// options of bench_throughput, bench_pingpong and bench_scaling, given as
+// --<name>=<value> in front of the mode (see print_help)
+struct bench_opts {
+    size_t msg_size;        // bytes per write(), 0: default of the benchmark
+    int ring_size;          // 0: keep the ring size of the device
+    int threads;            // writer threads (bench_scaling: up to)
+    double duration;        // seconds per run
+    int cpus[BENCH_MAX_CPUS];  // thread i is pinned to cpus[i % nr_cpus]
+    int nr_cpus;            // 0: no pinning
+    enum bench_format format;
+    FILE* out;              // results, NULL: stdout
+};
+
+static struct bench_opts opts = {.duration = 2.0, .format = FORMAT_TEXT};
+
+// latency samples in usec, grown on demand
+struct lat_samples {
+    double* us;
+    size_t cnt;
+    size_t cap;
+};
+
+// one line of the machine readable output
+struct bench_result {
+    const char* bench;
+    size_t msg_size;
+    int ring_size;
+    int threads;
+    int busy_poll;
+    double seconds;
+    size_t bytes;
+    size_t msgs;
+    struct lat_samples* lat;    // sorted by print_result
+};
+
+struct throughput_args {
+    int file;
+    int index;                  // of the thread for --cpus, the reader is 0
+    size_t msg_size;
+    struct timespec end;        // writers stop after this
+    size_t bytes;
+    struct lat_samples lat;     // writers: duration of each write()
+    int stop;                   // reader: stop after final bytes (set with __atomic)
+    size_t final;
+    int errors;
+};
+
+struct epoll_args {
+    int file;
+    int iterations;
+    sem_t consumed;  // posted by the reader for every received message
+    int errors;
+};
+
+int uring_setup(struct uring* ring, unsigned entries);
+void uring_exit(struct uring* ring);
+ssize_t uring_rw(struct uring* ring, int opcode, int fd, struct iovec* iov, int iovcnt);
+int fill_iov(struct iovec* iov, char* buf, size_t remaining);
+ssize_t submit_batch(enum submit_method method, struct uring* ring, int fd, int is_write,
+                     struct iovec* iov, int iovcnt);
+
+void lat_add(struct lat_samples* lat, double us);
+void print_result(struct bench_result* r);
+ssize_t read_full(int fd, char* buf, size_t len);
+
 int main(int argc, char** argv) {
     if (argc <= 2) {
         print_help();
@@ -47,6 +264,17 @@ int main(int argc, char** argv) {
     printf("%s", KNRM);
 
     for (int i = 2; i < argc; i++) {
+        if (strncmp(argv[i], "--", 2) == 0) {
+            // benchmark option, applies to the modes after it
+            if (parse_bench_option(argv[i])) {
+                printf("%s", KRED);
+                printf("option '%s' is not supported. this is how it works:\n", argv[i]);
+                printf("%s", KNRM);
+                print_help();
+                return 1;
+            }
+            continue;
+        }
         printf("\narg%d = '%s' \n\n", i, argv[i]);
         if (strcmp(argv[i], "rw_blocking") == 0) {
             test_result = testcase_read_write_blocking(device);
@@ -54,10 +282,63 @@ int main(int argc, char** argv) {
             test_result = testcase_read_write_nonblocking(device);
         } else if (strcmp(argv[i], "ioctl") == 0) {
             test_result = testcase_ioctrl(device);
+        } else if (strcmp(argv[i], "mmap") == 0) {
+            test_result = testcase_mmap(device);
+        } else if (strcmp(argv[i], "splice") == 0) {
+            test_result = testcase_splice(device);
+        } else if (strcmp(argv[i], "packet") == 0) {
+            test_result = testcase_packet(device);
+        } else if (strcmp(argv[i], "stats") == 0) {
+            test_result = testcase_stats(device);
+        } else if (strcmp(argv[i], "latency") == 0) {
+            test_result = testcase_latency(device);
+        } else if (strcmp(argv[i], "ctl") == 0) {
+            test_result = testcase_ctl(device);
+        } else if (strcmp(argv[i], "broadcast") == 0) {
+            test_result = testcase_broadcast(device);
+        } else if (strcmp(argv[i], "overwrite") == 0) {
+            test_result = testcase_overwrite(device);
+        } else if (strcmp(argv[i], "zerocopy") == 0) {
+            test_result = testcase_zerocopy(device);
+        } else if (strcmp(argv[i], "wakeup") == 0) {
+            test_result = testcase_wakeup(device);
+        } else if (strcmp(argv[i], "lowat") == 0) {
+            test_result = testcase_lowat(device);
+        } else if (strcmp(argv[i], "bench_ringsize") == 0) {
+            test_result = bench_ring_sizes(device);
+        } else if (strcmp(argv[i], "bench_epoll") == 0) {
+            test_result = bench_epoll(device);
+        } else if (strcmp(argv[i], "bench_submit") == 0) {
+            test_result = bench_submit(device);
+        } else if (strcmp(argv[i], "bench_smallrec") == 0) {
+            test_result = bench_small_records(device);
+        } else if (strcmp(argv[i], "bench_numa") == 0) {
+            test_result = bench_numa(device);
+        } else if (strcmp(argv[i], "bench_mpsc") == 0) {
+            test_result = bench_mpsc(device);
+        } else if (strcmp(argv[i], "bench_zerocopy") == 0) {
+            test_result = bench_zerocopy(device);
+        } else if (strcmp(argv[i], "bench_pingpong") == 0) {
+            test_result = bench_pingpong(device);
+        } else if (strcmp(argv[i], "bench_throughput") == 0) {
+            test_result = bench_throughput(device);
+        } else if (strcmp(argv[i], "bench_scaling") == 0) {
+            test_result = bench_scaling(device);
         } else if (strcmp(argv[i], "all") == 0) {
             test_result = testcase_read_write_blocking(device);
             test_result += testcase_read_write_nonblocking(device);
             test_result += testcase_ioctrl(device);
+            test_result += testcase_mmap(device);
+            test_result += testcase_splice(device);
+            test_result += testcase_packet(device);
+            test_result += testcase_stats(device);
+            test_result += testcase_latency(device);
+            test_result += testcase_ctl(device);
+            test_result += testcase_broadcast(device);
+            test_result += testcase_overwrite(device);
+            test_result += testcase_zerocopy(device);
+            test_result += testcase_wakeup(device);
+            test_result += testcase_lowat(device);
         } else {
             printf("%s", KRED);
             printf("mode '%s' is not supported. this is how it works:\n", argv[i]);
@@ -80,6 +361,9 @@ int main(int argc, char** argv) {
     printf("### TESTS FINISHED ###\n\n");
     printf("%s", KNRM);
 
+    if (opts.out) {
+        fclose(opts.out);
+    }
     return 0;
 }
 
@@ -374,6 +658,7 @@ int testcase_ioctrl(char* device) {
     int len = 0;
     int read_bytes = 0;
     int byte_to_read = 2;
+    struct is18_peek peek;
 
     int read_cnt = 0;
     int write_cnt = 0;
@@ -456,6 +741,29 @@ int testcase_ioctrl(char* device) {
         ++num_of_errors;
     }
 
+    // peek: the bytes stay in the ring
+    peek = (struct is18_peek){(unsigned long)read_buf, sizeof(read_buf), 1, 0, 0};
+    rv = ioctl(fd, IS18_IOC_PEEK, &peek);
+    printf("ioctl IS18_IOC_PEEK of %s: %d, %u bytes unread\n", device, rv, peek.avail);
+    if (rv != len - byte_to_read - 1 || peek.avail != (unsigned)(len - byte_to_read) ||
+        memcmp(read_buf, buf + byte_to_read + 1, rv)) {
+        printf("ERROR peek at offset 1 returned %d bytes\n", rv);
+        ++num_of_errors;
+    }
+
+    // drop one byte without reading it, then more than there are
+    rv = ioctl(fd, IS18_IOC_DEL_COUNT, 1);
+    printf("ioctl IS18_IOC_DEL_COUNT of %s: %d\n", device, rv);
+    if (rv != 1 || ioctl(fd, IS18_IOC_READ_INDEX) != byte_to_read + 1) {
+        printf("ERROR dropped %d bytes, but expected 1\n", rv);
+        ++num_of_errors;
+    }
+    rv = ioctl(fd, IS18_IOC_DEL_COUNT, 100);
+    if (rv != len - byte_to_read - 1 || ioctl(fd, IS18_IOC_NUM_BUFFERED_BYTES)) {
+        printf("ERROR dropped %d bytes, but expected the remaining %d\n", rv, len - byte_to_read - 1);
+        ++num_of_errors;
+    }
+
     rv = ioctl(fd, IS18_IOC_EMPTY_BUFFER);
     printf("ioctl IS18_IOC_EMPTY_BUFFER of %s: %d\n", device, rv);
     if (rv) {
@@ -582,32 +890,2485 @@ int testcase_ioctrl(char* device) {
     return num_of_errors;
 }
 
-int  print_file(char* filename)
-{
-    FILE *fp;
+double elapsed_sec(struct timespec* start, struct timespec* end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
 
-    char c;
+void* bench_reader_thread(void* args) {
+    struct bench_args* arguments = (struct bench_args*)args;
+    char* buf = malloc(arguments->chunk_size);
+    size_t done = 0;
 
-    // Open file
-    fp = fopen(filename, "r");
-    if (fp == NULL)
-    {
-        printf("Cannot open file \n");
+    if (!buf) {
+        ++arguments->errors;
+        return NULL;
+    }
+    while (done < arguments->total_bytes) {
+        ssize_t rv = read(arguments->file, buf, arguments->chunk_size);
+        if (rv <= 0) {
+            printf("ERROR read returned %zd after %zu bytes\n", rv, done);
+            ++arguments->errors;
+            break;
+        }
+        done += rv;
+    }
+    free(buf);
+    return NULL;
+}
+
+/*
+ *  BENCHMARK throughput over different ring sizes
+ */
+int bench_ring_sizes(char* device) {
+    static const int ring_sizes[] = {16, 256, 4096, 64 * 1024, 1024 * 1024, 4 * 1024 * 1024};
+    int num_of_errors = 0;
+    int fd_wo, fd_ro;
+    int orig_size;
+    char* buf;
+
+    printf("%s", KYEL);
+    printf("# Benchmark ring sizes\n\n");
+    printf("%s", KNRM);
+
+    if ((fd_wo = open(device, O_WRONLY)) < 0) {
+        perror(device);
+        return 1;
+    }
+    if ((fd_ro = open(device, O_RDONLY)) < 0) {
+        perror(device);
+        close(fd_wo);
+        return 1;
+    }
+    buf = calloc(1, BENCH_CHUNK_SIZE);
+    if (!buf) {
+        close(fd_ro);
+        close(fd_wo);
         return 1;
+    }
 
+    orig_size = ioctl(fd_wo, IS18_IOC_BUFFER_SIZE);
+    if (ioctl(fd_wo, IS18_IOC_EMPTY_BUFFER)) {
+        printf("clearing buffer did not work");
+        ++num_of_errors;
     }
 
-    c = fgetc(fp);
-    while (c != EOF)
-    {
-        printf ("%c", c);
-        c = fgetc(fp);
+    printf("%12s %12s %12s\n", "ring size", "seconds", "MB/s");
+    for (size_t i = 0; i < sizeof(ring_sizes) / sizeof(ring_sizes[0]); ++i) {
+        int size = ring_sizes[i];
+        size_t done = 0;
+        pthread_t id_reader;
+        struct timespec start, end;
+        struct bench_args arguments = {fd_ro, BENCH_TOTAL_BYTES, BENCH_CHUNK_SIZE, 0};
+
+        if (ioctl(fd_wo, IS18_IOC_SET_BUFFER_SIZE, &size)) {
+            perror("IS18_IOC_SET_BUFFER_SIZE");
+            ++num_of_errors;
+            continue;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pthread_create(&id_reader, NULL, bench_reader_thread, &arguments);
+        while (done < BENCH_TOTAL_BYTES) {
+            ssize_t rv = write(fd_wo, buf, BENCH_CHUNK_SIZE);
+            if (rv <= 0) {
+                printf("ERROR write returned %zd after %zu bytes\n", rv, done);
+                ++num_of_errors;
+                break;
+            }
+            done += rv;
+        }
+        pthread_join(id_reader, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        num_of_errors += arguments.errors;
+
+        double duration = elapsed_sec(&start, &end);
+        printf("%12d %12.3f %12.1f\n", size, duration, done / duration / (1024 * 1024));
     }
 
-    fclose(fp);
-    return 0;
+    // restore the ring size the device had before the benchmark
+    if (orig_size > 0 && ioctl(fd_wo, IS18_IOC_SET_BUFFER_SIZE, &orig_size)) {
+        perror("IS18_IOC_SET_BUFFER_SIZE");
+        ++num_of_errors;
+    }
+
+    free(buf);
+    close(fd_ro);
+    close(fd_wo);
+    return num_of_errors;
+}
+
+// reads the first max_cpus CPUs of a NUMA node from sysfs (e.g. "0-15,32-47"),
+// returns the number of CPUs or 0 if the node does not exist
+int node_cpus(int node, cpu_set_t* cpus, int max_cpus) {
+    char path[64];
+    char list[1024];
+    char* pos = list;
+    int num = 0;
+    FILE* file;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    if (!(file = fopen(path, "r"))) {
+        return 0;
+    }
+    if (!fgets(list, sizeof(list), file)) {
+        list[0] = '\0';
+    }
+    fclose(file);
+
+    CPU_ZERO(cpus);
+    while (num < max_cpus && *pos >= '0' && *pos <= '9') {
+        int first = strtol(pos, &pos, 10);
+        int last = first;
+        if (*pos == '-') {
+            last = strtol(pos + 1, &pos, 10);
+        }
+        for (int cpu = first; cpu <= last && num < max_cpus; ++cpu, ++num) {
+            CPU_SET(cpu, cpus);
+        }
+        if (*pos == ',') {
+            ++pos;
+        }
+    }
+    return num;
+}
+
+/*
+ *  BENCHMARK ring on the local vs. on remote NUMA nodes
+ *  writer and reader run on two CPUs of node 0, the ring is moved from node to node
+ */
+int bench_numa(char* device) {
+    int num_of_errors = 0;
+    int fd_wo, fd_ro;
+    int orig_size, size = BENCH_NUMA_RING_SIZE;
+    int nodes = 0;
+    cpu_set_t cpus, orig_cpus;
+    char* buf;
+
+    printf("%s", KYEL);
+    printf("# Benchmark NUMA node of the ring\n\n");
+    printf("%s", KNRM);
+
+    if (node_cpus(0, &cpus, 2) < 1) {
+        printf("no NUMA information in sysfs\n");
+        return 1;
+    }
+    // nodes are numbered without gaps on the hosts we care about
+    for (cpu_set_t node_set; nodes < MAX_NODES && node_cpus(nodes, &node_set, 1); ++nodes) {
+    }
+    if (nodes < 2) {
+        printf("only one NUMA node, measuring the local node only\n");
+    }
+
+    if ((fd_wo = open(device, O_WRONLY)) < 0) {
+        perror(device);
+        return 1;
+    }
+    if ((fd_ro = open(device, O_RDONLY)) < 0) {
+        perror(device);
+        close(fd_wo);
+        return 1;
+    }
+    buf = calloc(1, BENCH_CHUNK_SIZE);
+    if (!buf) {
+        close(fd_ro);
+        close(fd_wo);
+        return 1;
+    }
+    orig_size = ioctl(fd_wo, IS18_IOC_BUFFER_SIZE);
+    if (ioctl(fd_wo, IS18_IOC_EMPTY_BUFFER) || ioctl(fd_wo, IS18_IOC_SET_BUFFER_SIZE, &size)) {
+        perror("IS18_IOC_SET_BUFFER_SIZE");
+        ++num_of_errors;
+    }
+
+    // writer (this thread) and reader on node 0, the reader inherits the mask
+    sched_getaffinity(0, sizeof(orig_cpus), &orig_cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus)) {
+        perror("sched_setaffinity");
+        ++num_of_errors;
+    }
+
+    printf("%10s %10s %12s %12s\n", "cpu node", "ring node", "seconds", "MB/s");
+    for (int node = 0; node < nodes; ++node) {
+        size_t done = 0;
+        pthread_t id_reader;
+        struct timespec start, end;
+        struct bench_args arguments = {fd_ro, BENCH_TOTAL_BYTES, BENCH_CHUNK_SIZE, 0};
+        int ring_node;
+
+        if (ioctl(fd_wo, IS18_IOC_SET_NUMA_NODE, &node)) {
+            perror("IS18_IOC_SET_NUMA_NODE");
+            ++num_of_errors;
+            continue;
+        }
+        ring_node = ioctl(fd_wo, IS18_IOC_NUMA_NODE);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pthread_create(&id_reader, NULL, bench_reader_thread, &arguments);
+        while (done < BENCH_TOTAL_BYTES) {
+            ssize_t rv = write(fd_wo, buf, BENCH_CHUNK_SIZE);
+            if (rv <= 0) {
+                printf("ERROR write returned %zd after %zu bytes\n", rv, done);
+                ++num_of_errors;
+                break;
+            }
+            done += rv;
+        }
+        pthread_join(id_reader, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        num_of_errors += arguments.errors;
+
+        double duration = elapsed_sec(&start, &end);
+        printf("%10d %10d %12.3f %12.1f\n", 0, ring_node, duration, done / duration / (1024 * 1024));
+    }
+
+    // back to the node of the writer and the size the device had before
+    size = -1;
+    if (ioctl(fd_wo, IS18_IOC_SET_NUMA_NODE, &size) ||
+        (orig_size > 0 && ioctl(fd_wo, IS18_IOC_SET_BUFFER_SIZE, &orig_size))) {
+        perror("restoring the ring");
+        ++num_of_errors;
+    }
+    sched_setaffinity(0, sizeof(orig_cpus), &orig_cpus);
+
+    free(buf);
+    close(fd_ro);
+    close(fd_wo);
+    return num_of_errors;
+}
+
+/*
+ *  TEST mmap of the ring
+ */
+int testcase_mmap(char* device) {
+    int num_of_errors = 0;
+    int fd = 0;
+    char read_buf[READBUF_SIZE] = {0};
+    char* buf = "hello";
+    int buflen = strlen(buf);
+    long page_size = sysconf(_SC_PAGESIZE);
+    int size;
+    size_t map_len;
+    void* map;
+    struct is18_ring_ctrl* ctrl;
+    char* data;
+    unsigned int head, tail;
+
+    printf("%s", KYEL);
+    printf("# Testcase mmap\n\n");
+    printf("%s", KNRM);
+
+    printf("open %s\n", device);
+    if ((fd = open(device, O_RDWR)) < 0) {
+        perror(device);
+        return 1;
+    }
+    if (ioctl(fd, IS18_IOC_EMPTY_BUFFER)) {
+        printf("clearing buffer did not work");
+        ++num_of_errors;
+    }
+
+    size = ioctl(fd, IS18_IOC_BUFFER_SIZE);
+    map_len = (IS18_MMAP_DATA_PGOFF + (size + page_size - 1) / page_size) * page_size;
+    map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        return 1;
+    }
+    ctrl = map;
+    data = (char*)map + IS18_MMAP_DATA_PGOFF * page_size;
+
+    if (ctrl->buffer_size != (unsigned int)size) {
+        printf("ERROR mapped buffer size is %u, but expected %d\n", ctrl->buffer_size, size);
+        ++num_of_errors;
+    }
+
+    // produce through the mapping, consume with read()
+    head = __atomic_load_n(&ctrl->head, __ATOMIC_RELAXED);
+    for (int i = 0; i < buflen; ++i) {
+        data[(head + i) & (ctrl->buffer_size - 1)] = buf[i];
+    }
+    __atomic_store_n(&ctrl->head, head + buflen, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ctrl->reader_waiting, __ATOMIC_RELAXED)) {
+        ioctl(fd, IS18_IOC_RING_NOTIFY);
+    }
+
+    if (read(fd, read_buf, buflen) != buflen || memcmp(read_buf, buf, buflen)) {
+        printf("ERROR read() did not return the bytes produced through the mapping\n");
+        ++num_of_errors;
+    } else {
+        printf("read() returned the %d bytes produced through the mapping\n", buflen);
+    }
+
+    // produce with write(), consume through the mapping
+    if (write(fd, buf, buflen) != buflen) {
+        printf("ERROR write() failed\n");
+        ++num_of_errors;
+    }
+    head = __atomic_load_n(&ctrl->head, __ATOMIC_ACQUIRE);
+    tail = __atomic_load_n(&ctrl->tail, __ATOMIC_RELAXED);
+    if (head - tail != (unsigned int)buflen) {
+        printf("ERROR mapping shows %u bytes, but expected %d\n", head - tail, buflen);
+        ++num_of_errors;
+    } else {
+        for (int i = 0; i < buflen; ++i) {
+            read_buf[i] = data[(tail + i) & (ctrl->buffer_size - 1)];
+        }
+        __atomic_store_n(&ctrl->tail, tail + buflen, __ATOMIC_RELEASE);
+        if (memcmp(read_buf, buf, buflen)) {
+            printf("ERROR mapping did not show the bytes written with write()\n");
+            ++num_of_errors;
+        } else {
+            printf("mapping showed the %d bytes written with write()\n", buflen);
+        }
+    }
+
+    if (ioctl(fd, IS18_IOC_NUM_BUFFERED_BYTES)) {
+        printf("ERROR buffer should be empty\n");
+        ++num_of_errors;
+    }
+
+    if (ioctl(fd, IS18_IOC_SET_BUFFER_SIZE, &size) == 0) {
+        printf("ERROR resizing a mapped ring should fail\n");
+        ++num_of_errors;
+    }
+
+    munmap(map, map_len);
+    if (close(fd)) {
+        perror(device);
+    }
+    return num_of_errors;
+}
+
+/*
+ *  TEST splice between a pipe and the device
+ */
+int testcase_splice(char* device) {
+    int num_of_errors = 0;
+    int fd = 0;
+    int pipefd[2];
+    char read_buf[READBUF_SIZE] = {0};
+    char* buf = "splice";
+    int buflen = strlen(buf);
+    ssize_t len;
+
+    printf("%s", KYEL);
+    printf("# Testcase splice\n\n");
+    printf("%s", KNRM);
+
+    printf("open %s\n", device);
+    if ((fd = open(device, O_RDWR)) < 0) {
+        perror(device);
+        return 1;
+    }
+    if (pipe(pipefd)) {
+        perror("pipe");
+        close(fd);
+        return 1;
+    }
+    if (ioctl(fd, IS18_IOC_EMPTY_BUFFER)) {
+        printf("clearing buffer did not work");
+        ++num_of_errors;
+    }
+
+    // pipe --> device
+    if (write(pipefd[1], buf, buflen) != buflen) {
+        perror("write pipe");
+        ++num_of_errors;
+    }
+    len = splice(pipefd[0], NULL, fd, NULL, buflen, 0);
+    if (len != buflen) {
+        printf("ERROR spliced %zd bytes into the device, but expected %d\n", len, buflen);
+        ++num_of_errors;
+    }
+    if (read(fd, read_buf, buflen) != buflen || memcmp(read_buf, buf, buflen)) {
+        printf("ERROR read() did not return the spliced bytes\n");
+        ++num_of_errors;
+    } else {
+        printf("spliced %d bytes from a pipe into the device\n", buflen);
+    }
+
+    // device --> pipe
+    if (write(fd, buf, buflen) != buflen) {
+        printf("ERROR write() failed\n");
+        ++num_of_errors;
+    }
+    len = splice(fd, NULL, pipefd[1], NULL, READBUF_SIZE, 0);
+    if (len != buflen) {
+        printf("ERROR spliced %zd bytes out of the device, but expected %d\n", len, buflen);
+        ++num_of_errors;
+    }
+    memset(read_buf, 0, sizeof(read_buf));
+    if (read(pipefd[0], read_buf, buflen) != buflen || memcmp(read_buf, buf, buflen)) {
+        printf("ERROR pipe did not contain the spliced bytes\n");
+        ++num_of_errors;
+    } else {
+        printf("spliced %d bytes from the device into a pipe\n", buflen);
+    }
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+    if (close(fd)) {
+        perror(device);
+    }
+    return num_of_errors;
 }
 
+/*
+ *  TEST packet mode
+ */
+int testcase_packet(char* device) {
+    int num_of_errors = 0;
+    int fd = 0;
+    int orig_size;
+    int size = 16;
+    int packet = 1;
+    char read_buf[READBUF_SIZE] = {0};
+    struct is18_batch batch = {(unsigned long)read_buf, sizeof(read_buf), 0};
+    __u32 len;
+    ssize_t rv;
+
+    printf("%s", KYEL);
+    printf("# Testcase packet mode\n\n");
+    printf("%s", KNRM);
+
+    printf("open %s\n", device);
+    if ((fd = open(device, O_RDWR | O_NONBLOCK)) < 0) {
+        perror(device);
+        return 1;
+    }
+    if (ioctl(fd, IS18_IOC_EMPTY_BUFFER)) {
+        printf("clearing buffer did not work");
+        ++num_of_errors;
+    }
+    // 16 bytes: room for exactly two small messages
+    orig_size = ioctl(fd, IS18_IOC_BUFFER_SIZE);
+    if (ioctl(fd, IS18_IOC_SET_BUFFER_SIZE, &size) || ioctl(fd, IS18_IOC_SET_PACKET_MODE, &packet)) {
+        perror("switching to packet mode");
+        close(fd);
+        return 1;
+    }
+    if (ioctl(fd, IS18_IOC_PACKET_MODE) != 1) {
+        printf("ERROR device is not in packet mode\n");
+        ++num_of_errors;
+    }
+
+    // write boundaries are kept: "abc" (4 + 3 bytes) and "defgh" (4 + 5 bytes)
+    if (write(fd, "abc", 3) != 3 || write(fd, "defgh", 5) != 5) {
+        printf("ERROR writing two messages failed\n");
+        ++num_of_errors;
+    }
+    rv = write(fd, "x", 1);
+    if (rv != -1 || errno != ENOSPC) {
+        printf("ERROR write into a full ring returned %zd, expected ENOSPC\n", rv);
+        ++num_of_errors;
+    }
+    rv = read(fd, read_buf, sizeof(read_buf));
+    if (rv != 3 || memcmp(read_buf, "abc", 3)) {
+        printf("ERROR read returned %zd bytes instead of the first message\n", rv);
+        ++num_of_errors;
+    } else {
+        printf("read one message of %zd bytes\n", rv);
+    }
+    // a too small buffer truncates the message, the rest is discarded
+    rv = read(fd, read_buf, 2);
+    if (rv != 2 || memcmp(read_buf, "de", 2) || ioctl(fd, IS18_IOC_NUM_BUFFERED_BYTES) != 0) {
+        printf("ERROR truncated read returned %zd bytes\n", rv);
+        ++num_of_errors;
+    }
+
+    // all or nothing: 4 + 13 bytes never fit into the ring
+    rv = write(fd, "0123456789abc", 13);
+    if (rv != -1 || errno != EMSGSIZE) {
+        printf("ERROR too large message returned %zd, expected EMSGSIZE\n", rv);
+        ++num_of_errors;
+    }
+
+    // batch read: both messages with their length headers
+    if (write(fd, "ab", 2) != 2 || write(fd, "cde", 3) != 3) {
+        printf("ERROR writing two messages failed\n");
+        ++num_of_errors;
+    }
+    rv = ioctl(fd, IS18_IOC_READ_BATCH, &batch);
+    memcpy(&len, read_buf + IS18_PACKET_HDR_SIZE + 2, sizeof(len));
+    if (rv != 2 * IS18_PACKET_HDR_SIZE + 5 || batch.count != 2 || len != 3 ||
+        memcmp(read_buf + 2 * IS18_PACKET_HDR_SIZE + 2, "cde", 3)) {
+        printf("ERROR batch read returned %zd bytes, %u messages\n", rv, batch.count);
+        ++num_of_errors;
+    } else {
+        printf("read a batch of %u messages (%zd bytes)\n", batch.count, rv);
+    }
+
+    packet = 0;
+    if (ioctl(fd, IS18_IOC_SET_PACKET_MODE, &packet)) {
+        perror("IS18_IOC_SET_PACKET_MODE");
+        ++num_of_errors;
+    }
+    if (orig_size > 0 && ioctl(fd, IS18_IOC_SET_BUFFER_SIZE, &orig_size)) {
+        perror("IS18_IOC_SET_BUFFER_SIZE");
+        ++num_of_errors;
+    }
+    if (close(fd)) {
+        perror(device);
+    }
+    return num_of_errors;
+}
+
+/*
+ *  TEST statistics
+ */
+int testcase_stats(char* device) {
+    int num_of_errors = 0;
+    int fd = 0;
+    char read_buf[READBUF_SIZE] = {0};
+    char* buf = "stats";
+    int buflen = strlen(buf);
+    struct is18_stats before, after;
+
+    printf("%s", KYEL);
+    printf("# Testcase stats\n\n");
+    printf("%s", KNRM);
+
+    printf("open %s\n", device);
+    if ((fd = open(device, O_RDWR | O_NONBLOCK)) < 0) {
+        perror(device);
+        return 1;
+    }
+    if (ioctl(fd, IS18_IOC_EMPTY_BUFFER)) {
+        printf("clearing buffer did not work");
+        ++num_of_errors;
+    }
+    if (ioctl(fd, IS18_IOC_STATS, &before)) {
+        perror("IS18_IOC_STATS");
+        close(fd);
+        return 1;
+    }
+    if (before.version != IS18_STATS_VERSION || before.size != sizeof(before)) {
+        printf("ERROR stats version %u size %u, expected %d and %zu\n", before.version, before.size,
+               IS18_STATS_VERSION, sizeof(before));
+        ++num_of_errors;
+    }
+
+    // one write, one read and one read of the empty ring
+    if (write(fd, buf, buflen) != buflen || read(fd, read_buf, buflen) != buflen || read(fd, read_buf, 1) != 0) {
+        printf("ERROR read/write failed\n");
+        ++num_of_errors;
+    }
+    if (ioctl(fd, IS18_IOC_STATS, &after)) {
+        perror("IS18_IOC_STATS");
+        ++num_of_errors;
+    }
+    if (after.bytes_in - before.bytes_in != (__u64)buflen || after.bytes_out - before.bytes_out != (__u64)buflen ||
+        after.writes - before.writes != 1 || after.reads - before.reads != 2 || after.eagain - before.eagain != 1 ||
+        after.high_water < (__u32)buflen) {
+        printf("ERROR unexpected statistics: in %llu, out %llu, writes %llu, reads %llu, eagain %llu, high water %u\n",
+               after.bytes_in - before.bytes_in, after.bytes_out - before.bytes_out, after.writes - before.writes,
+               after.reads - before.reads, after.eagain - before.eagain, after.high_water);
+        ++num_of_errors;
+    } else {
+        printf("statistics counted %d bytes in and out\n", buflen);
+    }
+    print_file(PROC_STATS_FILE);
+
+    if (close(fd)) {
+        perror(device);
+    }
+    return num_of_errors;
+}
+
+// finds the line of a device and histogram in /proc/is18/latency:
+// "<minor> <histogram> <samples> <p50_ns> <p99_ns> <p999_ns> <buckets...>"
+int read_latency(int minor, const char* histogram, unsigned long long* samples, unsigned long long* p99) {
+    FILE* file = fopen(PROC_LATENCY_FILE, "r");
+    char line[1024];
+    int found = 0;
+
+    if (!file) {
+        perror(PROC_LATENCY_FILE);
+        return 0;
+    }
+    while (!found && fgets(line, sizeof(line), file)) {
+        int dev;
+        char name[32];
+        unsigned long long p50;
+        if (sscanf(line, "%d %31s %llu %llu %llu", &dev, name, samples, &p50, p99) == 5 && dev == minor &&
+            strcmp(name, histogram) == 0) {
+            found = 1;
+        }
+    }
+    fclose(file);
+    return found;
+}
+
+int testcase_latency(char* device) {
+    int num_of_errors = 0;
+    int fd = 0;
+    char read_buf[READBUF_SIZE] = {0};
+    char* buf = "latency";
+    int buflen = strlen(buf);
+    struct stat st;
+    unsigned long long samples = 0, p99 = 0;
+
+    printf("%s", KYEL);
+    printf("# Testcase latency\n\n");
+    printf("%s", KNRM);
+
+    printf("open %s\n", device);
+    if ((fd = open(device, O_RDWR | O_NONBLOCK)) < 0) {
+        perror(device);
+        return 1;
+    }
+    if (fstat(fd, &st)) {
+        perror(device);
+        close(fd);
+        return 1;
+    }
+    if (ioctl(fd, IS18_IOC_EMPTY_BUFFER)) {
+        printf("clearing buffer did not work");
+        ++num_of_errors;
+    }
+    if (ioctl(fd, IS18_IOC_RESET_LATENCY)) {
+        perror("IS18_IOC_RESET_LATENCY");
+        ++num_of_errors;
+    }
+    if (!read_latency(minor(st.st_rdev), "residency", &samples, &p99) || samples) {
+        printf("ERROR residency histogram not found or not reset (%llu samples)\n", samples);
+        ++num_of_errors;
+    }
+
+    // the bytes stay in the ring for 20 ms
+    if (write(fd, buf, buflen) != buflen) {
+        printf("ERROR write failed\n");
+        ++num_of_errors;
+    }
+    usleep(20000);
+    if (read(fd, read_buf, buflen) != buflen) {
+        printf("ERROR read failed\n");
+        ++num_of_errors;
+    }
+    // a bucket is reported with its upper bound --> not below 20 ms
+    if (!read_latency(minor(st.st_rdev), "residency", &samples, &p99) || samples != 1 || p99 < 20000000ULL) {
+        printf("ERROR expected one residency sample of 20 ms, got %llu samples, p99 %llu ns\n", samples, p99);
+        ++num_of_errors;
+    } else {
+        printf("residency p99 <= %llu ns\n", p99);
+    }
+    print_file(PROC_LATENCY_FILE);
+
+    if (close(fd)) {
+        perror(device);
+    }
+    return num_of_errors;
+}
+
+// creates a device at runtime, uses it and removes it again
+// (device is not used, the new device gets any free minor number)
+int testcase_ctl(char* device) {
+    int num_of_errors = 0;
+    int ctl, fd = -1;
+    int minor = -1;
+    char path[64];
+    char read_buf[READBUF_SIZE] = {0};
+    char* buf = "ctl";
+    int buflen = strlen(buf);
+    (void)device;
+
+    printf("%s", KYEL);
+    printf("# Testcase ctl\n\n");
+    printf("%s", KNRM);
+
+    printf("open %s\n", IS18_CTL_DEVICE);
+    if ((ctl = open(IS18_CTL_DEVICE, O_RDWR)) < 0) {
+        perror(IS18_CTL_DEVICE);
+        return 1;
+    }
+    if (ioctl(ctl, IS18_IOC_CREATE_DEVICE, &minor) < 0 || minor < 0) {
+        perror("IS18_IOC_CREATE_DEVICE");
+        close(ctl);
+        return 1;
+    }
+    snprintf(path, sizeof(path), "/dev/is18dev%d", minor);
+    printf("created %s\n", path);
+
+    // udev creates the device file asynchronously
+    for (int i = 0; i < 100 && fd < 0; ++i) {
+        if ((fd = open(path, O_RDWR | O_NONBLOCK)) < 0) {
+            usleep(10000);
+        }
+    }
+    if (fd < 0) {
+        perror(path);
+        ++num_of_errors;
+    } else {
+        if (write(fd, buf, buflen) != buflen || read(fd, read_buf, READBUF_SIZE) != buflen ||
+            strncmp(buf, read_buf, buflen)) {
+            printf("ERROR read/write on the new device failed\n");
+            ++num_of_errors;
+        }
+        if (ioctl(ctl, IS18_IOC_DESTROY_DEVICE, &minor) == 0 || errno != EBUSY) {
+            printf("ERROR destroying an open device has to fail with EBUSY\n");
+            ++num_of_errors;
+        }
+        close(fd);
+    }
+    if (ioctl(ctl, IS18_IOC_DESTROY_DEVICE, &minor)) {
+        perror("IS18_IOC_DESTROY_DEVICE");
+        ++num_of_errors;
+    }
+    if (ioctl(ctl, IS18_IOC_DESTROY_DEVICE, &minor) == 0 || errno != ENODEV) {
+        printf("ERROR destroying an unknown device has to fail with ENODEV\n");
+        ++num_of_errors;
+    }
+    print_file(PROC_FILE);
+
+    close(ctl);
+    return num_of_errors;
+}
+
+/*
+ *  TEST broadcast mode: one writer, two readers with cursors of their own
+ */
+int testcase_broadcast(char* device) {
+    int num_of_errors = 0;
+    int wfd, rfd[2];
+    int orig_size;
+    int size = 16;
+    int mode = IS18_BROADCAST_RELIABLE;
+    int packet = 1;
+    char read_buf[READBUF_SIZE] = {0};
+    __u64 dropped = 0;
+    ssize_t rv;
+
+    printf("%s", KYEL);
+    printf("# Testcase broadcast\n\n");
+    printf("%s", KNRM);
+
+    // the mode is switched by the only writer, before the readers exist
+    printf("open %s\n", device);
+    if ((wfd = open(device, O_WRONLY | O_NONBLOCK)) < 0) {
+        perror(device);
+        return 1;
+    }
+    orig_size = ioctl(wfd, IS18_IOC_BUFFER_SIZE);
+    if (ioctl(wfd, IS18_IOC_EMPTY_BUFFER) || ioctl(wfd, IS18_IOC_SET_BUFFER_SIZE, &size) ||
+        ioctl(wfd, IS18_IOC_SET_BROADCAST, &mode)) {
+        perror("switching to broadcast mode");
+        close(wfd);
+        return 1;
+    }
+    if (ioctl(wfd, IS18_IOC_BROADCAST) != IS18_BROADCAST_RELIABLE) {
+        printf("ERROR device is not in broadcast mode\n");
+        ++num_of_errors;
+    }
+    if (ioctl(wfd, IS18_IOC_SET_PACKET_MODE, &packet) == 0 || errno != EINVAL) {
+        printf("ERROR packet mode has to fail with EINVAL in broadcast mode\n");
+        ++num_of_errors;
+    }
+    rfd[0] = open(device, O_RDONLY | O_NONBLOCK);
+    rfd[1] = open(device, O_RDONLY | O_NONBLOCK);
+    if (rfd[0] < 0 || rfd[1] < 0) {
+        perror(device);
+        close(wfd);
+        return 1;
+    }
+
+    // both readers get every byte, the ring is empty after the slower one
+    if (write(wfd, "hello", 5) != 5) {
+        printf("ERROR write failed\n");
+        ++num_of_errors;
+    }
+    rv = read(rfd[0], read_buf, sizeof(read_buf));
+    if (rv != 5 || strncmp(read_buf, "hello", 5) || ioctl(wfd, IS18_IOC_NUM_BUFFERED_BYTES) != 5) {
+        printf("ERROR first reader got %zd bytes, the ring has to keep them for the second\n", rv);
+        ++num_of_errors;
+    }
+    rv = read(rfd[1], read_buf, sizeof(read_buf));
+    if (rv != 5 || strncmp(read_buf, "hello", 5) || ioctl(wfd, IS18_IOC_NUM_BUFFERED_BYTES) != 0) {
+        printf("ERROR second reader got %zd bytes\n", rv);
+        ++num_of_errors;
+    } else {
+        printf("both readers got 'hello'\n");
+    }
+
+    // reliable: the writer waits for the slowest reader
+    if (write(wfd, "0123456789abcdef", 16) != 16 || read(rfd[0], read_buf, sizeof(read_buf)) != 16) {
+        printf("ERROR filling the ring failed\n");
+        ++num_of_errors;
+    }
+    rv = write(wfd, "x", 1);
+    if (rv != -1 || errno != ENOSPC) {
+        printf("ERROR write returned %zd, the second reader still needs the ring\n", rv);
+        ++num_of_errors;
+    }
+    if (read(rfd[1], read_buf, sizeof(read_buf)) != 16 || write(wfd, "x", 1) != 1 ||
+        read(rfd[0], read_buf, 1) != 1 || read(rfd[1], read_buf, 1) != 1) {
+        printf("ERROR ring was not retired after the second reader\n");
+        ++num_of_errors;
+    }
+
+    // lossy: the writer overwrites what the second reader did not get yet
+    mode = IS18_BROADCAST_LOSSY;
+    if (ioctl(wfd, IS18_IOC_SET_BROADCAST, &mode)) {
+        perror("IS18_IOC_SET_BROADCAST");
+        ++num_of_errors;
+    }
+    if (write(wfd, "0123456789abcdef", 16) != 16 || read(rfd[0], read_buf, sizeof(read_buf)) != 16 ||
+        write(wfd, "XYZ", 3) != 3) {
+        printf("ERROR lossy write failed\n");
+        ++num_of_errors;
+    }
+    if (ioctl(rfd[1], IS18_IOC_DROPPED, &dropped) || dropped != 3) {
+        printf("ERROR second reader dropped %llu bytes, expected 3\n", (unsigned long long)dropped);
+        ++num_of_errors;
+    }
+    rv = read(rfd[1], read_buf, sizeof(read_buf));
+    if (rv != 16 || strncmp(read_buf, "3456789abcdefXYZ", 16)) {
+        printf("ERROR second reader got %zd bytes after the overrun\n", rv);
+        ++num_of_errors;
+    }
+    rv = read(rfd[0], read_buf, sizeof(read_buf));
+    if (rv != 3 || strncmp(read_buf, "XYZ", 3) || ioctl(rfd[0], IS18_IOC_DROPPED, &dropped) || dropped) {
+        printf("ERROR first reader got %zd bytes, dropped %llu\n", rv, (unsigned long long)dropped);
+        ++num_of_errors;
+    } else {
+        printf("lossy: the slow reader lost 3 bytes, the fast one none\n");
+    }
+
+    close(rfd[0]);
+    close(rfd[1]);
+    mode = IS18_BROADCAST_OFF;
+    if (ioctl(wfd, IS18_IOC_SET_BROADCAST, &mode)) {
+        perror("IS18_IOC_SET_BROADCAST");
+        ++num_of_errors;
+    }
+    if (orig_size > 0 && ioctl(wfd, IS18_IOC_SET_BUFFER_SIZE, &orig_size)) {
+        perror("IS18_IOC_SET_BUFFER_SIZE");
+        ++num_of_errors;
+    }
+    print_file(PROC_FILE);
+    close(wfd);
+    return num_of_errors;
+}
+
+/*
+ *  TEST overwrite mode: writes drop the oldest bytes instead of failing
+ */
+int testcase_overwrite(char* device) {
+    int num_of_errors = 0;
+    int fd = 0;
+    int orig_size;
+    int size = 16;
+    int on = 1, off = 0;
+    char read_buf[READBUF_SIZE] = {0};
+    struct is18_stats before, after;
+    ssize_t rv;
+
+    printf("%s", KYEL);
+    printf("# Testcase overwrite\n\n");
+    printf("%s", KNRM);
+
+    printf("open %s\n", device);
+    if ((fd = open(device, O_RDWR | O_NONBLOCK)) < 0) {
+        perror(device);
+        return 1;
+    }
+    orig_size = ioctl(fd, IS18_IOC_BUFFER_SIZE);
+    if (ioctl(fd, IS18_IOC_EMPTY_BUFFER) || ioctl(fd, IS18_IOC_SET_BUFFER_SIZE, &size) ||
+        ioctl(fd, IS18_IOC_SET_OVERWRITE, &on) || ioctl(fd, IS18_IOC_STATS, &before)) {
+        perror("switching to overwrite mode");
+        close(fd);
+        return 1;
+    }
+    if (ioctl(fd, IS18_IOC_OVERWRITE) != 1) {
+        printf("ERROR device is not in overwrite mode\n");
+        ++num_of_errors;
+    }
+
+    // a full ring: the write succeeds, the 3 oldest bytes are gone
+    if (write(fd, "0123456789abcdef", 16) != 16 || write(fd, "XYZ", 3) != 3) {
+        printf("ERROR write into a full ring failed in overwrite mode\n");
+        ++num_of_errors;
+    }
+    rv = read(fd, read_buf, sizeof(read_buf));
+    if (rv != 16 || strncmp(read_buf, "3456789abcdefXYZ", 16)) {
+        printf("ERROR read %zd bytes, expected the 16 newest\n", rv);
+        ++num_of_errors;
+    }
+    // larger than the ring: only the end of the write is kept
+    if (write(fd, "ABCDEFGHIJKLMNOPQRST", 20) != 20 || read(fd, read_buf, sizeof(read_buf)) != 16 ||
+        strncmp(read_buf, "EFGHIJKLMNOPQRST", 16)) {
+        printf("ERROR write larger than the ring did not keep its end\n");
+        ++num_of_errors;
+    }
+
+    // packet mode: whole messages are dropped, "abc" (4 + 3) makes room for "ij" (4 + 2)
+    if (ioctl(fd, IS18_IOC_SET_PACKET_MODE, &on)) {
+        perror("IS18_IOC_SET_PACKET_MODE");
+        ++num_of_errors;
+    }
+    if (write(fd, "abc", 3) != 3 || write(fd, "defgh", 5) != 5 || write(fd, "ij", 2) != 2) {
+        printf("ERROR writing messages failed in overwrite mode\n");
+        ++num_of_errors;
+    }
+    rv = read(fd, read_buf, sizeof(read_buf));
+    if (rv != 5 || strncmp(read_buf, "defgh", 5) || read(fd, read_buf, sizeof(read_buf)) != 2 ||
+        strncmp(read_buf, "ij", 2)) {
+        printf("ERROR the oldest message was not dropped as a whole\n");
+        ++num_of_errors;
+    }
+
+    if (ioctl(fd, IS18_IOC_STATS, &after) || after.overwritten - before.overwritten != 3 + 4 + 7) {
+        printf("ERROR %llu bytes counted as overwritten, expected 14\n",
+               (unsigned long long)(after.overwritten - before.overwritten));
+        ++num_of_errors;
+    } else {
+        printf("overwritten: %llu bytes\n", (unsigned long long)(after.overwritten - before.overwritten));
+    }
+    print_file(PROC_FILE);
+
+    if (ioctl(fd, IS18_IOC_SET_PACKET_MODE, &off) || ioctl(fd, IS18_IOC_SET_OVERWRITE, &off)) {
+        perror("switching back");
+        ++num_of_errors;
+    }
+    if (orig_size > 0 && ioctl(fd, IS18_IOC_SET_BUFFER_SIZE, &orig_size)) {
+        perror("IS18_IOC_SET_BUFFER_SIZE");
+        ++num_of_errors;
+    }
+    close(fd);
+    return num_of_errors;
+}
+
+void* zerocopy_writer_thread(void* args) {
+    struct zerocopy_args* arguments = (struct zerocopy_args*)args;
+
+    // below ZEROCOPY_MIN the ring is used, the order has to be kept anyway
+    if (write(arguments->file, "0123456789", 10) != 10 ||
+        write(arguments->file, arguments->buf, arguments->len) != (ssize_t)arguments->len ||
+        write(arguments->file, "abcdefghij", 10) != 10) {
+        perror("zero copy writer");
+        ++arguments->errors;
+    }
+    return NULL;
+}
+
+/*
+ *  TEST zero copy writes: a large write is copied straight from the pages of
+ *  the writer, small writes before and after it still use the ring
+ */
+int testcase_zerocopy(char* device) {
+    static char read_buf[BENCH_CHUNK_SIZE];
+    int num_of_errors = 0;
+    int fd_wo, fd_ro;
+    int min = ZEROCOPY_MIN, off = 0, invalid = 100;
+    char* expected;
+    size_t total = ZEROCOPY_TEST_SIZE + 20;
+    size_t received = 0;
+    pthread_t id_writer;
+    struct zerocopy_args arguments;
+
+    printf("%s", KYEL);
+    printf("# Testcase zerocopy\n\n");
+    printf("%s", KNRM);
+
+    if ((fd_wo = open(device, O_WRONLY)) < 0) {
+        perror(device);
+        return 1;
+    }
+    if ((fd_ro = open(device, O_RDONLY)) < 0) {
+        perror(device);
+        close(fd_wo);
+        return 1;
+    }
+    expected = malloc(total);
+    if (!expected) {
+        close(fd_ro);
+        close(fd_wo);
+        return 1;
+    }
+    memcpy(expected, "0123456789", 10);
+    for (size_t i = 0; i < ZEROCOPY_TEST_SIZE; ++i) {
+        expected[10 + i] = (char)(i * 7 + i / 4096);
+    }
+    memcpy(expected + 10 + ZEROCOPY_TEST_SIZE, "abcdefghij", 10);
+
+    if (ioctl(fd_wo, IS18_IOC_EMPTY_BUFFER)) {
+        printf("clearing buffer did not work");
+        ++num_of_errors;
+    }
+    if (ioctl(fd_wo, IS18_IOC_SET_ZEROCOPY, &invalid) != -1 || errno != EINVAL) {
+        printf("ERROR a minimum below the page size was accepted\n");
+        ++num_of_errors;
+    }
+    if (ioctl(fd_wo, IS18_IOC_SET_ZEROCOPY, &min) || ioctl(fd_wo, IS18_IOC_ZEROCOPY) != min) {
+        perror("IS18_IOC_SET_ZEROCOPY");
+        free(expected);
+        close(fd_ro);
+        close(fd_wo);
+        return num_of_errors + 1;
+    }
+
+    arguments = (struct zerocopy_args){fd_wo, expected + 10, ZEROCOPY_TEST_SIZE, 0};
+    pthread_create(&id_writer, NULL, zerocopy_writer_thread, &arguments);
+    while (received < total) {
+        ssize_t rv = read(fd_ro, read_buf, sizeof(read_buf));
+
+        if (rv <= 0) {
+            perror("read");
+            ++num_of_errors;
+            break;
+        }
+        if (received + rv > total || memcmp(read_buf, expected + received, rv)) {
+            printf("ERROR wrong data after %zu bytes\n", received);
+            ++num_of_errors;
+            break;
+        }
+        received += rv;
+    }
+    pthread_join(id_writer, NULL);
+    num_of_errors += arguments.errors;
+    printf("received %zu of %zu bytes in order\n", received, total);
+    print_file(PROC_FILE);
+
+    if (ioctl(fd_wo, IS18_IOC_SET_ZEROCOPY, &off)) {
+        perror("IS18_IOC_SET_ZEROCOPY");
+        ++num_of_errors;
+    }
+    free(expected);
+    close(fd_ro);
+    close(fd_wo);
+    return num_of_errors;
+}
+
+// voluntary + nonvoluntary context switches of the calling thread, -1 on error
+long ctxt_switches(void) {
+    char line[128];
+    long sum = 0, n;
+    FILE* f = fopen("/proc/thread-self/status", "r");
+
+    if (!f) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "voluntary_ctxt_switches: %ld", &n) == 1 ||
+            sscanf(line, "nonvoluntary_ctxt_switches: %ld", &n) == 1) {
+            sum += n;
+        }
+    }
+    fclose(f);
+    return sum;
+}
+
+void* wakeup_reader_thread(void* args) {
+    struct wakeup_args* arguments = (struct wakeup_args*)args;
+    char c;
+    long before;
+    int fd = open(arguments->device, O_RDONLY);
+
+    if (fd < 0) {
+        perror(arguments->device);
+        ++arguments->errors;
+        return NULL;
+    }
+    before = ctxt_switches();
+    // one byte per read(): every byte is a wakeup of one reader
+    for (int i = 0; i < WAKEUP_BYTES; ++i) {
+        if (read(fd, &c, 1) != 1) {
+            perror("read");
+            ++arguments->errors;
+            break;
+        }
+    }
+    arguments->switches = ctxt_switches() - before;
+    close(fd);
+    return NULL;
+}
+
+/*
+ *  TEST wakeups: many readers block on the empty ring, the writer stores one
+ *  byte at a time. Only one reader may be woken per byte (exclusive waiters),
+ *  a wake-all would cost every blocked reader a context switch per byte.
+ */
+int testcase_wakeup(char* device) {
+    int num_of_errors = 0;
+    int fd_wo;
+    long switches = 0;
+    size_t total = WAKEUP_READERS * WAKEUP_BYTES;
+    pthread_t ids[WAKEUP_READERS];
+    struct wakeup_args arguments[WAKEUP_READERS];
+
+    printf("%s", KYEL);
+    printf("# Testcase wakeup\n\n");
+    printf("%s", KNRM);
+
+    if ((fd_wo = open(device, O_WRONLY)) < 0) {
+        perror(device);
+        return 1;
+    }
+    if (ioctl(fd_wo, IS18_IOC_EMPTY_BUFFER)) {
+        printf("clearing buffer did not work");
+        ++num_of_errors;
+    }
+    for (int i = 0; i < WAKEUP_READERS; ++i) {
+        arguments[i] = (struct wakeup_args){device, 0, 0};
+        pthread_create(&ids[i], NULL, wakeup_reader_thread, &arguments[i]);
+    }
+    usleep(100000);  // all readers block on the empty ring
+
+    for (size_t i = 0; i < total; ++i) {
+        if (write(fd_wo, "w", 1) != 1) {
+            perror("write");
+            ++num_of_errors;
+            break;
+        }
+        // taken by a reader --> the others are asleep again before the next byte
+        while (ioctl(fd_wo, IS18_IOC_NUM_BUFFERED_BYTES) > 0) {
+            sched_yield();
+        }
+        usleep(100);
+    }
+    for (int i = 0; i < WAKEUP_READERS; ++i) {
+        pthread_join(ids[i], NULL);
+        num_of_errors += arguments[i].errors;
+        switches += arguments[i].switches;
+    }
+    printf("%d readers, %zu bytes: %ld context switches of the readers (%.2f per byte, a wake-all about %d)\n",
+           WAKEUP_READERS, total, switches, (double)switches / total, WAKEUP_READERS);
+    if (switches > (long)total * WAKEUP_READERS / 2) {
+        printf("ERROR every byte woke up most of the readers\n");
+        ++num_of_errors;
+    }
+    close(fd_wo);
+    return num_of_errors;
+}
+
+void* trickle_writer_thread(void* args) {
+    struct trickle_args* arguments = (struct trickle_args*)args;
+
+    for (int i = 0; i < arguments->bytes; ++i) {
+        usleep(arguments->gap_us);
+        if (write(arguments->file, "t", 1) != 1) {
+            perror("write");
+            ++arguments->errors;
+            break;
+        }
+    }
+    return NULL;
+}
+
+/*
+ *  TEST wakeup thresholds: a reader with a low watermark is woken once for
+ *  bytes which trickle in one by one, the max delay ends a read early
+ */
+int testcase_lowat(char* device) {
+    char buf[256];
+    int num_of_errors = 0;
+    int fd_wo, fd_ro;
+    long switches;
+    double ms;
+    ssize_t rv;
+    struct timespec t0, t1;
+    pthread_t id_writer;
+    struct trickle_args arguments;
+    struct is18_wakeup w = {.rcvlowat = LOWAT_BYTES};
+    struct is18_wakeup invalid = {.rcvdelay_us = IS18_WAKEUP_DELAY_MAX + 1};
+    struct is18_wakeup off = {0};
+    struct is18_wakeup got;
+
+    printf("%s", KYEL);
+    printf("# Testcase lowat\n\n");
+    printf("%s", KNRM);
+
+    if ((fd_wo = open(device, O_WRONLY)) < 0) {
+        perror(device);
+        return 1;
+    }
+    if ((fd_ro = open(device, O_RDONLY)) < 0) {
+        perror(device);
+        close(fd_wo);
+        return 1;
+    }
+    if (ioctl(fd_wo, IS18_IOC_EMPTY_BUFFER)) {
+        printf("clearing buffer did not work");
+        ++num_of_errors;
+    }
+    if (ioctl(fd_ro, IS18_IOC_SET_WAKEUP, &invalid) != -1 || errno != EINVAL) {
+        printf("ERROR a delay above IS18_WAKEUP_DELAY_MAX was accepted\n");
+        ++num_of_errors;
+    }
+    if (ioctl(fd_ro, IS18_IOC_SET_WAKEUP, &w) || ioctl(fd_ro, IS18_IOC_WAKEUP, &got) ||
+        got.rcvlowat != LOWAT_BYTES || got.rcvdelay_us || got.sndlowat) {
+        perror("IS18_IOC_SET_WAKEUP");
+        close(fd_ro);
+        close(fd_wo);
+        return num_of_errors + 1;
+    }
+
+    // low watermark: one wakeup for LOWAT_BYTES single byte writes
+    arguments = (struct trickle_args){fd_wo, LOWAT_BYTES, 1000, 0};
+    switches = ctxt_switches();
+    pthread_create(&id_writer, NULL, trickle_writer_thread, &arguments);
+    rv = read(fd_ro, buf, LOWAT_BYTES);
+    switches = ctxt_switches() - switches;
+    pthread_join(id_writer, NULL);
+    num_of_errors += arguments.errors;
+    printf("rcvlowat %d: read %zd bytes with %ld context switches\n", LOWAT_BYTES, rv, switches);
+    if (rv != LOWAT_BYTES) {
+        printf("ERROR read returned %zd\n", rv);
+        ++num_of_errors;
+    }
+    if (switches > LOWAT_BYTES / 4) {
+        printf("ERROR the reader was woken for single bytes\n");
+        ++num_of_errors;
+    }
+
+    // max delay: the read returns what it has although it asked for more
+    w = (struct is18_wakeup){.rcvlowat = sizeof(buf), .rcvdelay_us = LOWAT_DELAY_US};
+    if (ioctl(fd_ro, IS18_IOC_SET_WAKEUP, &w)) {
+        perror("IS18_IOC_SET_WAKEUP");
+        ++num_of_errors;
+    }
+    if (write(fd_wo, "0123456789", 10) != 10) {
+        perror("write");
+        ++num_of_errors;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    rv = read(fd_ro, buf, sizeof(buf));
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+    printf("rcvdelay_us %d: read %zd of %zu bytes after %.1f ms\n", LOWAT_DELAY_US, rv, sizeof(buf), ms);
+    if (rv != 10 || ms < LOWAT_DELAY_US / 2000.0) {
+        printf("ERROR the read did not wait for the delay\n");
+        ++num_of_errors;
+    }
+
+    if (ioctl(fd_ro, IS18_IOC_SET_WAKEUP, &off)) {
+        perror("IS18_IOC_SET_WAKEUP");
+        ++num_of_errors;
+    }
+    close(fd_ro);
+    close(fd_wo);
+    return num_of_errors;
+}
+
+int compare_double(const void* a, const void* b) {
+    double da = *(const double*)a;
+    double db = *(const double*)b;
+    return (da > db) - (da < db);
+}
+
+// p between 0 and 1, values have to be sorted
+double percentile(double* sorted, int num, double p) {
+    int index = (int)(p * (num - 1) + 0.5);
+    return num ? sorted[index] : 0;
+}
+
+// sends CLOCK_MONOTONIC timestamps, one at a time
+void* epoll_writer_thread(void* args) {
+    struct epoll_args* arguments = (struct epoll_args*)args;
+
+    for (int i = 0; i < arguments->iterations; ++i) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (write(arguments->file, &now, sizeof(now)) != sizeof(now)) {
+            printf("ERROR writing timestamp %d\n", i);
+            ++arguments->errors;
+            break;
+        }
+        // wait until the reader got it, so every message is a separate wakeup
+        sem_wait(&arguments->consumed);
+    }
+    return NULL;
+}
+
+/*
+ *  BENCHMARK wakeup latency with edge triggered epoll
+ */
+int bench_epoll(char* device) {
+    int num_of_errors = 0;
+    int fd_wo, fd_ro, epfd;
+    int received = 0;
+    double* latencies;
+    double sum = 0;
+    pthread_t id_writer;
+    struct epoll_event ev;
+    struct epoll_args arguments;
+
+    printf("%s", KYEL);
+    printf("# Benchmark epoll wakeups\n\n");
+    printf("%s", KNRM);
+
+    if ((fd_wo = open(device, O_WRONLY)) < 0) {
+        perror(device);
+        return 1;
+    }
+    if ((fd_ro = open(device, O_RDONLY | O_NONBLOCK)) < 0) {
+        perror(device);
+        close(fd_wo);
+        return 1;
+    }
+    if (ioctl(fd_wo, IS18_IOC_EMPTY_BUFFER)) {
+        printf("clearing buffer did not work");
+        ++num_of_errors;
+    }
+
+    epfd = epoll_create1(0);
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = fd_ro;
+    if (epfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, fd_ro, &ev)) {
+        perror("epoll");
+        close(fd_ro);
+        close(fd_wo);
+        return 1;
+    }
+
+    latencies = malloc(EPOLL_WAKEUPS * sizeof(*latencies));
+    arguments.file = fd_wo;
+    arguments.iterations = EPOLL_WAKEUPS;
+    arguments.errors = 0;
+    sem_init(&arguments.consumed, 0, 0);
+    pthread_create(&id_writer, NULL, epoll_writer_thread, &arguments);
+
+    struct timespec sent, now;
+    size_t got = 0;  // a message may arrive in two parts if the ring wraps
+    while (received < EPOLL_WAKEUPS) {
+        ssize_t rv;
+
+        rv = epoll_wait(epfd, &ev, 1, 1000);
+        if (rv <= 0) {
+            printf("ERROR epoll_wait returned %zd after %d messages\n", rv, received);
+            ++num_of_errors;
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        // edge triggered --> drain the ring until it is empty
+        while ((rv = read(fd_ro, (char*)&sent + got, sizeof(sent) - got)) > 0) {
+            got += rv;
+            if (got == sizeof(sent)) {
+                latencies[received] = elapsed_sec(&sent, &now) * 1e6;
+                sum += latencies[received];
+                ++received;
+                got = 0;
+                sem_post(&arguments.consumed);
+            }
+        }
+    }
+    if (received < EPOLL_WAKEUPS) {
+        // unblock the writer
+        for (int i = received; i < EPOLL_WAKEUPS; ++i) {
+            sem_post(&arguments.consumed);
+        }
+    }
+    pthread_join(id_writer, NULL);
+    num_of_errors += arguments.errors;
+
+    qsort(latencies, received, sizeof(*latencies), compare_double);
+    printf("%d wakeups, latency in usec: min %.1f, avg %.1f, p50 %.1f, p99 %.1f, max %.1f\n",
+           received, received ? latencies[0] : 0, received ? sum / received : 0,
+           percentile(latencies, received, 0.5), percentile(latencies, received, 0.99),
+           received ? latencies[received - 1] : 0);
+
+    free(latencies);
+    sem_destroy(&arguments.consumed);
+    close(epfd);
+    close(fd_ro);
+    close(fd_wo);
+    return num_of_errors;
+}
+
+int  print_file(char* filename)
+{
+    FILE *fp;
+
+    char c;
+
+    // Open file
+    fp = fopen(filename, "r");
+    if (fp == NULL)
+    {
+        printf("Cannot open file \n");
+        return 1;
+
+    }
+
+    c = fgetc(fp);
+    while (c != EOF)
+    {
+        printf ("%c", c);
+        c = fgetc(fp);
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+
+int uring_setup(struct uring* ring, unsigned entries) {
+    struct io_uring_params params;
+    char* sq;
+    char* cq;
+
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return -1;
+    }
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        uring_exit(ring);
+        return -1;
+    }
+    sq = ring->sq_ring;
+    cq = ring->cq_ring;
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+void uring_exit(struct uring* ring) {
+    if (ring->sq_ring != MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->cq_ring != MAP_FAILED) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    close(ring->fd);
+}
+
+// submits one READV/WRITEV and waits for its completion, returns the result
+ssize_t uring_rw(struct uring* ring, int opcode, int fd, struct iovec* iov, int iovcnt) {
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    struct io_uring_cqe* cqe;
+    unsigned head;
+    ssize_t res;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)iov;
+    sqe->len = iovcnt;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    if (syscall(__NR_io_uring_enter, ring->fd, 1, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+        return -1;
+    }
+    head = *ring->cq_head;
+    while (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        // GETEVENTS returned early (signal) --> wait again
+        syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    }
+    cqe = &ring->cqes[head & *ring->cq_mask];
+    res = cqe->res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return res;
+}
+
+// splits the next (at most) BENCH_IOV_CNT * BENCH_IOV_SIZE bytes into records
+int fill_iov(struct iovec* iov, char* buf, size_t remaining) {
+    int cnt = 0;
+
+    while (remaining && cnt < BENCH_IOV_CNT) {
+        iov[cnt].iov_base = buf + cnt * BENCH_IOV_SIZE;
+        iov[cnt].iov_len = remaining < BENCH_IOV_SIZE ? remaining : BENCH_IOV_SIZE;
+        remaining -= iov[cnt].iov_len;
+        ++cnt;
+    }
+    return cnt;
+}
+
+// moves one batch of records with the given method, returns the bytes moved
+ssize_t submit_batch(enum submit_method method, struct uring* ring, int fd, int is_write,
+                     struct iovec* iov, int iovcnt) {
+    ssize_t done = 0;
+
+    switch (method) {
+        case SUBMIT_SCALAR:
+            // one syscall per record
+            for (int i = 0; i < iovcnt; ++i) {
+                ssize_t rv = is_write ? write(fd, iov[i].iov_base, iov[i].iov_len)
+                                      : read(fd, iov[i].iov_base, iov[i].iov_len);
+                if (rv <= 0) {
+                    return done ? done : rv;
+                }
+                done += rv;
+                if ((size_t)rv < iov[i].iov_len) {
+                    break;
+                }
+            }
+            return done;
+        case SUBMIT_VECTORED:
+            return is_write ? writev(fd, iov, iovcnt) : readv(fd, iov, iovcnt);
+        case SUBMIT_IO_URING:
+            return uring_rw(ring, is_write ? IORING_OP_WRITEV : IORING_OP_READV, fd, iov, iovcnt);
+    }
+    return -1;
+}
+
+void* bench_submit_reader(void* args) {
+    struct submit_args* arguments = (struct submit_args*)args;
+    struct iovec iov[BENCH_IOV_CNT];
+    struct uring ring;
+    char* buf = malloc(BENCH_IOV_CNT * BENCH_IOV_SIZE);
+    size_t done = 0;
+
+    if (!buf || (arguments->method == SUBMIT_IO_URING && uring_setup(&ring, 4))) {
+        ++arguments->errors;
+        free(buf);
+        return NULL;
+    }
+    while (done < arguments->total_bytes) {
+        int cnt = fill_iov(iov, buf, arguments->total_bytes - done);
+        ssize_t rv = submit_batch(arguments->method, &ring, arguments->file, 0, iov, cnt);
+        if (rv <= 0) {
+            printf("ERROR read returned %zd after %zu bytes\n", rv, done);
+            ++arguments->errors;
+            break;
+        }
+        done += rv;
+    }
+    if (arguments->method == SUBMIT_IO_URING) {
+        uring_exit(&ring);
+    }
+    free(buf);
+    return NULL;
+}
+
+/*
+ *  BENCHMARK scalar vs. vectored vs. io_uring submission of small records
+ */
+int bench_submit(char* device) {
+    static const char* method_names[] = {"read/write", "readv/writev", "io_uring"};
+    static const enum submit_method methods[] = {SUBMIT_SCALAR, SUBMIT_VECTORED, SUBMIT_IO_URING};
+    int num_of_errors = 0;
+    int fd_wo, fd_ro;
+    int orig_size;
+    int size = 1024 * 1024;
+    char* buf;
+
+    printf("%s", KYEL);
+    printf("# Benchmark submission methods\n\n");
+    printf("%s", KNRM);
+
+    if ((fd_wo = open(device, O_WRONLY)) < 0) {
+        perror(device);
+        return 1;
+    }
+    if ((fd_ro = open(device, O_RDONLY)) < 0) {
+        perror(device);
+        close(fd_wo);
+        return 1;
+    }
+    buf = calloc(BENCH_IOV_CNT, BENCH_IOV_SIZE);
+    if (!buf) {
+        close(fd_ro);
+        close(fd_wo);
+        return 1;
+    }
+
+    orig_size = ioctl(fd_wo, IS18_IOC_BUFFER_SIZE);
+    if (ioctl(fd_wo, IS18_IOC_EMPTY_BUFFER)) {
+        printf("clearing buffer did not work");
+        ++num_of_errors;
+    }
+    if (ioctl(fd_wo, IS18_IOC_SET_BUFFER_SIZE, &size)) {
+        perror("IS18_IOC_SET_BUFFER_SIZE");
+        ++num_of_errors;
+    }
+
+    printf("%d records of %d bytes per batch, ring size %d\n", BENCH_IOV_CNT, BENCH_IOV_SIZE, size);
+    printf("%14s %12s %12s\n", "method", "seconds", "MB/s");
+    for (size_t i = 0; i < sizeof(methods) / sizeof(methods[0]); ++i) {
+        struct iovec iov[BENCH_IOV_CNT];
+        struct uring ring;
+        size_t done = 0;
+        pthread_t id_reader;
+        struct timespec start, end;
+        struct submit_args arguments = {fd_ro, methods[i], BENCH_TOTAL_BYTES, 0};
+
+        if (methods[i] == SUBMIT_IO_URING && uring_setup(&ring, 4)) {
+            perror("io_uring_setup");
+            printf("%14s %12s\n", method_names[i], "skipped");
+            continue;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pthread_create(&id_reader, NULL, bench_submit_reader, &arguments);
+        while (done < BENCH_TOTAL_BYTES) {
+            int cnt = fill_iov(iov, buf, BENCH_TOTAL_BYTES - done);
+            ssize_t rv = submit_batch(methods[i], &ring, fd_wo, 1, iov, cnt);
+            if (rv <= 0) {
+                printf("ERROR write returned %zd after %zu bytes\n", rv, done);
+                ++num_of_errors;
+                break;
+            }
+            done += rv;
+        }
+        pthread_join(id_reader, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        num_of_errors += arguments.errors;
+        if (methods[i] == SUBMIT_IO_URING) {
+            uring_exit(&ring);
+        }
+
+        double duration = elapsed_sec(&start, &end);
+        printf("%14s %12.3f %12.1f\n", method_names[i], duration, done / duration / (1024 * 1024));
+    }
+
+    // restore the ring size the device had before the benchmark
+    if (orig_size > 0 && ioctl(fd_wo, IS18_IOC_SET_BUFFER_SIZE, &orig_size)) {
+        perror("IS18_IOC_SET_BUFFER_SIZE");
+        ++num_of_errors;
+    }
+
+    free(buf);
+    close(fd_ro);
+    close(fd_wo);
+    return num_of_errors;
+}
+
+// receives BENCH_RECORDS records and checks their sequence numbers
+void* bench_record_reader(void* args) {
+    struct record_args* arguments = (struct record_args*)args;
+    static char records[BENCH_MMSG_BATCH][BENCH_RECORD_SIZE];
+    struct is18_msg msgs[BENCH_MMSG_BATCH];
+    struct is18_mmsg mmsg = {(unsigned long)msgs, BENCH_MMSG_BATCH, 0};
+    unsigned int expected = 0;
+
+    for (int i = 0; i < BENCH_MMSG_BATCH; ++i) {
+        msgs[i].buf = (unsigned long)records[i];
+        msgs[i].len = BENCH_RECORD_SIZE;
+    }
+    while (expected < BENCH_RECORDS) {
+        int received;
+
+        if (arguments->use_mmsg) {
+            mmsg.vlen = BENCH_RECORDS - expected < BENCH_MMSG_BATCH ? BENCH_RECORDS - expected : BENCH_MMSG_BATCH;
+            received = ioctl(arguments->file, IS18_IOC_RECV_MMSG, &mmsg);
+        } else {
+            received = read(arguments->file, records[0], BENCH_RECORD_SIZE) == BENCH_RECORD_SIZE ? 1 : -1;
+        }
+        if (received <= 0) {
+            printf("ERROR receiving record %u failed\n", expected);
+            ++arguments->errors;
+            break;
+        }
+        for (int i = 0; i < received; ++i, ++expected) {
+            unsigned int seq;
+            memcpy(&seq, records[i], sizeof(seq));
+            if (seq != expected) {
+                printf("ERROR got record %u, expected %u\n", seq, expected);
+                ++arguments->errors;
+                return NULL;
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ *  BENCHMARK small records: write() per record vs. IS18_IOC_SEND_MMSG batches
+ */
+int bench_small_records(char* device) {
+    static char records[BENCH_MMSG_BATCH][BENCH_RECORD_SIZE];
+    int num_of_errors = 0;
+    int fd_wo, fd_ro;
+    int orig_size;
+    int size = 64 * 1024;
+
+    printf("%s", KYEL);
+    printf("# Benchmark small records\n\n");
+    printf("%s", KNRM);
+
+    if ((fd_wo = open(device, O_WRONLY)) < 0) {
+        perror(device);
+        return 1;
+    }
+    if ((fd_ro = open(device, O_RDONLY)) < 0) {
+        perror(device);
+        close(fd_wo);
+        return 1;
+    }
+
+    orig_size = ioctl(fd_wo, IS18_IOC_BUFFER_SIZE);
+    if (ioctl(fd_wo, IS18_IOC_EMPTY_BUFFER)) {
+        printf("clearing buffer did not work");
+        ++num_of_errors;
+    }
+    if (ioctl(fd_wo, IS18_IOC_SET_BUFFER_SIZE, &size)) {
+        perror("IS18_IOC_SET_BUFFER_SIZE");
+        ++num_of_errors;
+    }
+
+    printf("%d records of %d bytes, ring size %d\n", BENCH_RECORDS, BENCH_RECORD_SIZE, size);
+    printf("%14s %12s %14s\n", "method", "seconds", "records/s");
+    for (int use_mmsg = 0; use_mmsg <= 1; ++use_mmsg) {
+        struct is18_msg msgs[BENCH_MMSG_BATCH];
+        struct is18_mmsg mmsg = {(unsigned long)msgs, 0, 0};
+        unsigned int seq = 0;
+        pthread_t id_reader;
+        struct timespec start, end;
+        struct record_args arguments = {fd_ro, use_mmsg, 0};
+
+        for (int i = 0; i < BENCH_MMSG_BATCH; ++i) {
+            msgs[i].buf = (unsigned long)records[i];
+            msgs[i].len = BENCH_RECORD_SIZE;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pthread_create(&id_reader, NULL, bench_record_reader, &arguments);
+        while (seq < BENCH_RECORDS) {
+            int batch = BENCH_RECORDS - seq < BENCH_MMSG_BATCH ? BENCH_RECORDS - seq : BENCH_MMSG_BATCH;
+            int sent;
+
+            for (int i = 0; i < batch; ++i) {
+                unsigned int record_seq = seq + i;
+                memcpy(records[i], &record_seq, sizeof(record_seq));
+            }
+            if (use_mmsg) {
+                mmsg.vlen = batch;
+                sent = ioctl(fd_wo, IS18_IOC_SEND_MMSG, &mmsg);
+            } else {
+                sent = write(fd_wo, records[0], BENCH_RECORD_SIZE) == BENCH_RECORD_SIZE ? 1 : -1;
+            }
+            if (sent <= 0) {
+                printf("ERROR sending record %u failed\n", seq);
+                ++num_of_errors;
+                break;
+            }
+            seq += sent;
+        }
+        pthread_join(id_reader, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        num_of_errors += arguments.errors;
+
+        double duration = elapsed_sec(&start, &end);
+        printf("%14s %12.3f %14.0f\n", use_mmsg ? "SEND_MMSG" : "write", duration, seq / duration);
+    }
+
+    // restore the ring size the device had before the benchmark
+    if (orig_size > 0 && ioctl(fd_wo, IS18_IOC_SET_BUFFER_SIZE, &orig_size)) {
+        perror("IS18_IOC_SET_BUFFER_SIZE");
+        ++num_of_errors;
+    }
+
+    close(fd_ro);
+    close(fd_wo);
+    return num_of_errors;
+}
+
+void* bench_mpsc_writer(void* args) {
+    struct mpsc_args* arguments = (struct mpsc_args*)args;
+    char record[BENCH_RECORD_SIZE];
+
+    memset(record, arguments->id, sizeof(record));
+    for (unsigned int i = 0; i < arguments->records; ++i) {
+        if (write(arguments->file, record, sizeof(record)) != sizeof(record)) {
+            printf("ERROR writer %u: write failed\n", arguments->id);
+            ++arguments->errors;
+            break;
+        }
+    }
+    return NULL;
+}
+
+/*
+ *  BENCHMARK multiple writers: 1 - 64 writer threads (one fd each) and one
+ *  reader, once with write_lock (locked) and once in MPSC mode. A record is
+ *  torn if it contains bytes of two writers, which must not happen in MPSC mode.
+ */
+int bench_mpsc(char* device) {
+    static struct mpsc_args arguments[BENCH_MPSC_MAX_WRITERS];
+    static char read_buf[BENCH_CHUNK_SIZE];
+    int num_of_errors = 0;
+    int fd;
+    int orig_size;
+    int size = 64 * 1024;
+
+    printf("%s", KYEL);
+    printf("# Benchmark multiple writers\n\n");
+    printf("%s", KNRM);
+
+    // reads, and switches the mode while it is the only writer
+    if ((fd = open(device, O_RDWR)) < 0) {
+        perror(device);
+        return 1;
+    }
+    orig_size = ioctl(fd, IS18_IOC_BUFFER_SIZE);
+    if (ioctl(fd, IS18_IOC_EMPTY_BUFFER) || ioctl(fd, IS18_IOC_SET_BUFFER_SIZE, &size)) {
+        perror("preparing the ring");
+        close(fd);
+        return 1;
+    }
+
+    printf("%d MiB in records of %d bytes, ring size %d\n", BENCH_MPSC_BYTES >> 20, BENCH_RECORD_SIZE, size);
+    printf("%8s %14s %10s %14s %10s\n", "writers", "locked MB/s", "torn", "mpsc MB/s", "torn");
+    for (int writers = 1; writers <= BENCH_MPSC_MAX_WRITERS; writers *= 2) {
+        printf("%8d", writers);
+        for (int mpsc = 0; mpsc <= 1; ++mpsc) {
+            pthread_t ids[BENCH_MPSC_MAX_WRITERS];
+            unsigned int records = BENCH_MPSC_BYTES / BENCH_RECORD_SIZE / writers;
+            size_t total = (size_t)records * writers * BENCH_RECORD_SIZE;
+            size_t received = 0;
+            unsigned long torn = 0;
+            int first = 0;
+            struct timespec start, end;
+
+            if (ioctl(fd, IS18_IOC_SET_MPSC, &mpsc)) {
+                perror("IS18_IOC_SET_MPSC");
+                ++num_of_errors;
+                break;
+            }
+            for (int i = 0; i < writers; ++i) {
+                arguments[i] = (struct mpsc_args){open(device, O_WRONLY), i, records, 0};
+                if (arguments[i].file < 0) {
+                    perror(device);
+                    ++num_of_errors;
+                    arguments[i].records = 0;
+                    total -= (size_t)records * BENCH_RECORD_SIZE;
+                }
+            }
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (int i = 0; i < writers; ++i) {
+                pthread_create(&ids[i], NULL, bench_mpsc_writer, &arguments[i]);
+            }
+            while (received < total) {
+                ssize_t rv = read(fd, read_buf, sizeof(read_buf));
+
+                if (rv <= 0) {
+                    perror("read");
+                    ++num_of_errors;
+                    break;
+                }
+                // every record has to consist of the bytes of one writer
+                for (ssize_t i = 0; i < rv; ++i, ++received) {
+                    if (received % BENCH_RECORD_SIZE == 0) {
+                        first = read_buf[i];
+                    } else if (read_buf[i] != first) {
+                        ++torn;
+                        first = read_buf[i];
+                    }
+                }
+            }
+            for (int i = 0; i < writers; ++i) {
+                pthread_join(ids[i], NULL);
+                num_of_errors += arguments[i].errors;
+                if (arguments[i].file >= 0) {
+                    close(arguments[i].file);
+                }
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+
+            printf(" %14.1f %10lu", received / elapsed_sec(&start, &end) / 1e6, torn);
+            if (mpsc && torn) {
+                ++num_of_errors;
+            }
+        }
+        printf("\n");
+    }
+
+    int off = 0;
+    if (ioctl(fd, IS18_IOC_SET_MPSC, &off)) {
+        perror("IS18_IOC_SET_MPSC");
+        ++num_of_errors;
+    }
+    // restore the ring size the device had before the benchmark
+    if (orig_size > 0 && ioctl(fd, IS18_IOC_SET_BUFFER_SIZE, &orig_size)) {
+        perror("IS18_IOC_SET_BUFFER_SIZE");
+        ++num_of_errors;
+    }
+    close(fd);
+    return num_of_errors;
+}
+
+/*
+ *  BENCHMARK zero copy writes: throughput of writes from 64K to 4M, copied
+ *  through the ring and handed to the reader with IS18_IOC_SET_ZEROCOPY
+ */
+int bench_zerocopy(char* device) {
+    static const size_t write_sizes[] = {64 * 1024, 256 * 1024, 1024 * 1024, 4 * 1024 * 1024};
+    int num_of_errors = 0;
+    int fd_wo, fd_ro;
+    int orig_size;
+    int size = 1024 * 1024;
+    char* buf;
+
+    printf("%s", KYEL);
+    printf("# Benchmark zero copy writes\n\n");
+    printf("%s", KNRM);
+
+    if ((fd_wo = open(device, O_WRONLY)) < 0) {
+        perror(device);
+        return 1;
+    }
+    if ((fd_ro = open(device, O_RDONLY)) < 0) {
+        perror(device);
+        close(fd_wo);
+        return 1;
+    }
+    buf = calloc(1, write_sizes[sizeof(write_sizes) / sizeof(write_sizes[0]) - 1]);
+    if (!buf) {
+        close(fd_ro);
+        close(fd_wo);
+        return 1;
+    }
+
+    orig_size = ioctl(fd_wo, IS18_IOC_BUFFER_SIZE);
+    if (ioctl(fd_wo, IS18_IOC_EMPTY_BUFFER) || ioctl(fd_wo, IS18_IOC_SET_BUFFER_SIZE, &size)) {
+        perror("preparing the ring");
+        ++num_of_errors;
+    }
+
+    printf("%d MiB per run, ring size %d, reads of %d bytes\n", BENCH_TOTAL_BYTES >> 20, size, BENCH_CHUNK_SIZE);
+    printf("%12s %14s %14s\n", "write size", "copy MB/s", "zerocopy MB/s");
+    for (size_t i = 0; i < sizeof(write_sizes) / sizeof(write_sizes[0]); ++i) {
+        printf("%12zu", write_sizes[i]);
+        for (int zerocopy = 0; zerocopy <= 1; ++zerocopy) {
+            int min = zerocopy ? ZEROCOPY_MIN : 0;
+            size_t done = 0;
+            pthread_t id_reader;
+            struct timespec start, end;
+            struct bench_args arguments = {fd_ro, BENCH_TOTAL_BYTES, BENCH_CHUNK_SIZE, 0};
+
+            if (ioctl(fd_wo, IS18_IOC_SET_ZEROCOPY, &min)) {
+                perror("IS18_IOC_SET_ZEROCOPY");
+                ++num_of_errors;
+                break;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            pthread_create(&id_reader, NULL, bench_reader_thread, &arguments);
+            while (done < BENCH_TOTAL_BYTES) {
+                ssize_t rv = write(fd_wo, buf, write_sizes[i]);
+                if (rv <= 0) {
+                    printf("ERROR write returned %zd after %zu bytes\n", rv, done);
+                    ++num_of_errors;
+                    break;
+                }
+                done += rv;
+            }
+            pthread_join(id_reader, NULL);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            num_of_errors += arguments.errors;
+
+            printf(" %14.1f", done / elapsed_sec(&start, &end) / 1e6);
+        }
+        printf("\n");
+    }
+
+    int off = 0;
+    if (ioctl(fd_wo, IS18_IOC_SET_ZEROCOPY, &off)) {
+        perror("IS18_IOC_SET_ZEROCOPY");
+        ++num_of_errors;
+    }
+    // restore the ring size the device had before the benchmark
+    if (orig_size > 0 && ioctl(fd_wo, IS18_IOC_SET_BUFFER_SIZE, &orig_size)) {
+        perror("IS18_IOC_SET_BUFFER_SIZE");
+        ++num_of_errors;
+    }
+    free(buf);
+    close(fd_ro);
+    close(fd_wo);
+    return num_of_errors;
+}
+
+// --msg-size=, --ring-size=, --threads=, --duration=, --cpus=0,2,..,
+// --format=text|json|csv, --out=<file> (results are appended)
+int parse_bench_option(char* arg) {
+    char* value = strchr(arg, '=');
+
+    if (!value) {
+        return 1;
+    }
+    ++value;
+    if (strncmp(arg, "--msg-size=", 11) == 0) {
+        opts.msg_size = strtoul(value, NULL, 0);
+        return opts.msg_size == 0;
+    } else if (strncmp(arg, "--ring-size=", 12) == 0) {
+        opts.ring_size = atoi(value);
+        return opts.ring_size <= 0;
+    } else if (strncmp(arg, "--threads=", 10) == 0) {
+        opts.threads = atoi(value);
+        return opts.threads <= 0 || opts.threads > BENCH_MAX_THREADS;
+    } else if (strncmp(arg, "--duration=", 11) == 0) {
+        opts.duration = atof(value);
+        return opts.duration <= 0;
+    } else if (strncmp(arg, "--cpus=", 7) == 0) {
+        opts.nr_cpus = 0;
+        for (char* cpu = strtok(value, ","); cpu && opts.nr_cpus < BENCH_MAX_CPUS; cpu = strtok(NULL, ",")) {
+            opts.cpus[opts.nr_cpus++] = atoi(cpu);
+        }
+        return 0;
+    } else if (strncmp(arg, "--format=", 9) == 0) {
+        if (strcmp(value, "json") == 0) {
+            opts.format = FORMAT_JSON;
+        } else if (strcmp(value, "csv") == 0) {
+            opts.format = FORMAT_CSV;
+        } else if (strcmp(value, "text") == 0) {
+            opts.format = FORMAT_TEXT;
+        } else {
+            return 1;
+        }
+        return 0;
+    } else if (strncmp(arg, "--out=", 6) == 0) {
+        if (opts.out) {
+            fclose(opts.out);
+        }
+        opts.out = fopen(value, "a");
+        if (!opts.out) {
+            perror(value);
+            return 1;
+        }
+        return 0;
+    }
+    return 1;
+}
+
+// pins the calling thread to the cpu of thread index (--cpus)
+void pin_self(int index) {
+    cpu_set_t cpus;
+
+    if (!opts.nr_cpus) {
+        return;
+    }
+    CPU_ZERO(&cpus);
+    CPU_SET(opts.cpus[index % opts.nr_cpus], &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus)) {
+        perror("sched_setaffinity");
+    }
+}
+
+void lat_add(struct lat_samples* lat, double us) {
+    if (lat->cnt == lat->cap) {
+        size_t cap = lat->cap ? lat->cap * 2 : 4096;
+        double* grown = realloc(lat->us, cap * sizeof(*grown));
+
+        if (!grown) {
+            return;  // the percentiles are computed from the samples so far
+        }
+        lat->us = grown;
+        lat->cap = cap;
+    }
+    lat->us[lat->cnt++] = us;
+}
+
+// prints one run as text, as one JSON object per line or as CSV row
+void print_result(struct bench_result* r) {
+    static int csv_header;
+    FILE* out = opts.out ? opts.out : stdout;
+    int cnt = r->lat->cnt;
+    double mb_per_s = r->bytes / r->seconds / 1e6;
+    double msgs_per_s = r->msgs / r->seconds;
+    double p50, p99, p999;
+
+    qsort(r->lat->us, cnt, sizeof(*r->lat->us), compare_double);
+    p50 = percentile(r->lat->us, cnt, 0.5);
+    p99 = percentile(r->lat->us, cnt, 0.99);
+    p999 = percentile(r->lat->us, cnt, 0.999);
+
+    switch (opts.format) {
+    case FORMAT_JSON:
+        fprintf(out, "{\"bench\": \"%s\", \"msg_size\": %zu, \"ring_size\": %d, \"threads\": %d, "
+                "\"busy_poll\": %d, \"seconds\": %.3f, \"bytes\": %zu, \"msgs\": %zu, "
+                "\"mb_per_s\": %.1f, \"msgs_per_s\": %.0f, \"p50_us\": %.2f, \"p99_us\": %.2f, "
+                "\"p999_us\": %.2f}\n",
+                r->bench, r->msg_size, r->ring_size, r->threads, r->busy_poll, r->seconds, r->bytes,
+                r->msgs, mb_per_s, msgs_per_s, p50, p99, p999);
+        break;
+    case FORMAT_CSV:
+        if (!csv_header++) {
+            fprintf(out, "bench,msg_size,ring_size,threads,busy_poll,seconds,bytes,msgs,"
+                    "mb_per_s,msgs_per_s,p50_us,p99_us,p999_us\n");
+        }
+        fprintf(out, "%s,%zu,%d,%d,%d,%.3f,%zu,%zu,%.1f,%.0f,%.2f,%.2f,%.2f\n", r->bench, r->msg_size,
+                r->ring_size, r->threads, r->busy_poll, r->seconds, r->bytes, r->msgs, mb_per_s,
+                msgs_per_s, p50, p99, p999);
+        break;
+    default:
+        fprintf(out, "%-10s msg %7zu ring %8d threads %2d busy poll %3d: %10.1f MB/s %12.0f msgs/s"
+                "   latency usec p50 %8.1f p99 %8.1f p999 %8.1f\n", r->bench, r->msg_size, r->ring_size,
+                r->threads, r->busy_poll, mb_per_s, msgs_per_s, p50, p99, p999);
+        break;
+    }
+    fflush(out);
+}
+
+// read() until len bytes arrived, returns len or the failed result of read()
+ssize_t read_full(int fd, char* buf, size_t len) {
+    size_t got = 0;
+
+    while (got < len) {
+        ssize_t rv = read(fd, buf + got, len - got);
+        if (rv <= 0) {
+            return rv;
+        }
+        got += rv;
+    }
+    return got;
+}
+
+// sends every message it gets back on the pong device, a message starting
+// with 1 is the last one
+void* pingpong_echo_thread(void* args) {
+    struct pingpong_args* arguments = (struct pingpong_args*)args;
+    char* buf = malloc(arguments->msg_size);
+
+    pin_self(1);
+    do {
+        if (!buf || read_full(arguments->in, buf, arguments->msg_size) != (ssize_t)arguments->msg_size ||
+            write(arguments->out, buf, arguments->msg_size) != (ssize_t)arguments->msg_size) {
+            printf("ERROR echo failed\n");
+            ++arguments->errors;
+            break;
+        }
+    } while (buf[0] != 1);
+    free(buf);
+    return NULL;
+}
+
+/*
+ *  BENCHMARK ping-pong round trip of one message (default 1 byte): ping on
+ *  <device>, pong on a device created via /dev/is18ctl. Once every wait
+ *  sleeps, once all fds spin PINGPONG_BUSY_POLL us first (IS18_IOC_SET_BUSY_POLL).
+ *  Options: --msg-size, --ring-size, --duration, --cpus (this thread, echo thread)
+ */
+int bench_pingpong(char* device) {
+    int num_of_errors = 0;
+    int ctl;
+    int minor = -1;
+    int fds[4] = {-1, -1, -1, -1};  // ping write, ping read, pong write, pong read
+    size_t msg_size = opts.msg_size ? opts.msg_size : 1;
+    char path[64];
+    char* buf;
+    cpu_set_t orig_cpus;
+
+    printf("%s", KYEL);
+    printf("# Benchmark ping-pong\n\n");
+    printf("%s", KNRM);
+
+    if ((ctl = open(IS18_CTL_DEVICE, O_RDWR)) < 0) {
+        perror(IS18_CTL_DEVICE);
+        return 1;
+    }
+    if (ioctl(ctl, IS18_IOC_CREATE_DEVICE, &minor) < 0 || minor < 0) {
+        perror("IS18_IOC_CREATE_DEVICE");
+        close(ctl);
+        return 1;
+    }
+    snprintf(path, sizeof(path), "/dev/is18dev%d", minor);
+    fds[0] = open(device, O_WRONLY);
+    fds[1] = open(device, O_RDONLY);
+    // udev creates the device file asynchronously
+    for (int i = 0; i < 100 && fds[2] < 0; ++i) {
+        if ((fds[2] = open(path, O_WRONLY)) < 0) {
+            usleep(10000);
+        }
+    }
+    fds[3] = open(path, O_RDONLY);
+    buf = calloc(1, msg_size);
+    int orig_size = fds[0] >= 0 ? ioctl(fds[0], IS18_IOC_BUFFER_SIZE) : -1;
+    if (fds[0] < 0 || fds[1] < 0 || fds[2] < 0 || fds[3] < 0 || !buf ||
+        ioctl(fds[0], IS18_IOC_EMPTY_BUFFER)) {
+        perror("preparing the devices");
+        ++num_of_errors;
+        goto out;
+    }
+    if (opts.ring_size && (ioctl(fds[0], IS18_IOC_SET_BUFFER_SIZE, &opts.ring_size) ||
+                           ioctl(fds[2], IS18_IOC_SET_BUFFER_SIZE, &opts.ring_size))) {
+        perror("IS18_IOC_SET_BUFFER_SIZE");
+        ++num_of_errors;
+        goto out;
+    }
+
+    int invalid = -1;
+    if (ioctl(fds[0], IS18_IOC_SET_BUSY_POLL, &invalid) != -1 || errno != EINVAL) {
+        printf("ERROR a negative busy poll time was accepted\n");
+        ++num_of_errors;
+    }
+
+    sched_getaffinity(0, sizeof(orig_cpus), &orig_cpus);
+    pin_self(0);
+    for (int run = 0; run <= 1; ++run) {
+        int us = run ? PINGPONG_BUSY_POLL : 0;
+        pthread_t id_echo;
+        struct timespec start, end, now;
+        struct lat_samples lat = {0};
+        struct pingpong_args arguments = {fds[1], fds[2], msg_size, 0};
+        struct bench_result result = {"pingpong", msg_size, ioctl(fds[0], IS18_IOC_BUFFER_SIZE), 1, us};
+
+        for (int i = 0; i < 4; ++i) {
+            if (ioctl(fds[i], IS18_IOC_SET_BUSY_POLL, &us) || ioctl(fds[i], IS18_IOC_BUSY_POLL) != us) {
+                perror("IS18_IOC_SET_BUSY_POLL");
+                ++num_of_errors;
+            }
+        }
+        pthread_create(&id_echo, NULL, pingpong_echo_thread, &arguments);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        now = start;
+        do {
+            struct timespec sent = now;
+
+            // the last message stops the echo thread
+            buf[0] = elapsed_sec(&start, &now) >= opts.duration;
+            if (write(fds[0], buf, msg_size) != (ssize_t)msg_size ||
+                read_full(fds[3], buf, msg_size) != (ssize_t)msg_size) {
+                printf("ERROR round trip %zu failed\n", result.msgs);
+                ++num_of_errors;
+                // the echo thread may block forever
+                pthread_cancel(id_echo);
+                break;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            lat_add(&lat, elapsed_sec(&sent, &now) * 1e6);
+            ++result.msgs;
+        } while (buf[0] != 1);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        pthread_join(id_echo, NULL);
+        num_of_errors += arguments.errors;
+
+        result.seconds = elapsed_sec(&start, &end);
+        result.bytes = result.msgs * msg_size;
+        result.lat = &lat;
+        print_result(&result);
+        free(lat.us);
+    }
+    sched_setaffinity(0, sizeof(orig_cpus), &orig_cpus);
+
+out:
+    if (orig_size > 0 && opts.ring_size && ioctl(fds[0], IS18_IOC_SET_BUFFER_SIZE, &orig_size)) {
+        perror("IS18_IOC_SET_BUFFER_SIZE");
+        ++num_of_errors;
+    }
+    free(buf);
+    for (int i = 0; i < 4; ++i) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+    if (ioctl(ctl, IS18_IOC_DESTROY_DEVICE, &minor)) {
+        perror("IS18_IOC_DESTROY_DEVICE");
+        ++num_of_errors;
+    }
+    close(ctl);
+    return num_of_errors;
+}
+
+// writes messages until arguments->end, measures every write()
+void* throughput_writer_thread(void* args) {
+    struct throughput_args* arguments = (struct throughput_args*)args;
+    char* buf = calloc(1, arguments->msg_size);
+    struct timespec before, after;
+
+    pin_self(arguments->index);
+    if (!buf) {
+        ++arguments->errors;
+        return NULL;
+    }
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &before);
+        ssize_t rv = write(arguments->file, buf, arguments->msg_size);
+        clock_gettime(CLOCK_MONOTONIC, &after);
+        if (rv != (ssize_t)arguments->msg_size) {
+            printf("ERROR write returned %zd after %zu bytes\n", rv, arguments->bytes);
+            ++arguments->errors;
+            break;
+        }
+        arguments->bytes += rv;
+        lat_add(&arguments->lat, elapsed_sec(&before, &after) * 1e6);
+    } while (elapsed_sec(&after, &arguments->end) > 0);
+    free(buf);
+    return NULL;
+}
+
+// reads until stop is set and final bytes arrived
+void* throughput_reader_thread(void* args) {
+    struct throughput_args* arguments = (struct throughput_args*)args;
+    char* buf = malloc(BENCH_CHUNK_SIZE);
+
+    pin_self(arguments->index);
+    if (!buf) {
+        ++arguments->errors;
+        return NULL;
+    }
+    while (!__atomic_load_n(&arguments->stop, __ATOMIC_ACQUIRE) || arguments->bytes < arguments->final) {
+        ssize_t rv = read(arguments->file, buf, BENCH_CHUNK_SIZE);
+        if (rv <= 0) {
+            printf("ERROR read returned %zd after %zu bytes\n", rv, arguments->bytes);
+            ++arguments->errors;
+            break;
+        }
+        arguments->bytes += rv;
+    }
+    free(buf);
+    return NULL;
+}
+
+// one run of writers threads (one fd each) and one reader thread for
+// --duration seconds, the ring is prepared by the caller
+int run_throughput(char* device, int writers, const char* name) {
+    static struct throughput_args arguments[BENCH_MAX_THREADS + 1];  // reader, writers
+    pthread_t ids[BENCH_MAX_THREADS + 1];
+    size_t msg_size = opts.msg_size ? opts.msg_size : BENCH_MSG_SIZE;
+    struct timespec start, end;
+    struct lat_samples lat = {0};
+    struct bench_result result = {name, msg_size, 0, writers, 0};
+    int num_of_errors = 0;
+    int fd;
+    char last = 0;
+
+    if ((fd = open(device, O_RDWR)) < 0) {
+        perror(device);
+        return 1;
+    }
+    result.ring_size = ioctl(fd, IS18_IOC_BUFFER_SIZE);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    end = start;
+    end.tv_sec += (time_t)opts.duration;
+    end.tv_nsec += (long)((opts.duration - (time_t)opts.duration) * 1e9);
+    if (end.tv_nsec >= 1000000000L) {
+        ++end.tv_sec;
+        end.tv_nsec -= 1000000000L;
+    }
+
+    for (int i = 0; i <= writers; ++i) {
+        arguments[i] = (struct throughput_args){.file = i ? open(device, O_WRONLY) : fd, .index = i,
+                                                .msg_size = msg_size, .end = end};
+        if (arguments[i].file < 0) {
+            perror(device);
+            ++num_of_errors;
+            writers = i - 1;
+            break;
+        }
+        pthread_create(&ids[i], NULL, i ? throughput_writer_thread : throughput_reader_thread, &arguments[i]);
+    }
+    for (int i = 1; i <= writers; ++i) {
+        pthread_join(ids[i], NULL);
+        num_of_errors += arguments[i].errors;
+        result.bytes += arguments[i].bytes;
+        for (size_t j = 0; j < arguments[i].lat.cnt; ++j) {
+            lat_add(&lat, arguments[i].lat.us[j]);
+        }
+        free(arguments[i].lat.us);
+        close(arguments[i].file);
+    }
+    // one more byte wakes up the reader, it stops once everything arrived
+    arguments[0].final = result.bytes + 1;
+    __atomic_store_n(&arguments[0].stop, 1, __ATOMIC_RELEASE);
+    if (write(fd, &last, 1) != 1) {
+        perror("write");
+        ++num_of_errors;
+    }
+    pthread_join(ids[0], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    num_of_errors += arguments[0].errors;
+
+    result.seconds = elapsed_sec(&start, &end);
+    result.msgs = result.bytes / msg_size;
+    result.lat = &lat;
+    print_result(&result);
+    free(lat.us);
+    close(fd);
+    return num_of_errors;
+}
+
+/*
+ *  BENCHMARK streaming throughput: --threads writers (default 1), one reader
+ *  Options: --msg-size, --ring-size, --threads, --duration, --cpus (reader, writers)
+ */
+int bench_throughput(char* device) {
+    int num_of_errors = 0;
+    int fd;
+    int orig_size;
+
+    printf("%s", KYEL);
+    printf("# Benchmark throughput\n\n");
+    printf("%s", KNRM);
+
+    if ((fd = open(device, O_WRONLY)) < 0) {
+        perror(device);
+        return 1;
+    }
+    orig_size = ioctl(fd, IS18_IOC_BUFFER_SIZE);
+    if (ioctl(fd, IS18_IOC_EMPTY_BUFFER) ||
+        (opts.ring_size && ioctl(fd, IS18_IOC_SET_BUFFER_SIZE, &opts.ring_size))) {
+        perror("preparing the ring");
+        close(fd);
+        return 1;
+    }
+
+    num_of_errors += run_throughput(device, opts.threads ? opts.threads : 1, "throughput");
+
+    // restore the ring size the device had before the benchmark
+    if (orig_size > 0 && opts.ring_size && ioctl(fd, IS18_IOC_SET_BUFFER_SIZE, &orig_size)) {
+        perror("IS18_IOC_SET_BUFFER_SIZE");
+        ++num_of_errors;
+    }
+    close(fd);
+    return num_of_errors;
+}
+
+/*
+ *  BENCHMARK scaling: throughput with 1, 2, 4 ... --threads writers (default
+ *  BENCH_SCALING_THREADS) and one reader
+ *  Options: --msg-size, --ring-size, --threads, --duration, --cpus (reader, writers)
+ */
+int bench_scaling(char* device) {
+    int num_of_errors = 0;
+    int max_writers = opts.threads ? opts.threads : BENCH_SCALING_THREADS;
+    int fd;
+    int orig_size;
+
+    printf("%s", KYEL);
+    printf("# Benchmark scaling\n\n");
+    printf("%s", KNRM);
+
+    if ((fd = open(device, O_WRONLY)) < 0) {
+        perror(device);
+        return 1;
+    }
+    orig_size = ioctl(fd, IS18_IOC_BUFFER_SIZE);
+    if (ioctl(fd, IS18_IOC_EMPTY_BUFFER) ||
+        (opts.ring_size && ioctl(fd, IS18_IOC_SET_BUFFER_SIZE, &opts.ring_size))) {
+        perror("preparing the ring");
+        close(fd);
+        return 1;
+    }
+
+    // powers of two, the last run with max_writers
+    for (int writers = 1;; writers *= 2) {
+        writers = writers < max_writers ? writers : max_writers;
+        num_of_errors += run_throughput(device, writers, "scaling");
+        if (writers == max_writers) {
+            break;
+        }
+    }
+
+    // restore the ring size the device had before the benchmark
+    if (orig_size > 0 && opts.ring_size && ioctl(fd, IS18_IOC_SET_BUFFER_SIZE, &orig_size)) {
+        perror("IS18_IOC_SET_BUFFER_SIZE");
+        ++num_of_errors;
+    }
+    close(fd);
+    return num_of_errors;
+}
 
 void print_help() {
     printf("## is18dev_ kernel driver test ##\n\n");
@@ -615,11 +3376,37 @@ void print_help() {
     printf("./testapp <device-file> <mode>\n");
     printf("e.g. >\n\n");
     printf("       ./testapp /dev/is18dev1 ioctl\n\n");
+    printf("       ./testapp /dev/is18dev1 --msg-size=64 --format=json bench_throughput\n\n");
     printf("the following modes/testcases are supported:\n");
     printf(" - 'ioctl': - is testing all the ioctl functionality\n");
     printf(" - 'rw_blocking': - tests reading and writing in blocking mode (multi threaded)\n");
     printf(" - 'rw_nonblocking': - tests reading and writing in non-blocking mode\n");
-    printf(" - 'all': - executes all the above mentioned tests\n\n");
+    printf(" - 'mmap': - tests the ring mapped into user space\n");
+    printf(" - 'splice': - tests splicing between a pipe and the device\n");
+    printf(" - 'packet': - tests the message framed packet mode\n");
+    printf(" - 'stats': - tests the statistics ioctl and /proc/is18/stats\n");
+    printf(" - 'latency': - tests the residency histogram in /proc/is18/latency\n");
+    printf(" - 'ctl': - tests creating and destroying devices via /dev/is18ctl\n");
+    printf(" - 'broadcast': - tests two readers getting every byte (reliable and lossy)\n");
+    printf(" - 'overwrite': - tests dropping the oldest bytes/messages instead of ENOSPC\n");
+    printf(" - 'zerocopy': - tests a large write handed to the reader without the ring\n");
+    printf(" - 'wakeup': - counts the context switches of many blocked readers (one wakeup per byte)\n");
+    printf(" - 'lowat': - tests the low watermark and the max delay of a blocked reader\n");
+    printf(" - 'all': - executes all the above mentioned tests\n");
+    printf(" - 'bench_ringsize': - measures the throughput for different ring sizes\n");
+    printf(" - 'bench_epoll': - measures the wakeup latency of edge triggered epoll\n");
+    printf(" - 'bench_submit': - compares scalar, vectored and io_uring submission\n");
+    printf(" - 'bench_smallrec': - compares write() per record with IS18_IOC_SEND_MMSG batches\n");
+    printf(" - 'bench_numa': - compares the throughput of a ring on the local and on remote NUMA nodes\n");
+    printf(" - 'bench_mpsc': - throughput of 1-64 writer threads, locked and with IS18_IOC_SET_MPSC\n");
+    printf(" - 'bench_zerocopy': - compares copying and zero copy writes of 64K - 4M\n");
+    printf(" - 'bench_pingpong': - round trip latency of one message, sleeping and with IS18_IOC_SET_BUSY_POLL\n");
+    printf(" - 'bench_throughput': - streaming throughput and write() latency of one or more writers\n");
+    printf(" - 'bench_scaling': - bench_throughput with 1, 2, 4 ... writer threads\n\n");
+    printf("options of bench_pingpong, bench_throughput and bench_scaling (in front of the mode):\n");
+    printf(" --msg-size=<bytes> --ring-size=<bytes> --threads=<writers> --duration=<seconds>\n");
+    printf(" --cpus=<cpu>,<cpu>,... (thread i runs on the i-th cpu of the list, the reader first)\n");
+    printf(" --format=text|json|csv --out=<file> (results are appended to the file)\n\n");
     printf("It's also supported to start the test with multiple testmodes, e.g. >\n\n");
     printf("       ./testapp /dev/is18dev1 ioctl rw_blocking\n\n");
     printf("\ngood luck, have fun!\n");